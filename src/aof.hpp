@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "snapshot.hpp"
+
+/*
+    Append-only file: the write commands applied after a snapshot,
+    replayed on top of it at startup.
+    - A 24-byte header: magic, a random id of the file and the id of the
+      snapshot loaded when it was started (0 without one).
+    - Then one record per command, framed like a request on the wire,
+      [u32 length][u32 nstr][u32 len][str]..., so replay parses records
+      like requests. A record running past the end of the file is a
+      write cut short by a crash only if its strings do too.
+    - Records of an event loop iteration are buffered and written with
+      one write() before the loop sleeps. fsync runs on its own thread:
+      after every write with `always`, at most once a second with
+      `everysec`, never with `no`.
+    - A snapshot stores the id and length of the file when it is taken
+      and replay starts there. The part of the file before the last
+      snapshot is given back to the file system by punching a hole over
+      it, so the file is never rewritten.
+*/
+
+const char k_aof_magic[8] = {'K', 'A', 'C', 'H', 'E', 'A', '0', '1'};
+const size_t k_aof_header = 24;
+const uint64_t k_aof_page = 4096; // holes are punched in whole pages
+
+struct AofFile {
+    int fd = -1;
+    uint64_t id = 0;
+    uint64_t offset = 0;      // file length once `buf` is written
+    uint64_t dropped = 0;     // bytes at the start given back
+    std::vector<uint8_t> buf; // records not yet written
+
+    // fsync thread, signals `wake_fd` after each fsync
+    pthread_t thread;
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+    uint64_t sync_want = 0;          // under mu, sync up to here
+    std::atomic<uint64_t> synced{0}; // durable up to here
+    std::atomic<uint64_t> fsyncs{0};
+    std::atomic<uint64_t> fsync_errors{0};
+    int wake_fd = -1;
+};
+
+// ------------------ Writer ------------------------
+
+void aof_put_u32(std::vector<uint8_t> &buf, uint32_t v) {
+    uint8_t tmp[4];
+    memcpy(tmp, &v, 4);
+    buf.insert(buf.end(), tmp, tmp + 4);
+}
+
+// buffer one command as a record
+void aof_append(AofFile &aof, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    aof_put_u32(aof.buf, len);
+    aof_put_u32(aof.buf, (uint32_t)cmd.size());
+    for (const std::string &s : cmd) {
+        aof_put_u32(aof.buf, (uint32_t)s.size());
+        aof.buf.insert(aof.buf.end(), s.begin(), s.end());
+    }
+    aof.offset += 4 + len;
+}
+
+// Write the buffered records, false on an error. What was not written
+// stays buffered for the next try.
+bool aof_write(AofFile &aof) {
+    size_t done = 0;
+    bool ok = true;
+    while (done < aof.buf.size()) {
+        ssize_t rv =
+            write(aof.fd, aof.buf.data() + done, aof.buf.size() - done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            ok = false;
+            break;
+        }
+        done += (size_t)rv;
+    }
+    aof.buf.erase(aof.buf.begin(), aof.buf.begin() + done);
+    return ok;
+}
+
+// bytes handed to the kernel
+uint64_t aof_written(AofFile &aof) { return aof.offset - aof.buf.size(); }
+
+// ------------------ fsync thread ------------------------
+
+void *aof_sync_thread(void *arg) {
+    AofFile &aof = *(AofFile *)arg;
+    uint64_t done = aof.synced;
+    while (true) {
+        pthread_mutex_lock(&aof.mu);
+        while (aof.sync_want <= done) {
+            pthread_cond_wait(&aof.cond, &aof.mu);
+        }
+        uint64_t want = aof.sync_want;
+        pthread_mutex_unlock(&aof.mu);
+
+        // everything written before the request is covered, the writes
+        // of many iterations share one fsync
+        if (fdatasync(aof.fd) == 0) {
+            done = want;
+            aof.synced = want;
+            aof.fsyncs++;
+        } else {
+            aof.fsync_errors++;
+            usleep(10000); // then retried
+        }
+
+        uint64_t one = 1;
+        ssize_t rv = write(aof.wake_fd, &one, sizeof(one));
+        (void)rv;
+    }
+    return NULL;
+}
+
+// ask the thread to sync what is written so far
+void aof_request_sync(AofFile &aof) {
+    uint64_t want = aof_written(aof);
+    pthread_mutex_lock(&aof.mu);
+    if (want > aof.sync_want) {
+        aof.sync_want = want;
+        pthread_cond_signal(&aof.cond);
+    }
+    pthread_mutex_unlock(&aof.mu);
+}
+
+void aof_start_sync(AofFile &aof, int wake_fd) {
+    aof.wake_fd = wake_fd;
+    aof.sync_want = aof.synced = aof.offset;
+    pthread_mutex_init(&aof.mu, NULL);
+    pthread_cond_init(&aof.cond, NULL);
+    pthread_create(&aof.thread, NULL, &aof_sync_thread, &aof);
+}
+
+// ------------------ Files ------------------------
+
+// Start an empty log after snapshot `base`, replacing `path`.
+bool aof_create(const std::string &path, uint64_t base, AofFile &aof) {
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t id = snap_new_id();
+    uint8_t header[k_aof_header];
+    memcpy(header, k_aof_magic, 8);
+    memcpy(header + 8, &id, 8);
+    memcpy(header + 16, &base, 8);
+    bool ok = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    aof.fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    aof.id = id;
+    aof.offset = k_aof_header;
+    aof.dropped = 0;
+    return aof.fd >= 0;
+}
+
+// open an existing log of `size` bytes for appending
+bool aof_reopen(const std::string &path, uint64_t id, uint64_t size,
+                AofFile &aof) {
+    aof.fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    aof.id = id;
+    aof.offset = size;
+    aof.dropped = 0;
+    return aof.fd >= 0;
+}
+
+// Give back the pages before `upto`, already in a snapshot. The first
+// page holds the header and is kept.
+void aof_drop_before(AofFile &aof, uint64_t upto) {
+    uint64_t from = std::max(aof.dropped, k_aof_page);
+    uint64_t to = upto / k_aof_page * k_aof_page;
+    if (to <= from) {
+        return;
+    }
+    if (fallocate(aof.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)from, (off_t)(to - from)) == 0) {
+        aof.dropped = to;
+    }
+}
+
+// ------------------ Reader ------------------------
+
+// the id and base snapshot of a mapped log, false if it is not one
+bool aof_read_header(SnapReader &r, uint64_t &id, uint64_t &base) {
+    const uint8_t *header = snap_get_raw(r, k_aof_header);
+    if (!header || memcmp(header, k_aof_magic, 8) != 0) {
+        return false;
+    }
+    memcpy(&id, header + 8, 8);
+    memcpy(&base, header + 16, 8);
+    return true;
+}
+
+// Whether a record of `len` bytes whose body starts at `p` and runs past
+// `end` was cut short by a crash: its own framing must run past `end`
+// too. If its strings end before, its length is damaged.
+bool aof_cut_short(const uint8_t *p, const uint8_t *end, uint32_t len) {
+    uint64_t avail = (uint64_t)(end - p);
+    if (avail < 4) {
+        return true;
+    }
+    uint32_t nstr = 0;
+    memcpy(&nstr, p, 4);
+    uint64_t pos = 4;
+    for (uint32_t i = 0; i < nstr; i++) {
+        if (pos + 4 > avail) {
+            return pos + 4 <= len; // ends in the string's length
+        }
+        uint32_t n = 0;
+        memcpy(&n, p + pos, 4);
+        pos += 4 + (uint64_t)n;
+        if (pos > len) {
+            return false; // the strings overrun the record
+        }
+        if (pos > avail) {
+            return true;
+        }
+    }
+    return false; // every string is there, the record should have ended
+}
+
+// The next record: 1 with its body, 0 at the end of the file, -1 if
+// the file ends inside it (a write cut short by a crash), -2 if its
+// length runs past the end of the file but its strings do not.
+int aof_next(SnapReader &r, const uint8_t *&body, uint32_t &len) {
+    if (r.p == r.end) {
+        return 0;
+    }
+    const uint8_t *head = snap_get_raw(r, 4);
+    if (!head) {
+        return -1;
+    }
+    memcpy(&len, head, 4);
+    const uint8_t *start = r.p;
+    body = snap_get_raw(r, len);
+    if (body) {
+        return 1;
+    }
+    return aof_cut_short(start, r.end, len) ? -1 : -2;
+}
@@ -0,0 +1,288 @@
+#include "../src/utils.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define PORT_NO 1234
+#define IP_ADDR "127.0.0.1"
+
+/*
+    Cache hit-rate benchmark.
+
+    Replays a Zipf-plus-scan trace against a running server
+    as a cache-aside client: `get` the key and `set` it on a miss.
+    Run the server with a maxmemory limit and the policy under test.
+
+    First checks that a large key freed in the background does not
+    evict other keys or fail the writes that follow it.
+*/
+
+const size_t k_hot_keys = 100000;    // Zipf key universe
+const double k_zipf_s = 0.99;        // Zipf exponent
+const size_t k_zipf_run = 100000;    // Zipf requests between scans
+const size_t k_scan_len = 50000;     // one-hit-wonder keys per scan
+const size_t k_rounds = 10;          // (zipf run + scan) rounds
+const size_t k_batch = 100;          // pipelined requests
+const std::string k_value(100, 'v'); // value stored on a miss
+
+const size_t k_lazy_keep = 200;             // keys that must survive it
+const size_t k_lazy_fields = 1000000;       // hash freed in the thread pool
+const size_t k_lazy_sets = 3000;            // writes sent after the del
+const size_t k_lazy_batch = 10;             // writes per round trip
+const size_t k_lazy_rounds = 3;             // the writes race the free
+const std::string k_lazy_maxmemory = "1gb"; // fits the hash
+
+int connect_to_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT_NO);
+    inet_pton(AF_INET, IP_ADDR, &addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void append_cmd(std::vector<uint8_t> &buf,
+                const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (auto &s : cmd) {
+        len += 4 + s.size();
+    }
+    buf_append_u32(buf, len);
+    buf_append_u32(buf, (uint32_t)cmd.size());
+    for (auto &s : cmd) {
+        buf_append_u32(buf, (uint32_t)s.size());
+        buf_append(buf, (const uint8_t *)s.data(), s.size());
+    }
+}
+
+// read one response, return its status code
+int32_t read_status(int fd) {
+    uint32_t len = 0;
+    if (read_full(fd, (char *)&len, 4)) {
+        return -1;
+    }
+    std::vector<char> body(len);
+    if (read_full(fd, body.data(), len)) {
+        return -1;
+    }
+    uint32_t status = 0;
+    memcpy(&status, body.data(), 4);
+    return (int32_t)status;
+}
+
+// send a batch, collect the status of each command
+bool run_batch(int fd, const std::vector<std::vector<std::string>> &cmds,
+               std::vector<int32_t> &statuses) {
+    std::vector<uint8_t> buf;
+    for (auto &cmd : cmds) {
+        append_cmd(buf, cmd);
+    }
+    if (write_all(fd, (const char *)buf.data(), buf.size())) {
+        return false;
+    }
+
+    statuses.clear();
+    for (size_t i = 0; i < cmds.size(); i++) {
+        statuses.push_back(read_status(fd));
+    }
+    return true;
+}
+
+std::vector<std::string> make_trace() {
+    // Zipf CDF over the hot keys
+    std::vector<double> cdf(k_hot_keys);
+    double sum = 0;
+    for (size_t i = 0; i < k_hot_keys; i++) {
+        sum += 1.0 / std::pow((double)(i + 1), k_zipf_s);
+        cdf[i] = sum;
+    }
+
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uni(0, sum);
+
+    std::vector<std::string> trace;
+    size_t scan_id = 0;
+    for (size_t round = 0; round < k_rounds; round++) {
+        for (size_t i = 0; i < k_zipf_run; i++) {
+            size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uni(rng)) -
+                          cdf.begin();
+            trace.push_back("hot:" + std::to_string(rank));
+        }
+        for (size_t i = 0; i < k_scan_len; i++) {
+            trace.push_back("scan:" + std::to_string(scan_id++));
+        }
+    }
+    return trace;
+}
+
+// run a batch, true if every command got `status`
+bool batch_all(int fd, const std::vector<std::vector<std::string>> &cmds,
+               int32_t status) {
+    std::vector<int32_t> statuses;
+    if (!run_batch(fd, cmds, statuses)) {
+        return false;
+    }
+    return std::all_of(statuses.begin(), statuses.end(),
+                       [&](int32_t s) { return s == status; });
+}
+
+// send one command, read its string reply
+bool call_str(int fd, const std::vector<std::string> &cmd, std::string &out) {
+    std::vector<uint8_t> buf;
+    append_cmd(buf, cmd);
+    if (write_all(fd, (const char *)buf.data(), buf.size())) {
+        return false;
+    }
+    uint32_t len = 0;
+    if (read_full(fd, (char *)&len, 4) || len < 9) {
+        return false;
+    }
+    std::vector<char> body(len);
+    if (read_full(fd, body.data(), len)) {
+        return false;
+    }
+    uint32_t status = 0;
+    memcpy(&status, body.data(), 4);
+    if (status != OK || body[4] != TAG_STR) {
+        return false;
+    }
+    out.assign(body.begin() + 9, body.end());
+    return true;
+}
+
+// One round of the lazy free check: the writes go in small batches so
+// that many land while the hash is still being freed.
+bool check_lazyfree_round(int fd) {
+    std::vector<std::vector<std::string>> keep, hset, writes, cleanup;
+    for (size_t i = 0; i < k_lazy_keep; i++) {
+        keep.push_back({"set", "keep:" + std::to_string(i), k_value});
+    }
+    for (size_t i = 0; i < k_lazy_fields; i += 500) {
+        std::vector<std::string> cmd = {"hset", "lazy:big"};
+        for (size_t j = i; j < i + 500; j++) {
+            cmd.push_back("f" + std::to_string(j));
+            cmd.push_back(std::to_string(j));
+        }
+        hset.push_back(cmd);
+    }
+    if (!batch_all(fd, keep, OK) || !batch_all(fd, hset, OK) ||
+        !batch_all(fd, {{"del", "lazy:big"}}, OK)) {
+        return false;
+    }
+    for (size_t i = 0; i < k_lazy_sets; i++) {
+        std::string key = "lazy:" + std::to_string(i);
+        writes.push_back({"set", key, "x"});
+        cleanup.push_back({"del", key});
+        if (writes.size() == k_lazy_batch || i + 1 == k_lazy_sets) {
+            if (!batch_all(fd, writes, OK)) {
+                return false;
+            }
+            writes.clear();
+        }
+    }
+
+    for (auto &cmd : keep) {
+        cmd = {"get", cmd[1]};
+        cleanup.push_back({"del", cmd[1]});
+    }
+    return batch_all(fd, keep, OK) && batch_all(fd, cleanup, OK);
+}
+
+// runs under a maxmemory the large key fits in, then restores the limit
+bool check_lazyfree(int fd) {
+    std::string maxmemory;
+    if (!call_str(fd, {"config", "get", "maxmemory"}, maxmemory) ||
+        !batch_all(fd, {{"config", "set", "maxmemory", k_lazy_maxmemory}},
+                   OK)) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t round = 0; ok && round < k_lazy_rounds; round++) {
+        ok = check_lazyfree_round(fd);
+    }
+    return batch_all(fd, {{"config", "set", "maxmemory", maxmemory}}, OK) &&
+           ok;
+}
+
+int main() {
+    std::vector<std::string> trace = make_trace();
+
+    int fd = connect_to_server();
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (!check_lazyfree(fd)) {
+        std::cerr << "Lazy free check failed: keys evicted or writes "
+                     "refused while a large key was freed\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "Lazy free check: ok\n";
+
+    size_t hits = 0, hot_hits = 0, hot_total = 0;
+    std::vector<std::vector<std::string>> gets, sets;
+    std::vector<int32_t> statuses;
+
+    auto t_start = std::chrono::high_resolution_clock::now();
+
+    for (size_t i = 0; i < trace.size(); i += k_batch) {
+        size_t end = std::min(trace.size(), i + k_batch);
+
+        gets.clear();
+        for (size_t j = i; j < end; j++) {
+            gets.push_back({"get", trace[j]});
+        }
+        if (!run_batch(fd, gets, statuses)) {
+            std::cerr << "Failed to talk to the server\n";
+            return EXIT_FAILURE;
+        }
+
+        // cache-aside: fill misses
+        sets.clear();
+        for (size_t j = i; j < end; j++) {
+            bool hot = trace[j][0] == 'h';
+            bool hit = statuses[j - i] == OK;
+            hits += hit;
+            hot_hits += hot && hit;
+            hot_total += hot;
+            if (!hit) {
+                sets.push_back({"set", trace[j], k_value});
+            }
+        }
+        if (!sets.empty() && !run_batch(fd, sets, statuses)) {
+            std::cerr << "Failed to talk to the server\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+    double total_time = std::chrono::duration<double>(t_end - t_start).count();
+
+    std::cout << "==========================" << "\n";
+    std::cout << "Requests: " << trace.size() << "\n";
+    std::cout << "Hit rate: " << 100.0 * hits / trace.size() << " %\n";
+    std::cout << "Hot key hit rate: " << 100.0 * hot_hits / hot_total
+              << " %\n";
+    std::cout << "Throughput: " << trace.size() / total_time << " gets/s\n";
+    std::cout << "==========================" << "\n";
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "../src/intset.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <vector>
+
+/*
+    Intset intersection benchmark, in process, no server needed.
+
+    Intersects two random sorted sets of equal size, about half of the
+    members shared, with each kernel and std::set_intersection, then a
+    small set against a large one where galloping pays off.
+    Reports ns per input member, best of k_runs.
+*/
+
+const size_t k_sizes[] = {10000, 100000, 1000000, 10000000};
+const size_t k_small = 1000; // small side of the skewed runs
+const size_t k_runs = 5;
+
+typedef size_t (*Kernel)(const int64_t *, size_t, const int64_t *, size_t,
+                         int64_t *);
+
+// n distinct sorted values, drawn from [0, range)
+std::vector<int64_t> random_set(std::mt19937_64 &rng, size_t n,
+                                int64_t range) {
+    std::uniform_int_distribution<int64_t> dist(0, range - 1);
+    std::vector<int64_t> v;
+    while (v.size() < n) {
+        size_t missing = n - v.size();
+        for (size_t i = 0; i < missing; i++) {
+            v.push_back(dist(rng));
+        }
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+    std::shuffle(v.begin(), v.end(), rng);
+    v.resize(n);
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+size_t std_kernel(const int64_t *a, size_t na, const int64_t *b, size_t nb,
+                  int64_t *out) {
+    return std::set_intersection(a, a + na, b, b + nb, out) - out;
+}
+
+// best time in ns, the result count in n
+double run(Kernel kernel, const std::vector<int64_t> &a,
+           const std::vector<int64_t> &b, size_t &n) {
+    std::vector<int64_t> out(std::min(a.size(), b.size()) + 4);
+    double best = 1e30;
+    for (size_t r = 0; r < k_runs; r++) {
+        auto start = std::chrono::steady_clock::now();
+        n = kernel(a.data(), a.size(), b.data(), b.size(), out.data());
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(
+            best, (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      end - start)
+                      .count());
+    }
+    return best;
+}
+
+int main() {
+    std::mt19937_64 rng(42);
+
+    struct {
+        const char *name;
+        Kernel kernel;
+    } kernels[] = {
+        {"std::set_intersection", &std_kernel},
+        {"scalar merge", &intset_inter_scalar},
+#if defined(__x86_64__)
+        {"avx2 4x4 blocks", &intset_inter_avx2},
+#endif
+        {"gallop", &intset_inter_gallop},
+    };
+#if defined(__x86_64__)
+    if (!intset_has_avx2()) {
+        std::cerr << "CPU without AVX2, skipping that kernel\n";
+        kernels[2].kernel = NULL;
+    }
+#endif
+
+    std::cout << "Equal sizes, ns per input member\n";
+    std::cout << "==========================" << "\n";
+    for (size_t size : k_sizes) {
+        // a range of 1.5x the size shares about half of the members
+        int64_t range = (int64_t)(size * 3 / 2);
+        std::vector<int64_t> a = random_set(rng, size, range);
+        std::vector<int64_t> b = random_set(rng, size, range);
+
+        std::cout << size << " x " << size << "\n";
+        size_t expect = 0;
+        run(&std_kernel, a, b, expect);
+        for (auto &k : kernels) {
+            if (!k.kernel) {
+                continue;
+            }
+            size_t n = 0;
+            double ns = run(k.kernel, a, b, n);
+            printf("  %-22s %6.2f ns%s\n", k.name, ns / (2 * size),
+                   n == expect ? "" : "  WRONG RESULT");
+        }
+    }
+
+    std::cout << "==========================" << "\n";
+    std::cout << k_small << " members against a large set, us per call\n";
+    for (size_t size : k_sizes) {
+        int64_t range = (int64_t)(size * 3 / 2);
+        std::vector<int64_t> a = random_set(rng, k_small, range);
+        std::vector<int64_t> b = random_set(rng, size, range);
+
+        std::cout << k_small << " x " << size << "\n";
+        size_t expect = 0;
+        run(&std_kernel, a, b, expect);
+        for (auto &k : kernels) {
+            if (!k.kernel) {
+                continue;
+            }
+            size_t n = 0;
+            double ns = run(k.kernel, a, b, n);
+            printf("  %-22s %9.1f us%s\n", k.name, ns / 1000,
+                   n == expect ? "" : "  WRONG RESULT");
+        }
+        size_t n = 0;
+        double ns = run(&intset_inter, a, b, n);
+        printf("  %-22s %9.1f us%s\n", "intset_inter (picked)", ns / 1000,
+               n == expect ? "" : "  WRONG RESULT");
+    }
+    return 0;
+}
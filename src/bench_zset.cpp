@@ -0,0 +1,338 @@
+#include "../src/utils.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define PORT_NO 1234
+#define IP_ADDR "127.0.0.1"
+
+/*
+    Sorted set pagination benchmark.
+
+    Loads one large zset three ways and reports members/s:
+    - one zadd per member, pipelined
+    - variadic zadd, many members per request
+    - a single variadic zadd with every member (bulk build)
+
+    Then fetches pages at increasing depths:
+    - zquery from the lowest score with a growing offset
+    - zrange by rank (skipped if the server lacks it)
+    - a full scan in pages, each page seeking past the last member
+    - a full scan with zscan cursors, and the first 100k members
+      in zscan pages against a single zrange
+*/
+
+const size_t k_members = 1000000; // zset size
+const size_t k_page = 1000;       // members per page
+const size_t k_pages = 50;        // pages timed per depth
+const size_t k_load_batch = 1000; // members per round trip
+const size_t k_depths[] = {0, 10000, 100000, 500000, 900000};
+const size_t k_cursor_members = 100000; // zscan vs one zrange
+const char *k_key = "bench:lb";
+
+int connect_to_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT_NO);
+    inet_pton(AF_INET, IP_ADDR, &addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void append_cmd(std::vector<uint8_t> &buf,
+                const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (auto &s : cmd) {
+        len += 4 + s.size();
+    }
+    buf_append_u32(buf, len);
+    buf_append_u32(buf, (uint32_t)cmd.size());
+    for (auto &s : cmd) {
+        buf_append_u32(buf, (uint32_t)s.size());
+        buf_append(buf, (const uint8_t *)s.data(), s.size());
+    }
+}
+
+struct Reply {
+    int32_t status = -1;
+    std::vector<char> body; // status code stripped
+};
+
+bool read_reply(int fd, Reply &reply) {
+    uint32_t len = 0;
+    if (read_full(fd, (char *)&len, 4) || len < 4) {
+        return false;
+    }
+    std::vector<char> body(len);
+    if (read_full(fd, body.data(), len)) {
+        return false;
+    }
+    uint32_t status = 0;
+    memcpy(&status, body.data(), 4);
+    reply.status = (int32_t)status;
+    reply.body.assign(body.begin() + 4, body.end());
+    return true;
+}
+
+bool call(int fd, const std::vector<std::string> &cmd, Reply &reply) {
+    std::vector<uint8_t> buf;
+    append_cmd(buf, cmd);
+    return !write_all(fd, (const char *)buf.data(), buf.size()) &&
+           read_reply(fd, reply);
+}
+
+// last (name, score) pair of an array reply of pairs
+bool last_pair(const Reply &reply, std::string &name, double &score) {
+    const char *p = reply.body.data();
+    const char *end = p + reply.body.size();
+    if (reply.body.size() < 5 || p[0] != TAG_ARR) {
+        return false;
+    }
+    p += 5;
+
+    bool found = false;
+    while (p < end) {
+        if (*p == TAG_STR) {
+            uint32_t len = 0;
+            memcpy(&len, p + 1, 4);
+            name.assign(p + 5, len);
+            p += 5 + len;
+        } else if (*p == TAG_DBL) {
+            memcpy(&score, p + 1, 8);
+            p += 9;
+            found = true;
+        } else {
+            return false;
+        }
+    }
+    return found;
+}
+
+// first element of an array reply, a string
+bool first_str(const Reply &reply, std::string &out) {
+    const char *p = reply.body.data();
+    if (reply.body.size() < 10 || p[0] != TAG_ARR || p[5] != TAG_STR) {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, p + 6, 4);
+    out.assign(p + 10, len);
+    return true;
+}
+
+// zscan from the start until `limit` members or the end, returns the
+// members read and sets the pages, or 0 on failure
+size_t zscan_pages(int fd, size_t limit, size_t &pages) {
+    Reply reply;
+    std::string cursor = "0";
+    size_t members = 0;
+    pages = 0;
+    while (members < limit) {
+        if (!call(fd, {"zscan", k_key, cursor, std::to_string(k_page)},
+                  reply) ||
+            reply.status != OK || !first_str(reply, cursor)) {
+            return 0;
+        }
+        pages++;
+        members += k_page;
+        if (cursor == "0") {
+            break;
+        }
+    }
+    return members;
+}
+
+// Load the members with `per_cmd` of them in each zadd, and `batch` of
+// them per round trip. Returns members/s, or -1 on failure.
+double load(int fd, size_t per_cmd, size_t batch) {
+    std::mt19937_64 rng(42);
+    std::vector<uint8_t> buf;
+    std::vector<std::string> cmd;
+    Reply reply;
+
+    auto t_start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < k_members; i += batch) {
+        buf.clear();
+        size_t ncmds = 0;
+        for (size_t j = i; j < i + batch; j += per_cmd) {
+            cmd = {"zadd", k_key};
+            for (size_t k = j; k < j + per_cmd; k++) {
+                cmd.push_back(std::to_string(rng() % 10000000));
+                cmd.push_back("player:" + std::to_string(k));
+            }
+            append_cmd(buf, cmd);
+            ncmds++;
+        }
+        if (write_all(fd, (const char *)buf.data(), buf.size())) {
+            return -1;
+        }
+        for (size_t j = 0; j < ncmds; j++) {
+            if (!read_reply(fd, reply) || reply.status != OK) {
+                return -1;
+            }
+        }
+    }
+    auto t_end = std::chrono::high_resolution_clock::now();
+    return k_members / std::chrono::duration<double>(t_end - t_start).count();
+}
+
+// command fetching the page at a given rank
+typedef std::vector<std::string> (*PageCmd)(size_t rank);
+
+std::vector<std::string> zquery_page(size_t rank) {
+    // zquery counts the limit in reply elements, 2 per member
+    return {"zquery", k_key, "-inf", "", std::to_string(rank),
+            std::to_string(2 * k_page)};
+}
+
+std::vector<std::string> zrange_page(size_t rank) {
+    return {"zrange", k_key, std::to_string(rank),
+            std::to_string(rank + k_page - 1)};
+}
+
+// Average microseconds per page over consecutive pages from `depth`,
+// so every page touches different members. -1 if unsupported.
+double time_pages(int fd, size_t depth, PageCmd page_cmd) {
+    Reply reply;
+    auto t_start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < k_pages; i++) {
+        size_t rank = (depth + i * k_page) % k_members;
+        if (!call(fd, page_cmd(rank), reply) || reply.status != OK) {
+            return -1;
+        }
+    }
+    auto t_end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::micro>(t_end - t_start)
+               .count() /
+           k_pages;
+}
+
+void print_us(double us) {
+    if (us < 0) {
+        std::cout << "n/a";
+    } else {
+        std::cout << (int64_t)us << " us";
+    }
+}
+
+int main() {
+    int fd = connect_to_server();
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Loading " << k_members << " members...\n";
+    std::cout << "==========================" << "\n";
+    struct {
+        const char *name;
+        size_t per_cmd, batch;
+    } modes[] = {
+        {"one zadd per member", 1, k_load_batch},
+        {"variadic zadd", k_load_batch, k_load_batch},
+        {"single bulk zadd", k_members, k_members},
+    };
+    Reply reply;
+    for (auto &mode : modes) {
+        call(fd, {"del", k_key}, reply);
+        double rate = load(fd, mode.per_cmd, mode.batch);
+        if (rate < 0) {
+            std::cerr << "Failed to talk to the server\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << mode.name << ": " << (size_t)rate << " members/s\n";
+    }
+
+    std::cout << "==========================" << "\n";
+    std::cout << "Page of " << k_page << " members, average of " << k_pages
+              << " consecutive pages\n";
+    for (size_t depth : k_depths) {
+        double zquery = time_pages(fd, depth, zquery_page);
+        double zrange = time_pages(fd, depth, zrange_page);
+
+        std::cout << "depth " << depth << ": zquery ";
+        print_us(zquery);
+        std::cout << ", zrange ";
+        print_us(zrange);
+        std::cout << "\n";
+    }
+
+    // full scan, each page seeks past the last member of the previous one
+    std::string name;
+    double score = -INFINITY;
+    size_t pages = 0;
+    auto t_start = std::chrono::high_resolution_clock::now();
+    while (true) {
+        char from[32];
+        snprintf(from, sizeof(from), "%.17g", score);
+        if (!call(fd,
+                  {"zquery", k_key, from, name, pages ? "1" : "0",
+                   std::to_string(2 * k_page)},
+                  reply) ||
+            reply.status != OK) {
+            std::cerr << "Scan failed\n";
+            return EXIT_FAILURE;
+        }
+        pages++;
+        if (!last_pair(reply, name, score)) {
+            break; // empty page, done
+        }
+    }
+    auto t_end = std::chrono::high_resolution_clock::now();
+    double total = std::chrono::duration<double>(t_end - t_start).count();
+
+    std::cout << "full scan: " << pages << " pages in " << total * 1000
+              << " ms, " << (size_t)(k_members / total) << " members/s\n";
+
+    // the same with zscan cursors
+    t_start = std::chrono::high_resolution_clock::now();
+    if (!zscan_pages(fd, k_members, pages)) {
+        std::cout << "zscan: n/a\n";
+    } else {
+        t_end = std::chrono::high_resolution_clock::now();
+        total = std::chrono::duration<double>(t_end - t_start).count();
+        std::cout << "zscan full scan: " << pages << " pages in "
+                  << total * 1000 << " ms, " << (size_t)(k_members / total)
+                  << " members/s\n";
+
+        // the first members in pages, against one reply with all of them
+        t_start = std::chrono::high_resolution_clock::now();
+        zscan_pages(fd, k_cursor_members, pages);
+        t_end = std::chrono::high_resolution_clock::now();
+        double paged = std::chrono::duration<double, std::milli>(t_end - t_start)
+                           .count();
+
+        t_start = std::chrono::high_resolution_clock::now();
+        call(fd, {"zrange", k_key, "0", std::to_string(k_cursor_members - 1)},
+             reply);
+        t_end = std::chrono::high_resolution_clock::now();
+        double whole = std::chrono::duration<double, std::milli>(t_end - t_start)
+                           .count();
+
+        std::cout << "first " << k_cursor_members << " members: zscan "
+                  << pages << " pages " << paged << " ms, one zrange "
+                  << whole << " ms\n";
+    }
+    std::cout << "==========================" << "\n";
+
+    call(fd, {"del", k_key}, reply);
+    close(fd);
+    return 0;
+}
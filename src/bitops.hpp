@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+    Kernels for bitmaps stored in string values. Bit 0 is the most
+    significant bit of the first byte, as in Redis, so a bitmap reads
+    left to right.
+    - count: set bits in a byte range, the AVX2 version looks up the
+      count of each nibble with a shuffle and sums bytes with sad
+    - find: the first byte other than 0x00 or 0xff, for bitpos
+    - bitop: dst = dst op src over a byte range, or dst = ~src
+    The AVX2 versions are picked at runtime when the CPU has it, so the
+    build needs no -march flag.
+*/
+
+enum {
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3,
+};
+
+// ------------------ Scalar kernels ------------------------
+
+uint64_t bit_count_scalar(const uint8_t *p, size_t n) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, 8);
+        count += __builtin_popcountll(w);
+    }
+    for (; i < n; i++) {
+        count += __builtin_popcount(p[i]);
+    }
+    return count;
+}
+
+// index of the first byte other than `skip`, n if there is none
+size_t bit_find_scalar(const uint8_t *p, size_t n, uint8_t skip) {
+    uint64_t pattern = 0x0101010101010101ull * skip;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, p + i, 8);
+        if (w != pattern) {
+            break;
+        }
+    }
+    for (; i < n && p[i] == skip; i++) {
+    }
+    return i;
+}
+
+void bitop_scalar(int op, uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a = 0, b = 0;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a = op == BITOP_AND ? a & b
+            : op == BITOP_OR ? a | b
+            : op == BITOP_XOR ? a ^ b
+                              : ~b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; i++) {
+        uint8_t a = dst[i], b = src[i];
+        dst[i] = op == BITOP_AND ? a & b
+                 : op == BITOP_OR ? a | b
+                 : op == BITOP_XOR ? a ^ b
+                                   : (uint8_t)~b;
+    }
+}
+
+// ------------------ AVX2 kernels ------------------------
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) uint64_t bit_count_avx2(const uint8_t *p,
+                                                        size_t n) {
+    // bits set in each nibble value
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                         2, 3, 3, 4, //
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                         2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    const size_t blocks = n & ~(size_t)31;
+
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i < blocks) {
+        // byte counters gain at most 8 per block, sum them before they wrap
+        __m256i counts = _mm256_setzero_si256();
+        size_t end = std::min(blocks, i + 31 * 32);
+        for (; i < end; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_and_si256(v, low4);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low4);
+            counts = _mm256_add_epi8(
+                counts, _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                        _mm256_shuffle_epi8(lut, hi)));
+        }
+        total = _mm256_add_epi64(
+            total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *)sums, total);
+    return sums[0] + sums[1] + sums[2] + sums[3] +
+           bit_count_scalar(p + blocks, n - blocks);
+}
+
+__attribute__((target("avx2"))) size_t bit_find_avx2(const uint8_t *p,
+                                                     size_t n, uint8_t skip) {
+    const __m256i vskip = _mm256_set1_epi8((char)skip);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t same =
+            (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vskip));
+        if (same != 0xffffffffu) {
+            return i + __builtin_ctz(~same);
+        }
+    }
+    return i + bit_find_scalar(p + i, n - i, skip);
+}
+
+__attribute__((target("avx2"))) void bitop_avx2(int op, uint8_t *dst,
+                                                const uint8_t *src, size_t n) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    // one loop per op keeps the switch out of the loop body
+    switch (op) {
+    case BITOP_AND:
+        for (; i + 32 <= n; i += 32) {
+            __m256i *d = (__m256i *)(dst + i);
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256(d, _mm256_and_si256(_mm256_loadu_si256(d), s));
+        }
+        break;
+    case BITOP_OR:
+        for (; i + 32 <= n; i += 32) {
+            __m256i *d = (__m256i *)(dst + i);
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256(d, _mm256_or_si256(_mm256_loadu_si256(d), s));
+        }
+        break;
+    case BITOP_XOR:
+        for (; i + 32 <= n; i += 32) {
+            __m256i *d = (__m256i *)(dst + i);
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256(d, _mm256_xor_si256(_mm256_loadu_si256(d), s));
+        }
+        break;
+    default: // BITOP_NOT
+        for (; i + 32 <= n; i += 32) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256((__m256i *)(dst + i),
+                                _mm256_xor_si256(s, ones));
+        }
+        break;
+    }
+    bitop_scalar(op, dst + i, src + i, n - i);
+}
+
+bool bit_has_avx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+#endif
+
+// ------------------ Dispatch ------------------------
+
+// set bits in p[0, n)
+uint64_t bit_count(const uint8_t *p, size_t n) {
+#if defined(__x86_64__)
+    if (bit_has_avx2()) {
+        return bit_count_avx2(p, n);
+    }
+#endif
+    return bit_count_scalar(p, n);
+}
+
+// Position of the first bit equal to `bit` in p[0, n), counted from the
+// start of p, -1 if there is none.
+int64_t bit_pos(const uint8_t *p, size_t n, bool bit) {
+    uint8_t skip = bit ? 0x00 : 0xff;
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (bit_has_avx2()) {
+        i = bit_find_avx2(p, n, skip);
+    } else
+#endif
+    {
+        i = bit_find_scalar(p, n, skip);
+    }
+    if (i == n) {
+        return -1;
+    }
+    // bits of the byte from the most significant one
+    unsigned byte = bit ? p[i] : (uint8_t)~p[i];
+    return (int64_t)(i * 8 + __builtin_clz(byte) - 24);
+}
+
+// dst[i] = dst[i] op src[i] for i < n, dst[i] = ~src[i] for BITOP_NOT
+void bitop(int op, uint8_t *dst, const uint8_t *src, size_t n) {
+#if defined(__x86_64__)
+    if (bit_has_avx2()) {
+        return bitop_avx2(op, dst, src, n);
+    }
+#endif
+    bitop_scalar(op, dst, src, n);
+}
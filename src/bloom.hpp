@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "memory.hpp"
+
+/*
+    Scalable Bloom filters built from blocked filters.
+    - A layer is an array of 64-byte blocks. An element picks one block
+      from the high half of its hash and sets k bits inside it, so every
+      probe touches one cache line.
+    - Blocks fill unevenly, which costs false positives over a classic
+      filter of the same size, so layers are sized with the false
+      positive rate of blocks holding a Poisson number of elements.
+    - Once the last layer holds `capacity` elements, a layer `expansion`
+      times larger is added with half the error rate of the one before,
+      so the rates of all layers sum to less than the filter's rate.
+      A non scaling filter has one layer and refuses elements past it.
+    - Batches of probes prefetch their blocks in every layer first.
+*/
+
+const size_t k_bloom_block_bits = 512;
+const uint32_t k_bloom_max_k = 16;     // bits set per element at most
+const uint64_t k_bloom_max_blocks = 1ull << 32;
+const size_t k_bloom_batch = 32;       // probes prefetched together
+
+struct BloomLayer {
+    uint64_t *blocks;  // nblocks * 8 words, 64-byte aligned
+    void *alloc;       // the allocation holding the blocks
+    uint64_t nblocks;
+    uint32_t k;        // bits set per element
+    uint64_t capacity; // elements before the next layer
+    uint64_t count;    // elements added
+};
+
+struct Bloom {
+    BloomLayer *layers = NULL;
+    uint32_t nlayers = 0;
+    uint32_t expansion = 0; // capacity growth per layer, 0: non scaling
+    double error_rate = 0;
+    size_t mem = 0;         // bytes held by the layers
+};
+
+// ------------------ Sizing ------------------------
+
+// false positive rate of `nblocks` blocks holding `n` elements with k
+// bits each, averaged over the Poisson distribution of block loads
+double bloom_fp_rate(uint64_t n, uint64_t nblocks, uint32_t k) {
+    double lambda = (double)n / (double)nblocks;
+    double spread = 10 * std::sqrt(lambda) + 10;
+    uint64_t lo = (uint64_t)std::max(0.0, lambda - spread);
+    uint64_t hi = (uint64_t)(lambda + spread);
+
+    double rate = 0;
+    for (uint64_t j = lo; j <= hi; j++) {
+        double pmf = std::exp(-lambda + (double)j * std::log(lambda) -
+                              std::lgamma((double)j + 1));
+        double set = 1 - std::pow(1 - 1.0 / k_bloom_block_bits,
+                                  (double)(k * j)); // share of bits set
+        rate += pmf * std::pow(set, (double)k);
+    }
+    return rate;
+}
+
+// blocks and bits per element for `capacity` elements at rate `p`,
+// false if that takes too many blocks
+bool bloom_size(uint64_t capacity, double p, uint64_t &nblocks, uint32_t &k) {
+    double ln2 = std::log(2.0);
+    double bits = -std::log(p) / (ln2 * ln2); // per element, unblocked
+    k = (uint32_t)std::clamp(std::round(bits * ln2), 1.0,
+                             (double)k_bloom_max_k);
+
+    double start = std::ceil((double)capacity * bits / k_bloom_block_bits);
+    if (start >= (double)k_bloom_max_blocks) {
+        return false;
+    }
+    nblocks = std::max((uint64_t)1, (uint64_t)start);
+    while (bloom_fp_rate(capacity, nblocks, k) > p) {
+        nblocks += std::max((uint64_t)1, nblocks / 32);
+        if (nblocks >= k_bloom_max_blocks) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ------------------ Layers ------------------------
+
+// append an empty layer of `nblocks` blocks
+BloomLayer *bloom_push_layer(Bloom *bf, uint64_t nblocks, uint32_t k,
+                             uint64_t capacity) {
+    BloomLayer *layers =
+        (BloomLayer *)mem_alloc((bf->nlayers + 1) * sizeof(BloomLayer));
+    if (bf->layers) {
+        memcpy(layers, bf->layers, bf->nlayers * sizeof(BloomLayer));
+        mem_free(bf->layers);
+    }
+    bf->layers = layers;
+
+    // room to align the blocks to a cache line
+    BloomLayer &l = bf->layers[bf->nlayers++];
+    l.alloc = mem_calloc(nblocks * 64 + 63, 1);
+    l.blocks = (uint64_t *)(((uintptr_t)l.alloc + 63) & ~(uintptr_t)63);
+    l.nblocks = nblocks;
+    l.k = k;
+    l.capacity = capacity;
+    l.count = 0;
+    bf->mem += mem_usable(l.alloc);
+    return &l;
+}
+
+bool bloom_add_layer(Bloom *bf, uint64_t capacity, double p) {
+    uint64_t nblocks = 0;
+    uint32_t k = 0;
+    if (!bloom_size(capacity, p, nblocks, k)) {
+        return false;
+    }
+    bloom_push_layer(bf, nblocks, k, capacity);
+    return true;
+}
+
+// the block of an element in a layer
+uint64_t *bloom_block(BloomLayer &l, uint64_t hash) {
+    return l.blocks + 8 * (((hash >> 32) * l.nblocks) >> 32);
+}
+
+// Bit positions are the top 9 bits of the hash multiplied again for each
+// one. Stepping by a second hash (double hashing) repeats whole patterns
+// within 512 bits often enough to put a floor under the error rate.
+uint64_t bloom_next_bit(uint64_t &h) {
+    h *= 0x9e3779b97f4a7c15ull;
+    return h >> 55;
+}
+
+bool bloom_layer_has(BloomLayer &l, uint64_t hash) {
+    const uint64_t *block = bloom_block(l, hash);
+    uint64_t h = hash;
+    for (uint32_t i = 0; i < l.k; i++) {
+        uint64_t bit = bloom_next_bit(h);
+        if (!(block[bit / 64] & (1ull << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bloom_layer_set(BloomLayer &l, uint64_t hash) {
+    uint64_t *block = bloom_block(l, hash);
+    uint64_t h = hash;
+    for (uint32_t i = 0; i < l.k; i++) {
+        uint64_t bit = bloom_next_bit(h);
+        block[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+// ------------------ Bloom functions ------------------------
+
+// the first layer, false if the filter would be too large
+bool bloom_init(Bloom *bf, uint64_t capacity, double error_rate,
+                uint32_t expansion) {
+    bf->expansion = expansion;
+    bf->error_rate = error_rate;
+    return bloom_add_layer(bf, capacity, expansion ? error_rate / 2
+                                                   : error_rate);
+}
+
+// elements added
+uint64_t bloom_count(Bloom *bf) {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        n += bf->layers[i].count;
+    }
+    return n;
+}
+
+bool bloom_has(Bloom *bf, uint64_t hash) {
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        if (bloom_layer_has(bf->layers[i], hash)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add an element, returns 1 if it is new, 0 if it may be present, -1 if
+// a non scaling filter is full or the next layer would be too large.
+int bloom_add(Bloom *bf, uint64_t hash) {
+    if (bloom_has(bf, hash)) {
+        return 0;
+    }
+
+    BloomLayer *last = &bf->layers[bf->nlayers - 1];
+    if (last->count >= last->capacity) {
+        double p = bf->error_rate / std::pow(2.0, bf->nlayers + 1);
+        if (!bf->expansion ||
+            !bloom_add_layer(bf, last->capacity * bf->expansion, p)) {
+            return -1;
+        }
+        last = &bf->layers[bf->nlayers - 1];
+    }
+    bloom_layer_set(*last, hash);
+    last->count++;
+    return 1;
+}
+
+void bloom_prefetch(Bloom *bf, uint64_t hash) {
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        __builtin_prefetch(bloom_block(bf->layers[i], hash));
+    }
+}
+
+// bloom_add() for many elements, the blocks of a batch are prefetched
+// before any is probed
+void bloom_madd(Bloom *bf, const uint64_t *hashes, size_t n, int *res) {
+    for (size_t start = 0; start < n; start += k_bloom_batch) {
+        size_t end = std::min(n, start + k_bloom_batch);
+        for (size_t i = start; i < end; i++) {
+            bloom_prefetch(bf, hashes[i]);
+        }
+        for (size_t i = start; i < end; i++) {
+            res[i] = bloom_add(bf, hashes[i]);
+        }
+    }
+}
+
+// bloom_has() for many elements, prefetched like bloom_madd()
+void bloom_mhas(Bloom *bf, const uint64_t *hashes, size_t n, int *res) {
+    for (size_t start = 0; start < n; start += k_bloom_batch) {
+        size_t end = std::min(n, start + k_bloom_batch);
+        for (size_t i = start; i < end; i++) {
+            bloom_prefetch(bf, hashes[i]);
+        }
+        for (size_t i = start; i < end; i++) {
+            res[i] = bloom_has(bf, hashes[i]);
+        }
+    }
+}
+
+void bloom_clear(Bloom *bf) {
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        mem_free(bf->layers[i].alloc);
+    }
+    mem_free(bf->layers);
+    *bf = Bloom{};
+}
+
+// bytes held by the filter and its layers
+size_t bloom_mem(Bloom *bf) {
+    return sizeof(Bloom) + bf->nlayers * sizeof(BloomLayer) + bf->mem;
+}
+
+// ------------------ Defrag ------------------------
+
+// Move the layer array and small layers out of sparse slabs. A moved
+// layer may land at another offset from a cache line, its blocks are
+// shifted to stay aligned.
+void bloom_defrag(Bloom *bf, size_t &moved) {
+    if (void *layers = mem_defrag(bf->layers)) {
+        bf->layers = (BloomLayer *)layers;
+        moved++;
+    }
+
+    for (uint32_t i = 0; i < bf->nlayers; i++) {
+        BloomLayer &l = bf->layers[i];
+        size_t offset = (char *)l.blocks - (char *)l.alloc;
+        void *copy = mem_defrag(l.alloc);
+        if (!copy) {
+            continue;
+        }
+        char *blocks = (char *)(((uintptr_t)copy + 63) & ~(uintptr_t)63);
+        memmove(blocks, (char *)copy + offset, l.nblocks * 64);
+        l.alloc = copy;
+        l.blocks = (uint64_t *)blocks;
+        moved++;
+    }
+}
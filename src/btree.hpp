@@ -0,0 +1,884 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "memory.hpp"
+
+/*
+    B+tree index for sorted sets:
+    - Leaves hold (score, ZNode *) pairs in (score, name) order. Scores are
+      stored contiguously, so finding a slot is a branch-free pass over a
+      few cache lines that the compiler vectorizes.
+    - Inner nodes keep the max key and the pair count of every child,
+      so seeks and rank/offset lookups visit one node per level.
+    - Leaves are chained for range scans.
+    - An underfull node is merged with a sibling when both fit in one node.
+    - A rank range is cut out by splitting the tree twice and joining the
+      outer parts, touching O(log n) nodes.
+*/
+
+struct ZNode;
+
+// ordering of a member against (score, name), defined in zset.hpp
+bool zless(ZNode *node, double score, const char *name, size_t len);
+
+// sized so both node kinds fill a 640-byte slab class
+const uint32_t k_bt_leaf = 38;  // pairs per leaf
+const uint32_t k_bt_inner = 19; // children per inner node
+
+struct BNode {
+    uint32_t n = 0; // used slots
+    bool leaf = false;
+};
+
+struct BLeaf {
+    BNode hdr;
+    BLeaf *prev;
+    BLeaf *next;
+    double scores[k_bt_leaf];
+    ZNode *items[k_bt_leaf];
+};
+
+struct BInner {
+    BNode hdr;
+    double scores[k_bt_inner]; // max pair of each child
+    ZNode *keys[k_bt_inner];
+    size_t counts[k_bt_inner]; // pairs under each child
+    BNode *child[k_bt_inner];
+};
+
+struct BTree {
+    BNode *root = NULL;
+    size_t size = 0; // pairs
+    size_t mem = 0;  // bytes held by tree nodes
+};
+
+// a pair for bulk building
+struct BPair {
+    double score;
+    ZNode *item;
+};
+
+// a position in the tree, invalidated by any write
+struct BIter {
+    BLeaf *leaf = NULL; // NULL past either end
+    uint32_t pos = 0;
+};
+
+// ---------------- Nodes ----------------
+
+BLeaf *bt_leaf_new(BTree *tree) {
+    BLeaf *leaf = (BLeaf *)mem_alloc(sizeof(BLeaf));
+    leaf->hdr.n = 0;
+    leaf->hdr.leaf = true;
+    leaf->prev = leaf->next = NULL;
+    tree->mem += mem_usable(leaf);
+    return leaf;
+}
+
+BInner *bt_inner_new(BTree *tree) {
+    BInner *inner = (BInner *)mem_alloc(sizeof(BInner));
+    inner->hdr.n = 0;
+    inner->hdr.leaf = false;
+    tree->mem += mem_usable(inner);
+    return inner;
+}
+
+void bt_node_del(BTree *tree, BNode *node) {
+    tree->mem -= mem_usable(node);
+    mem_free(node);
+}
+
+// pairs under a node
+size_t bt_count(BNode *node) {
+    if (node->leaf) {
+        return node->n;
+    }
+    BInner *inner = (BInner *)node;
+    size_t n = 0;
+    for (uint32_t i = 0; i < node->n; i++) {
+        n += inner->counts[i];
+    }
+    return n;
+}
+
+// largest pair of a non-empty node
+void bt_max(BNode *node, double &score, ZNode *&item) {
+    uint32_t last = node->n - 1;
+    if (node->leaf) {
+        score = ((BLeaf *)node)->scores[last];
+        item = ((BLeaf *)node)->items[last];
+    } else {
+        score = ((BInner *)node)->scores[last];
+        item = ((BInner *)node)->keys[last];
+    }
+}
+
+// first slot whose pair is not less than (score, name)
+uint32_t bt_lower(const double *scores, ZNode *const *items, uint32_t n,
+                  double score, const char *name, size_t len) {
+    // count smaller scores without branches, so this vectorizes
+    uint32_t i = 0;
+    for (uint32_t j = 0; j < n; j++) {
+        i += scores[j] < score;
+    }
+    // ties on score are ordered by name
+    while (i < n && scores[i] == score && zless(items[i], score, name, len)) {
+        i++;
+    }
+    return i;
+}
+
+// slots with a score below `score`, or not above it if `inclusive`
+uint32_t bt_lower_score(const double *scores, uint32_t n, double score,
+                        bool inclusive) {
+    uint32_t i = 0;
+    if (inclusive) {
+        for (uint32_t j = 0; j < n; j++) {
+            i += scores[j] <= score;
+        }
+    } else {
+        for (uint32_t j = 0; j < n; j++) {
+            i += scores[j] < score;
+        }
+    }
+    return i;
+}
+
+// bt_lower() for a pair known to be in the slots, stops at `item` by
+// identity so it is never dereferenced
+uint32_t bt_lower_ref(const double *scores, ZNode *const *items, uint32_t n,
+                      double score, ZNode *item, const char *name,
+                      size_t len) {
+    uint32_t i = 0;
+    for (uint32_t j = 0; j < n; j++) {
+        i += scores[j] < score;
+    }
+    while (i < n && scores[i] == score && items[i] != item &&
+           zless(items[i], score, name, len)) {
+        i++;
+    }
+    return i;
+}
+
+void bt_leaf_put(BLeaf *leaf, uint32_t pos, double score, ZNode *item) {
+    uint32_t tail = leaf->hdr.n - pos;
+    memmove(&leaf->scores[pos + 1], &leaf->scores[pos], tail * sizeof(double));
+    memmove(&leaf->items[pos + 1], &leaf->items[pos], tail * sizeof(ZNode *));
+    leaf->scores[pos] = score;
+    leaf->items[pos] = item;
+    leaf->hdr.n++;
+}
+
+void bt_leaf_remove(BLeaf *leaf, uint32_t pos) {
+    uint32_t tail = leaf->hdr.n - pos - 1;
+    memmove(&leaf->scores[pos], &leaf->scores[pos + 1], tail * sizeof(double));
+    memmove(&leaf->items[pos], &leaf->items[pos + 1], tail * sizeof(ZNode *));
+    leaf->hdr.n--;
+}
+
+void bt_inner_put(BInner *inner, uint32_t pos, BNode *child) {
+    uint32_t tail = inner->hdr.n - pos;
+    memmove(&inner->scores[pos + 1], &inner->scores[pos],
+            tail * sizeof(double));
+    memmove(&inner->keys[pos + 1], &inner->keys[pos], tail * sizeof(ZNode *));
+    memmove(&inner->counts[pos + 1], &inner->counts[pos],
+            tail * sizeof(size_t));
+    memmove(&inner->child[pos + 1], &inner->child[pos],
+            tail * sizeof(BNode *));
+    inner->child[pos] = child;
+    inner->counts[pos] = bt_count(child);
+    bt_max(child, inner->scores[pos], inner->keys[pos]);
+    inner->hdr.n++;
+}
+
+void bt_inner_remove(BInner *inner, uint32_t pos) {
+    uint32_t tail = inner->hdr.n - pos - 1;
+    memmove(&inner->scores[pos], &inner->scores[pos + 1],
+            tail * sizeof(double));
+    memmove(&inner->keys[pos], &inner->keys[pos + 1], tail * sizeof(ZNode *));
+    memmove(&inner->counts[pos], &inner->counts[pos + 1],
+            tail * sizeof(size_t));
+    memmove(&inner->child[pos], &inner->child[pos + 1],
+            tail * sizeof(BNode *));
+    inner->hdr.n--;
+}
+
+// move the upper half of a full leaf to a new right sibling
+BLeaf *bt_leaf_split(BTree *tree, BLeaf *leaf) {
+    BLeaf *right = bt_leaf_new(tree);
+    uint32_t mid = leaf->hdr.n / 2;
+    right->hdr.n = leaf->hdr.n - mid;
+    memcpy(right->scores, &leaf->scores[mid], right->hdr.n * sizeof(double));
+    memcpy(right->items, &leaf->items[mid], right->hdr.n * sizeof(ZNode *));
+    leaf->hdr.n = mid;
+
+    // link into the leaf chain
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (right->next) {
+        right->next->prev = right;
+    }
+    leaf->next = right;
+    return right;
+}
+
+BInner *bt_inner_split(BTree *tree, BInner *inner) {
+    BInner *right = bt_inner_new(tree);
+    uint32_t mid = inner->hdr.n / 2;
+    uint32_t n = inner->hdr.n - mid;
+    memcpy(right->scores, &inner->scores[mid], n * sizeof(double));
+    memcpy(right->keys, &inner->keys[mid], n * sizeof(ZNode *));
+    memcpy(right->counts, &inner->counts[mid], n * sizeof(size_t));
+    memcpy(right->child, &inner->child[mid], n * sizeof(BNode *));
+    right->hdr.n = n;
+    inner->hdr.n = mid;
+    return right;
+}
+
+// ---------------- Insert ----------------
+
+// insert into the subtree, returns the new right sibling if the node split
+BNode *bt_insert_rec(BTree *tree, BNode *node, double score, ZNode *item,
+                     const char *name, size_t len) {
+    if (node->leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        uint32_t pos =
+            bt_lower(leaf->scores, leaf->items, node->n, score, name, len);
+
+        BLeaf *right = NULL;
+        if (node->n == k_bt_leaf) {
+            right = bt_leaf_split(tree, leaf);
+            if (pos > leaf->hdr.n) {
+                pos -= leaf->hdr.n;
+                leaf = right;
+            }
+        }
+        bt_leaf_put(leaf, pos, score, item);
+        return right ? &right->hdr : NULL;
+    }
+
+    BInner *inner = (BInner *)node;
+    uint32_t pos =
+        bt_lower(inner->scores, inner->keys, node->n, score, name, len);
+    if (pos == node->n) {
+        pos--; // a new max, goes into the last child
+    }
+
+    BNode *child = inner->child[pos];
+    BNode *split = bt_insert_rec(tree, child, score, item, name, len);
+    bt_max(child, inner->scores[pos], inner->keys[pos]);
+    if (!split) {
+        inner->counts[pos]++;
+        return NULL;
+    }
+
+    // the child split, add its new sibling after it
+    inner->counts[pos] = bt_count(child);
+    pos++;
+
+    BInner *right = NULL;
+    if (node->n == k_bt_inner) {
+        right = bt_inner_split(tree, inner);
+        if (pos > inner->hdr.n) {
+            pos -= inner->hdr.n;
+            inner = right;
+        }
+    }
+    bt_inner_put(inner, pos, split);
+    return right ? &right->hdr : NULL;
+}
+
+void bt_insert(BTree *tree, double score, ZNode *item, const char *name,
+               size_t len) {
+    if (!tree->root) {
+        tree->root = &bt_leaf_new(tree)->hdr;
+    }
+
+    BNode *split = bt_insert_rec(tree, tree->root, score, item, name, len);
+    if (split) {
+        // grow a level
+        BInner *root = bt_inner_new(tree);
+        bt_inner_put(root, 0, tree->root);
+        bt_inner_put(root, 1, split);
+        tree->root = &root->hdr;
+    }
+    tree->size++;
+}
+
+// ---------------- Delete ----------------
+
+// merge the child at `pos` with a sibling if it is underfull and they fit
+void bt_merge(BTree *tree, BInner *inner, uint32_t pos) {
+    BNode *child = inner->child[pos];
+    uint32_t cap = child->leaf ? k_bt_leaf : k_bt_inner;
+    if (child->n >= cap / 2 || inner->hdr.n < 2) {
+        return;
+    }
+
+    uint32_t left = pos + 1 < inner->hdr.n ? pos : pos - 1;
+    BNode *a = inner->child[left];
+    BNode *b = inner->child[left + 1];
+    if (a->n + b->n > cap) {
+        return;
+    }
+
+    // append b to a
+    if (a->leaf) {
+        BLeaf *la = (BLeaf *)a, *lb = (BLeaf *)b;
+        memcpy(&la->scores[a->n], lb->scores, b->n * sizeof(double));
+        memcpy(&la->items[a->n], lb->items, b->n * sizeof(ZNode *));
+        la->next = lb->next;
+        if (la->next) {
+            la->next->prev = la;
+        }
+    } else {
+        BInner *ia = (BInner *)a, *ib = (BInner *)b;
+        memcpy(&ia->scores[a->n], ib->scores, b->n * sizeof(double));
+        memcpy(&ia->keys[a->n], ib->keys, b->n * sizeof(ZNode *));
+        memcpy(&ia->counts[a->n], ib->counts, b->n * sizeof(size_t));
+        memcpy(&ia->child[a->n], ib->child, b->n * sizeof(BNode *));
+    }
+    a->n += b->n;
+
+    inner->counts[left] += inner->counts[left + 1];
+    inner->scores[left] = inner->scores[left + 1];
+    inner->keys[left] = inner->keys[left + 1];
+    bt_inner_remove(inner, left + 1);
+    bt_node_del(tree, b);
+}
+
+// remove the pair from the subtree, false if not found
+bool bt_delete_rec(BTree *tree, BNode *node, double score, ZNode *item,
+                   const char *name, size_t len) {
+    if (node->leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        uint32_t pos =
+            bt_lower(leaf->scores, leaf->items, node->n, score, name, len);
+        if (pos == node->n || leaf->items[pos] != item) {
+            return false;
+        }
+        bt_leaf_remove(leaf, pos);
+        return true;
+    }
+
+    BInner *inner = (BInner *)node;
+    uint32_t pos =
+        bt_lower(inner->scores, inner->keys, node->n, score, name, len);
+    if (pos == node->n) {
+        return false;
+    }
+
+    BNode *child = inner->child[pos];
+    if (!bt_delete_rec(tree, child, score, item, name, len)) {
+        return false;
+    }
+    inner->counts[pos]--;
+
+    if (child->n == 0) {
+        // drop the empty child
+        if (child->leaf) {
+            BLeaf *leaf = (BLeaf *)child;
+            if (leaf->prev) {
+                leaf->prev->next = leaf->next;
+            }
+            if (leaf->next) {
+                leaf->next->prev = leaf->prev;
+            }
+        }
+        bt_inner_remove(inner, pos);
+        bt_node_del(tree, child);
+        return true;
+    }
+
+    bt_max(child, inner->scores[pos], inner->keys[pos]);
+    bt_merge(tree, inner, pos);
+    return true;
+}
+
+// drop roots with a single child, and an empty root leaf
+void bt_shrink(BTree *tree) {
+    BNode *root = tree->root;
+    while (!root->leaf && root->n == 1) {
+        tree->root = ((BInner *)root)->child[0];
+        bt_node_del(tree, root);
+        root = tree->root;
+    }
+    if (root->n == 0) {
+        bt_node_del(tree, root);
+        tree->root = NULL;
+    }
+}
+
+bool bt_delete(BTree *tree, double score, ZNode *item, const char *name,
+               size_t len) {
+    if (!tree->root ||
+        !bt_delete_rec(tree, tree->root, score, item, name, len)) {
+        return false;
+    }
+    tree->size--;
+    bt_shrink(tree);
+    return true;
+}
+
+// free the tree nodes, not the items
+void bt_dispose(BTree *tree, BNode *node) {
+    if (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        for (uint32_t i = 0; i < node->n; i++) {
+            bt_dispose(tree, inner->child[i]);
+        }
+    }
+    bt_node_del(tree, node);
+}
+
+// empty the tree, the bytes of nodes split off from it stay counted
+void bt_clear(BTree *tree) {
+    if (tree->root) {
+        bt_dispose(tree, tree->root);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+// Replace the contents with pairs sorted by (score, name), building
+// bottom-up in O(n). Nodes are filled evenly, as full as possible.
+void bt_build(BTree *tree, const BPair *pairs, size_t n) {
+    bt_clear(tree);
+    if (n == 0) {
+        return;
+    }
+
+    // leaves, chained in order
+    std::vector<BNode *> level;
+    size_t nleaves = (n + k_bt_leaf - 1) / k_bt_leaf;
+    BLeaf *prev = NULL;
+    for (size_t i = 0, pos = 0; i < nleaves; i++) {
+        uint32_t cnt = (uint32_t)((n - pos) / (nleaves - i));
+        BLeaf *leaf = bt_leaf_new(tree);
+        for (uint32_t j = 0; j < cnt; j++) {
+            leaf->scores[j] = pairs[pos + j].score;
+            leaf->items[j] = pairs[pos + j].item;
+        }
+        leaf->hdr.n = cnt;
+        pos += cnt;
+
+        leaf->prev = prev;
+        if (prev) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level.push_back(&leaf->hdr);
+    }
+
+    // inner levels up to the root
+    while (level.size() > 1) {
+        std::vector<BNode *> parents;
+        size_t nparents = (level.size() + k_bt_inner - 1) / k_bt_inner;
+        for (size_t i = 0, pos = 0; i < nparents; i++) {
+            uint32_t cnt = (uint32_t)((level.size() - pos) / (nparents - i));
+            BInner *inner = bt_inner_new(tree);
+            for (uint32_t j = 0; j < cnt; j++) {
+                bt_inner_put(inner, j, level[pos + j]);
+            }
+            pos += cnt;
+            parents.push_back(&inner->hdr);
+        }
+        level.swap(parents);
+    }
+
+    tree->root = level[0];
+    tree->size = n;
+}
+
+// ---------------- Queries ----------------
+
+// first pair not less than (score, name)
+BIter bt_seek(BTree *tree, double score, const char *name, size_t len) {
+    BNode *node = tree->root;
+    if (!node) {
+        return BIter{};
+    }
+
+    while (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        uint32_t pos =
+            bt_lower(inner->scores, inner->keys, node->n, score, name, len);
+        if (pos == node->n) {
+            return BIter{}; // larger than every pair
+        }
+        node = inner->child[pos];
+    }
+
+    BLeaf *leaf = (BLeaf *)node;
+    uint32_t pos =
+        bt_lower(leaf->scores, leaf->items, node->n, score, name, len);
+    return pos < node->n ? BIter{leaf, pos} : BIter{};
+}
+
+// number of pairs less than (score, name)
+size_t bt_rank(BTree *tree, double score, const char *name, size_t len) {
+    size_t rank = 0;
+    BNode *node = tree->root;
+    if (!node) {
+        return 0;
+    }
+
+    while (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        uint32_t pos =
+            bt_lower(inner->scores, inner->keys, node->n, score, name, len);
+        if (pos == node->n) {
+            return tree->size;
+        }
+        for (uint32_t i = 0; i < pos; i++) {
+            rank += inner->counts[i];
+        }
+        node = inner->child[pos];
+    }
+
+    BLeaf *leaf = (BLeaf *)node;
+    return rank +
+           bt_lower(leaf->scores, leaf->items, node->n, score, name, len);
+}
+
+// number of pairs with a score below `score`, or not above it if `inclusive`
+size_t bt_rank_score(BTree *tree, double score, bool inclusive) {
+    size_t rank = 0;
+    BNode *node = tree->root;
+    if (!node) {
+        return 0;
+    }
+
+    while (!node->leaf) {
+        // children before `pos` lie entirely below the bound
+        BInner *inner = (BInner *)node;
+        uint32_t pos = bt_lower_score(inner->scores, node->n, score, inclusive);
+        if (pos == node->n) {
+            return tree->size;
+        }
+        for (uint32_t i = 0; i < pos; i++) {
+            rank += inner->counts[i];
+        }
+        node = inner->child[pos];
+    }
+
+    BLeaf *leaf = (BLeaf *)node;
+    return rank + bt_lower_score(leaf->scores, node->n, score, inclusive);
+}
+
+// the pair at a 0-based rank
+BIter bt_at(BTree *tree, size_t rank) {
+    if (rank >= tree->size) {
+        return BIter{};
+    }
+
+    BNode *node = tree->root;
+    while (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        uint32_t i = 0;
+        while (rank >= inner->counts[i]) {
+            rank -= inner->counts[i];
+            i++;
+        }
+        node = inner->child[i];
+    }
+    return BIter{(BLeaf *)node, (uint32_t)rank};
+}
+
+ZNode *bt_item(BIter it) { return it.leaf ? it.leaf->items[it.pos] : NULL; }
+
+void bt_next(BIter &it) {
+    if (it.leaf && ++it.pos == it.leaf->hdr.n) {
+        it.leaf = it.leaf->next;
+        it.pos = 0;
+    }
+}
+
+void bt_prev(BIter &it) {
+    if (!it.leaf) {
+        return;
+    }
+    if (it.pos > 0) {
+        it.pos--;
+    } else {
+        it.leaf = it.leaf->prev;
+        it.pos = it.leaf ? it.leaf->hdr.n - 1 : 0;
+    }
+}
+
+// ---------------- Split / Join ----------------
+
+uint32_t bt_height(BNode *node) {
+    uint32_t h = 0;
+    for (; !node->leaf; h++) {
+        node = ((BInner *)node)->child[0];
+    }
+    return h;
+}
+
+// bytes held by the inner nodes of a subtree, the leaves are not read
+size_t bt_inner_mem(BNode *node, uint32_t height) {
+    if (height == 0) {
+        return 0;
+    }
+    size_t mem = mem_usable(node);
+    BInner *inner = (BInner *)node;
+    for (uint32_t i = 0; height > 1 && i < node->n; i++) {
+        mem += bt_inner_mem(inner->child[i], height - 1);
+    }
+    return mem;
+}
+
+// Split the subtree before the pair at `rank`, which must be below its
+// count: `node` keeps the smaller pairs, the rest move to a new node of
+// the same height, returned. Returns `node` itself if every pair moves.
+BNode *bt_split_rec(BTree *tree, BNode *node, size_t rank) {
+    if (rank == 0) {
+        return node;
+    }
+
+    if (node->leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        BLeaf *right = bt_leaf_new(tree);
+        right->hdr.n = node->n - (uint32_t)rank;
+        memcpy(right->scores, &leaf->scores[rank],
+               right->hdr.n * sizeof(double));
+        memcpy(right->items, &leaf->items[rank],
+               right->hdr.n * sizeof(ZNode *));
+        leaf->hdr.n = (uint32_t)rank;
+
+        // keep the chain whole, bt_split() cuts it
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (right->next) {
+            right->next->prev = right;
+        }
+        leaf->next = right;
+        return &right->hdr;
+    }
+
+    BInner *inner = (BInner *)node;
+    uint32_t i = 0;
+    while (rank >= inner->counts[i]) {
+        rank -= inner->counts[i];
+        i++;
+    }
+    BNode *child = inner->child[i];
+    BNode *split = bt_split_rec(tree, child, rank);
+
+    // children after `i` move, and `i` too unless it kept some pairs
+    uint32_t from = split == child ? i : i + 1;
+    BInner *right = bt_inner_new(tree);
+    uint32_t n = node->n - from;
+    memcpy(right->scores, &inner->scores[from], n * sizeof(double));
+    memcpy(right->keys, &inner->keys[from], n * sizeof(ZNode *));
+    memcpy(right->counts, &inner->counts[from], n * sizeof(size_t));
+    memcpy(right->child, &inner->child[from], n * sizeof(BNode *));
+    right->hdr.n = n;
+    inner->hdr.n = from;
+
+    if (split != child) {
+        inner->counts[i] = bt_count(child);
+        bt_max(child, inner->scores[i], inner->keys[i]);
+        bt_inner_put(right, 0, split);
+    }
+    return &right->hdr;
+}
+
+// Merge the thin nodes a split leaves along one edge of the tree, the
+// last children if `last`, else the first ones, then shrink the height.
+void bt_fix_edge(BTree *tree, bool last) {
+    for (BNode *node = tree->root; !node->leaf;) {
+        BInner *inner = (BInner *)node;
+        bt_merge(tree, inner, last ? node->n - 1 : 0);
+        node = inner->child[last ? node->n - 1 : 0];
+    }
+    bt_shrink(tree);
+}
+
+// Move the pairs from `rank` on into the empty tree `right`, in
+// O(log n). Counting the bytes of the moved nodes would mean visiting
+// them all, so they stay counted in `tree->mem`.
+void bt_split(BTree *tree, size_t rank, BTree *right) {
+    if (rank >= tree->size) {
+        return;
+    }
+    if (rank == 0) {
+        right->root = tree->root;
+        right->size = tree->size;
+        tree->root = NULL;
+        tree->size = 0;
+        return;
+    }
+
+    // nodes freed from `right` make its count wrap, it is folded back
+    right->root = bt_split_rec(tree, tree->root, rank);
+    right->size = tree->size - rank;
+    tree->size = rank;
+
+    BLeaf *first = bt_at(right, 0).leaf;
+    first->prev->next = NULL;
+    first->prev = NULL;
+
+    bt_fix_edge(tree, true);
+    bt_fix_edge(right, false);
+    tree->mem += right->mem;
+    right->mem = 0;
+}
+
+// Add the subtree `sub` at the end (or the start) of the subtree at
+// `node`, which is taller. Returns the new right sibling if `node` split.
+BNode *bt_graft_rec(BTree *tree, BNode *node, uint32_t height, BNode *sub,
+                    uint32_t sub_height, bool at_end) {
+    BInner *inner = (BInner *)node;
+    uint32_t pos = at_end ? node->n : 0;
+    BNode *add = sub;
+
+    if (height > sub_height + 1) {
+        // go down the edge
+        pos = at_end ? node->n - 1 : 0;
+        BNode *child = inner->child[pos];
+        add = bt_graft_rec(tree, child, height - 1, sub, sub_height, at_end);
+        inner->counts[pos] = bt_count(child);
+        bt_max(child, inner->scores[pos], inner->keys[pos]);
+        if (!add) {
+            return NULL;
+        }
+        pos++; // the child split, add its new sibling after it
+    }
+
+    BInner *right = NULL;
+    if (node->n == k_bt_inner) {
+        right = bt_inner_split(tree, inner);
+        if (pos > inner->hdr.n) {
+            pos -= inner->hdr.n;
+            inner = right;
+        }
+    }
+    bt_inner_put(inner, pos, add);
+    if (add == sub) {
+        bt_merge(tree, inner, pos); // `sub` may be thin
+    }
+    return right ? &right->hdr : NULL;
+}
+
+// Append the pairs of `right`, all larger than those of `tree`, in
+// O(log n). `right` is left empty.
+void bt_join(BTree *tree, BTree *right) {
+    if (!right->root) {
+        return;
+    }
+    if (!tree->root) {
+        tree->root = right->root;
+        tree->size = right->size;
+        tree->mem += right->mem;
+        *right = BTree{};
+        return;
+    }
+
+    BLeaf *last = bt_at(tree, tree->size - 1).leaf;
+    BLeaf *first = bt_at(right, 0).leaf;
+    last->next = first;
+    first->prev = last;
+
+    size_t size = tree->size + right->size;
+    tree->mem += right->mem;
+    uint32_t lh = bt_height(tree->root);
+    uint32_t rh = bt_height(right->root);
+
+    BNode *left = tree->root;
+    BNode *split = NULL;
+    if (lh > rh) {
+        split = bt_graft_rec(tree, left, lh, right->root, rh, true);
+    } else if (lh < rh) {
+        split = bt_graft_rec(tree, right->root, rh, left, lh, false);
+        left = right->root;
+    } else {
+        split = right->root;
+    }
+
+    tree->root = left;
+    if (split) {
+        // grow a level
+        BInner *root = bt_inner_new(tree);
+        bt_inner_put(root, 0, left);
+        bt_inner_put(root, 1, split);
+        bt_merge(tree, root, 1);
+        tree->root = &root->hdr;
+    }
+    tree->size = size;
+    *right = BTree{};
+    bt_shrink(tree);
+}
+
+// ---------------- Defrag ----------------
+
+// Point the leaf slot and inner keys referring to `old_item` at `item`,
+// a copy of it at a new address. `old_item` may already be freed.
+void bt_relocate(BTree *tree, ZNode *old_item, ZNode *item, double score,
+                 const char *name, size_t len) {
+    BNode *node = tree->root;
+    while (node && !node->leaf) {
+        BInner *inner = (BInner *)node;
+        uint32_t pos = bt_lower_ref(inner->scores, inner->keys, node->n,
+                                    score, old_item, name, len);
+        if (pos == node->n) {
+            return;
+        }
+        if (inner->keys[pos] == old_item) {
+            inner->keys[pos] = item;
+        }
+        node = inner->child[pos];
+    }
+
+    if (node) {
+        BLeaf *leaf = (BLeaf *)node;
+        uint32_t pos = bt_lower_ref(leaf->scores, leaf->items, node->n,
+                                    score, old_item, name, len);
+        if (pos < node->n && leaf->items[pos] == old_item) {
+            leaf->items[pos] = item;
+        }
+    }
+}
+
+// Move the nodes on the path to the leaf holding `rank` out of sparse
+// slabs. Returns that leaf, or NULL past the end.
+BLeaf *bt_defrag_path(BTree *tree, size_t rank, size_t &moved) {
+    if (rank >= tree->size) {
+        return NULL;
+    }
+
+    BNode **from = &tree->root;
+    while (true) {
+        if (BNode *copy = (BNode *)mem_defrag(*from)) {
+            *from = copy;
+            moved++;
+            if (copy->leaf) {
+                BLeaf *leaf = (BLeaf *)copy;
+                if (leaf->prev) {
+                    leaf->prev->next = leaf;
+                }
+                if (leaf->next) {
+                    leaf->next->prev = leaf;
+                }
+            }
+        }
+
+        BNode *node = *from;
+        if (node->leaf) {
+            return (BLeaf *)node;
+        }
+
+        BInner *inner = (BInner *)node;
+        uint32_t i = 0;
+        while (rank >= inner->counts[i]) {
+            rank -= inner->counts[i];
+            i++;
+        }
+        from = &inner->child[i];
+    }
+}
@@ -212,6 +212,10 @@ int32_t get_res(int fd) {
                       << std::endl;
             break;
 
+        case ERR_OOM:
+            std::cout << "ERR_OOM: Out of memory, write rejected" << std::endl;
+            break;
+
         default:
             break;
         }
@@ -347,14 +351,25 @@ int main(void) {
         {"zadd", "leaderboard", "100", "Alice"},
         {"zadd", "leaderboard", "200", "Bob"},
         {"zadd", "leaderboard", "150", "Charlie"},
-        {"zadd", "leaderboard", "250", "Diana"},
-        {"zadd", "leaderboard", "180", "Eve"},
+        {"zadd", "leaderboard", "250", "Diana", "180", "Eve"},
         {"zscore", "leaderboard", "Bob"},
         {"zrem", "leaderboard", "Alice"}, 
 
         // Sorted Set traversal queries
         {"zquery", "leaderboard", "150", "Charlie", "0", "3"},
-        {"zquery", "leaderboard", "200", "Bob", "0", "2"}
+        {"zquery", "leaderboard", "200", "Bob", "0", "2"},
+        {"zrank", "leaderboard", "Eve"},
+        {"zrevrank", "leaderboard", "Eve"},
+        {"zcount", "leaderboard", "150", "(250"},
+        {"zrange", "leaderboard", "0", "-1"},
+        {"zrevrangebyscore", "leaderboard", "+inf", "180", "0", "2"},
+
+        // Combining sorted sets
+        {"zadd", "weekly", "50", "Bob", "70", "Frank"},
+        {"zunionstore", "total", "2", "leaderboard", "weekly"},
+        {"zinterstore", "both", "2", "leaderboard", "weekly", "weights", "1",
+         "2", "aggregate", "max"},
+        {"zrange", "total", "0", "-1"}
     };
 
     for (auto cmd : cmd_list) {
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "utils.hpp"
+
+// ---------------- Server Config ----------------
+
+// Eviction policies once maxmemory is reached
+enum maxmemory_policies {
+    MM_NOEVICTION,     // reject writes
+    MM_ALLKEYS_LRU,    // evict the least recently used key
+    MM_VOLATILE_LRU,   // evict the least recently used key with a TTL
+    MM_ALLKEYS_RANDOM, // evict a random key
+    MM_VOLATILE_TTL,   // evict the key closest to expiring
+    MM_ALLKEYS_LFU,    // evict the least frequently used key
+    MM_VOLATILE_LFU,   // evict the least frequently used key with a TTL
+};
+
+const char *k_maxmemory_policies[] = {
+    "noeviction",   "allkeys-lru", "volatile-lru", "allkeys-random",
+    "volatile-ttl", "allkeys-lfu", "volatile-lfu",
+};
+
+// When the append-only file is synced to disk
+enum appendfsync_policies {
+    AOF_FSYNC_ALWAYS,   // before replying to the writes
+    AOF_FSYNC_EVERYSEC, // once a second
+    AOF_FSYNC_NO,       // when the kernel flushes it
+};
+
+const char *k_appendfsync_policies[] = {"always", "everysec", "no"};
+
+// ceilings of the request limits, a bulk load of 1M zset members fits
+const uint64_t k_max_msg_len = 64ull << 20;
+const int64_t k_max_msg_args = 4 << 20;
+
+struct Config {
+    // longest request and most arguments per request, raise them for bulk
+    // loads; a client may make the server buffer one request of this size
+    uint64_t proto_max_msg_len = 512 << 10;
+    int64_t proto_max_msg_args = 1024;
+
+    uint64_t maxmemory = 0; // bytes, 0 means no limit
+    int maxmemory_policy = MM_NOEVICTION;
+    int64_t maxmemory_samples = 5; // keys sampled per eviction
+    bool lfu_admission = true;     // LFU: reject new keys colder than victims
+
+    // active defrag
+    bool activedefrag = false;
+    uint64_t defrag_ignore_bytes = 100ull << 20; // ignore less waste
+    int64_t defrag_threshold_start = 10;         // % waste to start
+    int64_t defrag_threshold_stop = 5;           // % waste to stop
+    int64_t defrag_cycle_max = 25;               // % of CPU time
+
+    // sorted sets up to these limits use the compact array encoding
+    int64_t zset_max_array_entries = 128;
+    int64_t zset_max_array_value = 64; // bytes per member name
+
+    // hashes up to these limits use the compact array encoding
+    int64_t hash_max_array_entries = 128;
+    int64_t hash_max_array_value = 64; // bytes per field or value
+
+    // sets of only integers up to this size use the intset encoding
+    int64_t set_max_intset_entries = 512;
+
+    // HyperLogLogs up to this size use the sparse encoding
+    int64_t hll_sparse_max_bytes = 3000;
+
+    // Bloom filters created by bf.add and bf.madd
+    double bf_error_rate = 0.01;
+    int64_t bf_initial_size = 100;    // elements in the first layer
+    int64_t bf_expansion_factor = 2;  // growth of each next layer
+
+    // snapshot written by save and bgsave, loaded at startup
+    std::string dbfilename = "dump.kdb";
+
+    // log of write commands, replayed after the snapshot at startup
+    bool appendonly = false;
+    std::string appendfilename = "appendonly.aof";
+    int appendfsync = AOF_FSYNC_EVERYSEC;
+} g_config;
+
+// parse sizes like "512", "64kb", "100mb", "2gb"
+bool parse_bytes(const std::string &s, uint64_t &out) {
+    size_t digits = 0;
+    while (digits < s.size() && isdigit((unsigned char)s[digits])) {
+        digits++;
+    }
+
+    int64_t n = 0;
+    if (!str_to_i64(s.substr(0, digits), n) || n < 0) {
+        return false;
+    }
+
+    std::string unit = s.substr(digits);
+    for (char &c : unit) {
+        c = (char)tolower((unsigned char)c);
+    }
+
+    uint64_t mul = 1;
+    if (unit == "kb" || unit == "k") {
+        mul = 1ull << 10;
+    } else if (unit == "mb" || unit == "m") {
+        mul = 1ull << 20;
+    } else if (unit == "gb" || unit == "g") {
+        mul = 1ull << 30;
+    } else if (!unit.empty()) {
+        return false;
+    }
+
+    out = (uint64_t)n * mul;
+    return true;
+}
+
+bool parse_enum(const std::string &s, const char **names, size_t n, int &out) {
+    for (size_t i = 0; i < n; i++) {
+        if (s == names[i]) {
+            out = (int)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_bool(const std::string &s, bool &out) {
+    if (s == "yes" || s == "no") {
+        out = s == "yes";
+        return true;
+    }
+    return false;
+}
+
+bool parse_positive(const std::string &s, int64_t &out) {
+    int64_t v = 0;
+    if (!str_to_i64(s, v) || v <= 0) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+bool parse_percent(const std::string &s, int64_t &out) {
+    int64_t v = 0;
+    if (!str_to_i64(s, v) || v < 0 || v > 100) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+// a probability in (0, 1)
+bool parse_rate(const std::string &s, double &out) {
+    double v = 0;
+    if (!str_to_dbl(s, v) || !(v > 0 && v < 1)) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+// growth factor of scalable filters, bounded so capacities cannot wrap
+bool parse_expansion(const std::string &s, int64_t &out) {
+    int64_t v = 0;
+    if (!parse_positive(s, v) || v > 32768) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+// a size up to `max` bytes
+bool parse_bytes_upto(const std::string &s, uint64_t max, uint64_t &out) {
+    uint64_t v = 0;
+    if (!parse_bytes(s, v) || v == 0 || v > max) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+// a named option with its parser and formatter
+struct ConfigOption {
+    const char *name;
+    bool (*set)(const std::string &val);
+    std::string (*get)();
+    bool startup = false; // only set on the command line
+};
+
+const ConfigOption k_config_options[] = {
+    {"proto-max-msg-len",
+     [](const std::string &v) {
+         return parse_bytes_upto(v, k_max_msg_len,
+                                 g_config.proto_max_msg_len);
+     },
+     [] { return std::to_string(g_config.proto_max_msg_len); }},
+    {"proto-max-msg-args",
+     [](const std::string &v) {
+         int64_t n = 0;
+         if (!parse_positive(v, n) || n > k_max_msg_args) {
+             return false;
+         }
+         g_config.proto_max_msg_args = n;
+         return true;
+     },
+     [] { return std::to_string(g_config.proto_max_msg_args); }},
+    {"maxmemory",
+     [](const std::string &v) { return parse_bytes(v, g_config.maxmemory); },
+     [] { return std::to_string(g_config.maxmemory); }},
+    {"maxmemory-policy",
+     [](const std::string &v) {
+         return parse_enum(v, k_maxmemory_policies,
+                           ARRAY_LEN(k_maxmemory_policies),
+                           g_config.maxmemory_policy);
+     },
+     [] {
+         return std::string(k_maxmemory_policies[g_config.maxmemory_policy]);
+     }},
+    {"maxmemory-samples",
+     [](const std::string &v) {
+         return parse_positive(v, g_config.maxmemory_samples);
+     },
+     [] { return std::to_string(g_config.maxmemory_samples); }},
+    {"lfu-admission",
+     [](const std::string &v) { return parse_bool(v, g_config.lfu_admission); },
+     [] { return std::string(g_config.lfu_admission ? "yes" : "no"); }},
+    {"activedefrag",
+     [](const std::string &v) { return parse_bool(v, g_config.activedefrag); },
+     [] { return std::string(g_config.activedefrag ? "yes" : "no"); }},
+    {"active-defrag-ignore-bytes",
+     [](const std::string &v) {
+         return parse_bytes(v, g_config.defrag_ignore_bytes);
+     },
+     [] { return std::to_string(g_config.defrag_ignore_bytes); }},
+    {"active-defrag-threshold-start",
+     [](const std::string &v) {
+         // not below the stop threshold
+         int64_t pct = 0;
+         if (!parse_percent(v, pct) || pct < g_config.defrag_threshold_stop) {
+             return false;
+         }
+         g_config.defrag_threshold_start = pct;
+         return true;
+     },
+     [] { return std::to_string(g_config.defrag_threshold_start); }},
+    {"active-defrag-threshold-stop",
+     [](const std::string &v) {
+         int64_t pct = 0;
+         if (!parse_percent(v, pct) || pct > g_config.defrag_threshold_start) {
+             return false;
+         }
+         g_config.defrag_threshold_stop = pct;
+         return true;
+     },
+     [] { return std::to_string(g_config.defrag_threshold_stop); }},
+    {"active-defrag-cycle-max",
+     [](const std::string &v) {
+         int64_t pct = 0;
+         if (!parse_percent(v, pct) || pct == 0) {
+             return false;
+         }
+         g_config.defrag_cycle_max = pct;
+         return true;
+     },
+     [] { return std::to_string(g_config.defrag_cycle_max); }},
+    {"zset-max-array-entries",
+     [](const std::string &v) {
+         return parse_positive(v, g_config.zset_max_array_entries);
+     },
+     [] { return std::to_string(g_config.zset_max_array_entries); }},
+    {"zset-max-array-value",
+     [](const std::string &v) {
+         // name lengths are stored in one byte
+         int64_t len = 0;
+         if (!parse_positive(v, len) || len > 255) {
+             return false;
+         }
+         g_config.zset_max_array_value = len;
+         return true;
+     },
+     [] { return std::to_string(g_config.zset_max_array_value); }},
+    {"hash-max-array-entries",
+     [](const std::string &v) {
+         return parse_positive(v, g_config.hash_max_array_entries);
+     },
+     [] { return std::to_string(g_config.hash_max_array_entries); }},
+    {"hash-max-array-value",
+     [](const std::string &v) {
+         // field and value lengths are stored in one byte
+         int64_t len = 0;
+         if (!parse_positive(v, len) || len > 255) {
+             return false;
+         }
+         g_config.hash_max_array_value = len;
+         return true;
+     },
+     [] { return std::to_string(g_config.hash_max_array_value); }},
+    {"set-max-intset-entries",
+     [](const std::string &v) {
+         return parse_positive(v, g_config.set_max_intset_entries);
+     },
+     [] { return std::to_string(g_config.set_max_intset_entries); }},
+    {"hll-sparse-max-bytes",
+     [](const std::string &v) {
+         return parse_positive(v, g_config.hll_sparse_max_bytes);
+     },
+     [] { return std::to_string(g_config.hll_sparse_max_bytes); }},
+    {"bf-error-rate",
+     [](const std::string &v) { return parse_rate(v, g_config.bf_error_rate); },
+     [] {
+         char buf[32];
+         snprintf(buf, sizeof(buf), "%g", g_config.bf_error_rate);
+         return std::string(buf);
+     }},
+    {"bf-initial-size",
+     [](const std::string &v) {
+         return parse_positive(v, g_config.bf_initial_size);
+     },
+     [] { return std::to_string(g_config.bf_initial_size); }},
+    {"bf-expansion-factor",
+     [](const std::string &v) {
+         return parse_expansion(v, g_config.bf_expansion_factor);
+     },
+     [] { return std::to_string(g_config.bf_expansion_factor); }},
+    {"dbfilename",
+     [](const std::string &v) {
+         if (v.empty()) {
+             return false;
+         }
+         g_config.dbfilename = v;
+         return true;
+     },
+     [] { return g_config.dbfilename; }},
+    {"appendonly",
+     [](const std::string &v) { return parse_bool(v, g_config.appendonly); },
+     [] { return std::string(g_config.appendonly ? "yes" : "no"); },
+     true},
+    {"appendfilename",
+     [](const std::string &v) {
+         if (v.empty()) {
+             return false;
+         }
+         g_config.appendfilename = v;
+         return true;
+     },
+     [] { return g_config.appendfilename; }, true},
+    {"appendfsync",
+     [](const std::string &v) {
+         return parse_enum(v, k_appendfsync_policies,
+                           ARRAY_LEN(k_appendfsync_policies),
+                           g_config.appendfsync);
+     },
+     [] {
+         return std::string(k_appendfsync_policies[g_config.appendfsync]);
+     }},
+};
+
+const ConfigOption *config_find(const std::string &name) {
+    for (const ConfigOption &opt : k_config_options) {
+        if (name == opt.name) {
+            return &opt;
+        }
+    }
+    return NULL;
+}
+
+bool config_set(const std::string &name, const std::string &val) {
+    const ConfigOption *opt = config_find(name);
+    return opt && opt->set(val);
+}
+
+// parse "--name value" pairs from the command line
+bool config_parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc) {
+            std::cerr << "Bad argument: " << argv[i] << std::endl;
+            return false;
+        }
+        if (!config_set(argv[i] + 2, argv[i + 1])) {
+            std::cerr << "Bad config: " << argv[i] << " " << argv[i + 1]
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,361 @@
+#pragma once
+
+#include <algorithm>
+
+#include "config.hpp"
+#include "hashtable.hpp"
+#include "utils.hpp"
+
+/*
+    Hashes have two encodings:
+    - Array: small hashes are one buffer of
+      (field length, field, value length, value) entries, searched linearly.
+    - Table: a hashtable of HField nodes, each one allocation holding
+      the field and the value.
+    A hash starts as an array and is converted for good once it has more than
+    `hash-max-array-entries` fields or a field or value longer than
+    `hash-max-array-value` bytes.
+*/
+
+// the table encoding, allocated on conversion
+struct HashTable {
+    HMap hmap;
+    size_t node_mem = 0; // bytes held by HFields
+};
+
+// small, most hashes never leave the array encoding
+struct Hash {
+    // array encoding
+    char *arr = NULL;
+    uint32_t arr_n = 0;    // fields
+    uint32_t arr_used = 0; // bytes
+    uint32_t arr_cap = 0;
+
+    // table encoding, NULL while the array is used
+    HashTable *table = NULL;
+};
+
+// one allocation: [HField][field bytes][value bytes]
+struct HField {
+    HNode node;
+    uint32_t flen;
+    uint32_t vlen;
+    char data[0];
+};
+
+// ------------------ HField functions ------------------------
+
+HField *hfield_new(const char *field, size_t flen, const char *val,
+                   size_t vlen) {
+    HField *f = (HField *)mem_alloc(sizeof(HField) + flen + vlen);
+    f->node.next = NULL;
+    f->node.hcode = str_hash((uint8_t *)field, flen);
+    f->flen = (uint32_t)flen;
+    f->vlen = (uint32_t)vlen;
+    memcpy(f->data, field, flen);
+    memcpy(f->data + flen, val, vlen);
+    return f;
+}
+
+char *hfield_val(HField *f) { return f->data + f->flen; }
+
+bool hfield_eq(HNode *node, HNode *key) {
+    HField *f = container_of(node, HField, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return f->flen == hkey->len && memcmp(f->data, hkey->name, f->flen) == 0;
+}
+
+// ------------------ Array encoding ------------------------
+
+// entry: [uint8_t field length][field][uint8_t value length][value]
+size_t harr_flen(const char *p) { return (uint8_t)p[0]; }
+const char *harr_field(const char *p) { return p + 1; }
+size_t harr_vlen(const char *p) { return (uint8_t)p[1 + harr_flen(p)]; }
+const char *harr_val(const char *p) { return p + 2 + harr_flen(p); }
+size_t harr_size(const char *p) { return 2 + harr_flen(p) + harr_vlen(p); }
+
+// byte offset of a field, -1 if absent
+int64_t harr_find(Hash *hash, const char *field, size_t flen) {
+    for (uint32_t off = 0; off < hash->arr_used;) {
+        const char *p = hash->arr + off;
+        if (harr_flen(p) == flen && memcmp(harr_field(p), field, flen) == 0) {
+            return off;
+        }
+        off += harr_size(p);
+    }
+    return -1;
+}
+
+void harr_resize(Hash *hash, size_t cap) {
+    char *arr = (char *)mem_alloc(cap);
+    if (hash->arr) {
+        memcpy(arr, hash->arr, hash->arr_used);
+        mem_free(hash->arr);
+    }
+    hash->arr = arr;
+    hash->arr_cap = (uint32_t)mem_usable(arr);
+}
+
+void harr_append(Hash *hash, const char *field, size_t flen, const char *val,
+                 size_t vlen) {
+    size_t size = 2 + flen + vlen;
+
+    if (hash->arr_used + size > hash->arr_cap) {
+        // grow by half, the slab class rounding gives some slack for free
+        harr_resize(hash, std::max(hash->arr_used + size,
+                                   (size_t)hash->arr_cap + hash->arr_cap / 2));
+    }
+
+    char *p = hash->arr + hash->arr_used;
+    p[0] = (char)(uint8_t)flen;
+    memcpy(p + 1, field, flen);
+    p[1 + flen] = (char)(uint8_t)vlen;
+    memcpy(p + 2 + flen, val, vlen);
+
+    hash->arr_used += (uint32_t)size;
+    hash->arr_n++;
+}
+
+void harr_remove(Hash *hash, uint32_t off) {
+    char *p = hash->arr + off;
+    size_t size = harr_size(p);
+    memmove(p, p + size, hash->arr_used - off - size);
+    hash->arr_used -= (uint32_t)size;
+    hash->arr_n--;
+}
+
+// ------------------ Table encoding ------------------------
+
+HField *hash_lookup(Hash *hash, const char *field, size_t flen) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.name = field;
+    key.len = flen;
+
+    HNode *found = hm_lookup(&hash->table->hmap, &key.node, &hfield_eq);
+    return found ? container_of(found, HField, node) : NULL;
+}
+
+void hash_add_field(Hash *hash, const char *field, size_t flen,
+                    const char *val, size_t vlen) {
+    HField *f = hfield_new(field, flen, val, vlen);
+    hm_insert(&hash->table->hmap, &f->node);
+    hash->table->node_mem += mem_usable(f);
+}
+
+// overwrite a value, in place when it fits the allocation
+void hash_update_field(Hash *hash, HField *f, const char *val, size_t vlen) {
+    if (sizeof(HField) + f->flen + vlen <= mem_usable(f)) {
+        memcpy(hfield_val(f), val, vlen);
+        f->vlen = (uint32_t)vlen;
+        return;
+    }
+
+    // swap a larger copy into the same hash chain slot
+    HField *copy = hfield_new(f->data, f->flen, val, vlen);
+    HNode **from = hm_ref(&hash->table->hmap, &f->node, f->node.hcode);
+    assert(from);
+    copy->node.next = f->node.next;
+    *from = &copy->node;
+
+    hash->table->node_mem += mem_usable(copy);
+    hash->table->node_mem -= mem_usable(f);
+    mem_free(f);
+}
+
+// move every field from the array to the table encoding
+void hash_convert(Hash *hash) {
+    char *arr = hash->arr;
+    uint32_t used = hash->arr_used;
+
+    hash->arr = NULL;
+    hash->arr_n = hash->arr_used = hash->arr_cap = 0;
+    hash->table = new (mem_alloc(sizeof(HashTable))) HashTable();
+
+    for (uint32_t off = 0; off < used;) {
+        const char *p = arr + off;
+        hash_add_field(hash, harr_field(p), harr_flen(p), harr_val(p),
+                       harr_vlen(p));
+        off += harr_size(p);
+    }
+    mem_free(arr);
+}
+
+// ------------------ Hash functions ------------------------
+
+size_t hash_size(Hash *hash) {
+    return hash->table ? hm_size(&hash->table->hmap) : hash->arr_n;
+}
+
+// Make room for a write of `n` fields taking `bytes` array bytes, so it
+// does not grow the array field by field. Skipped if the write is going
+// to convert the hash anyway.
+void hash_reserve(Hash *hash, size_t n, size_t bytes) {
+    size_t max_value = (size_t)g_config.hash_max_array_value;
+    if (hash->table ||
+        hash->arr_n + n > (uint64_t)g_config.hash_max_array_entries ||
+        bytes > n * (2 + 2 * max_value)) {
+        return;
+    }
+    if (hash->arr_used + bytes > hash->arr_cap) {
+        harr_resize(hash, hash->arr_used + bytes);
+    }
+}
+
+// the value of a field, valid until the next write
+bool hash_get(Hash *hash, const char *field, size_t flen, const char *&val,
+              size_t &vlen) {
+    if (!hash->table) {
+        int64_t off = harr_find(hash, field, flen);
+        if (off < 0) {
+            return false;
+        }
+        val = harr_val(hash->arr + off);
+        vlen = harr_vlen(hash->arr + off);
+        return true;
+    }
+
+    HField *f = hash_lookup(hash, field, flen);
+    if (!f) {
+        return false;
+    }
+    val = hfield_val(f);
+    vlen = f->vlen;
+    return true;
+}
+
+// set a field, returns true if it was added
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val,
+              size_t vlen) {
+    if (!hash->table) {
+        uint64_t max_value = (uint64_t)g_config.hash_max_array_value;
+        int64_t off = harr_find(hash, field, flen);
+        if (off >= 0 && vlen <= max_value) {
+            char *p = hash->arr + off;
+            if (harr_vlen(p) == vlen) {
+                memcpy(p + 2 + flen, val, vlen);
+            } else {
+                harr_remove(hash, (uint32_t)off);
+                harr_append(hash, field, flen, val, vlen);
+            }
+            return false;
+        }
+
+        if (off < 0 &&
+            hash->arr_n < (uint64_t)g_config.hash_max_array_entries &&
+            flen <= max_value && vlen <= max_value) {
+            harr_append(hash, field, flen, val, vlen);
+            return true;
+        }
+        hash_convert(hash);
+    }
+
+    if (HField *f = hash_lookup(hash, field, flen)) {
+        hash_update_field(hash, f, val, vlen);
+        return false;
+    }
+    hash_add_field(hash, field, flen, val, vlen);
+    return true;
+}
+
+// remove a field, returns false if it is absent
+bool hash_remove(Hash *hash, const char *field, size_t flen) {
+    if (!hash->table) {
+        int64_t off = harr_find(hash, field, flen);
+        if (off < 0) {
+            return false;
+        }
+        harr_remove(hash, (uint32_t)off);
+        return true;
+    }
+
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.name = field;
+    key.len = flen;
+
+    HNode *found = hm_delete(&hash->table->hmap, &key.node, &hfield_eq);
+    if (!found) {
+        return false;
+    }
+    HField *f = container_of(found, HField, node);
+    hash->table->node_mem -= mem_usable(f);
+    mem_free(f);
+    return true;
+}
+
+// call f(field, flen, val, vlen, arg) for every field, in no order
+void hash_foreach(Hash *hash,
+                  void (*f)(const char *, size_t, const char *, size_t,
+                            void *),
+                  void *arg) {
+    if (!hash->table) {
+        for (uint32_t off = 0; off < hash->arr_used;) {
+            const char *p = hash->arr + off;
+            f(harr_field(p), harr_flen(p), harr_val(p), harr_vlen(p), arg);
+            off += harr_size(p);
+        }
+        return;
+    }
+
+    for (size_t pos = 0;; pos++) {
+        HNode **from = hm_bucket(&hash->table->hmap, pos);
+        if (!from) {
+            break;
+        }
+        for (HNode *node = *from; node; node = node->next) {
+            HField *field = container_of(node, HField, node);
+            f(field->data, field->flen, hfield_val(field), field->vlen, arg);
+        }
+    }
+}
+
+void hash_clear(Hash *hash) {
+    mem_free(hash->arr);
+    if (HashTable *table = hash->table) {
+        for (size_t pos = 0;; pos++) {
+            HNode **from = hm_bucket(&table->hmap, pos);
+            if (!from) {
+                break;
+            }
+            for (HNode *node = *from; node;) {
+                HNode *next = node->next;
+                mem_free(container_of(node, HField, node));
+                node = next;
+            }
+        }
+        hm_clear(&table->hmap);
+        mem_free(table);
+    }
+    *hash = Hash{};
+}
+
+// bytes held by the hash and its fields
+size_t hash_mem(Hash *hash) {
+    size_t mem = sizeof(Hash) + hash->arr_cap;
+    if (HashTable *table = hash->table) {
+        mem += sizeof(HashTable) + table->node_mem + hm_mem(&table->hmap);
+    }
+    return mem;
+}
+
+// ------------------ Defrag ------------------------
+
+// Move the fields of one bucket out of sparse slabs, `pos` counts
+// buckets as hm_bucket() does. Returns false past the last bucket.
+bool hash_defrag_bucket(Hash *hash, size_t &pos, size_t &moved) {
+    HNode **from = hash->table ? hm_bucket(&hash->table->hmap, pos) : NULL;
+    if (!from) {
+        return false;
+    }
+
+    for (; *from; from = &(*from)->next) {
+        if (void *copy = mem_defrag(container_of(*from, HField, node))) {
+            *from = &((HField *)copy)->node;
+            moved++;
+        }
+    }
+
+    pos++;
+    return true;
+}
@@ -4,6 +4,9 @@
 #include <cstdint>
 #include <iostream>
 
+#include "memory.hpp"
+#include "utils.hpp"
+
 // container_of macro to access data of intrusive data dtructure
 #define container_of(ptr, T, member) \
     ((T *)( (char *)ptr - offsetof(T, member) ))
@@ -34,6 +37,9 @@ struct HKey {
     size_t len = 0;
 };
 
+// eq callback to find a node by identity
+bool hnode_same(HNode *node, HNode *key) { return node == key; }
+
 const size_t k_max_load_factor = 8;
 const size_t k_rehashing_work = 128; // constant work
 
@@ -44,7 +50,7 @@ void h_init(HTab *htab, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);
 
     // use calloc so all default values are null
-    htab->tab = (HNode **)calloc(n, sizeof(HNode *));
+    htab->tab = (HNode **)mem_calloc(n, sizeof(HNode *));
     htab->mask = n - 1;
     htab->size = 0;
 }
@@ -134,7 +140,7 @@ void hm_help_rehashing(HMap *hmap) {
 
     // discard old table if all data is rehashed
     if(hmap->older.size == 0 && hmap->older.tab){
-        free(hmap->older.tab);
+        mem_free(hmap->older.tab);
         hmap->older = HTab{};
     }
 }
@@ -183,8 +189,8 @@ void hm_insert(HMap *hmap, HNode *node) {
 }
 
 void hm_clear(HMap *hmap) {
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    mem_free(hmap->newer.tab);
+    mem_free(hmap->older.tab);
     *hmap = HMap{};
 }
 
@@ -195,4 +201,98 @@ void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg){
 
 size_t hm_size(HMap *hmap) {
     return hmap->newer.size + hmap->older.size;
+}
+
+// size an empty map for about n keys, so filling it never rehashes
+void hm_reserve(HMap *hmap, size_t n) {
+    assert(hm_size(hmap) == 0);
+    size_t cap = 4;
+    while (cap < n) {
+        cap *= 2;
+    }
+    hm_clear(hmap);
+    h_init(&hmap->newer, cap);
+}
+
+// Bucket `pos` counting the newer table first, then the older one.
+// Returns NULL past the last bucket. Used by incremental scans.
+HNode **hm_bucket(HMap *hmap, size_t pos) {
+    size_t n_newer = hmap->newer.tab ? hmap->newer.mask + 1 : 0;
+    size_t n_older = hmap->older.tab ? hmap->older.mask + 1 : 0;
+
+    if (pos < n_newer) {
+        return &hmap->newer.tab[pos];
+    } else if (pos < n_newer + n_older) {
+        return &hmap->older.tab[pos - n_newer];
+    }
+    return NULL;
+}
+
+// The pointer linking `node` into its chain, found by identity,
+// so `node` itself is not read. NULL if it is not in the map.
+HNode **hm_ref(HMap *hmap, HNode *node, uint64_t hcode) {
+    HTab *tabs[2] = {&hmap->newer, &hmap->older};
+    for (HTab *htab : tabs) {
+        if (!htab->tab) {
+            continue;
+        }
+        HNode **from = &htab->tab[hcode & htab->mask];
+        for (; *from; from = &(*from)->next) {
+            if (*from == node) {
+                return from;
+            }
+        }
+    }
+    return NULL;
+}
+
+// move the bucket arrays out of sparse slabs
+void hm_defrag(HMap *hmap) {
+    HTab *tabs[2] = {&hmap->newer, &hmap->older};
+    for (HTab *htab : tabs) {
+        if (void *moved = htab->tab ? mem_defrag(htab->tab) : NULL) {
+            htab->tab = (HNode **)moved;
+        }
+    }
+}
+
+// bytes held by the bucket arrays
+size_t hm_mem(HMap *hmap) {
+    size_t n = 0;
+    if (hmap->newer.tab) {
+        n += (hmap->newer.mask + 1) * sizeof(HNode *);
+    }
+    if (hmap->older.tab) {
+        n += (hmap->older.mask + 1) * sizeof(HNode *);
+    }
+    return n;
+}
+
+// Collect up to n nodes starting from a random bucket.
+// Used for sampling, so the result is not uniformly random.
+size_t hm_sample(HMap *hmap, HNode **out, size_t n) {
+    size_t found = 0;
+    HTab *tabs[2] = {&hmap->newer, &hmap->older};
+
+    for (HTab *htab : tabs) {
+        if (htab->size == 0) {
+            continue;
+        }
+
+        // bound the work spent on sparse tables
+        size_t max_empty = n * 10;
+        size_t pos = rand_u64() & htab->mask;
+
+        for (size_t i = 0; i <= htab->mask && found < n; i++) {
+            HNode *node = htab->tab[(pos + i) & htab->mask];
+            if (!node && max_empty-- == 0) {
+                break;
+            }
+            for (; node && found < n; node = node->next) {
+                out[found++] = node;
+            }
+        }
+    }
+
+    return found;
 }
\ No newline at end of file
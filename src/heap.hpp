@@ -91,4 +91,29 @@ void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
         a.push_back(t); // or add a new item
     }
     heap_update(a.data(), pos, a.size());
-}
\ No newline at end of file
+}
+
+// number of items with a value below `val`, only those are visited since
+// a node is never below its parent
+size_t heap_count_below(const std::vector<HeapItem> &a, uint64_t val) {
+    size_t n = 0;
+    std::vector<size_t> stack;
+    if (!a.empty()) {
+        stack.push_back(0);
+    }
+    while (!stack.empty()) {
+        size_t pos = stack.back();
+        stack.pop_back();
+        if (a[pos].val >= val) {
+            continue;
+        }
+        n++;
+        if (heap_left(pos) < a.size()) {
+            stack.push_back(heap_left(pos));
+        }
+        if (heap_right(pos) < a.size()) {
+            stack.push_back(heap_right(pos));
+        }
+    }
+    return n;
+}
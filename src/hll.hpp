@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "utils.hpp"
+
+/*
+    HyperLogLog, stored in a string value so it moves, expires and frees
+    like any string. Layout: [16-byte header][registers].
+    - Header: "HYLL", the encoding, 3 unused bytes and the cached
+      cardinality, whose top bit marks it stale.
+    - Sparse: sorted 4-byte (index << 8 | value) entries for the registers
+      that are not 0, while it takes at most `hll-sparse-max-bytes`.
+    - Dense: 16384 registers of 6 bits, 12 KB, bit i * 6 holds register i.
+    Counting unpacks every input into one byte per register, taking the
+    max across keys, then estimates from the histogram of register values
+    (Ertl, "New cardinality estimation algorithms for HyperLogLog
+    sketches", as Redis does). Both use AVX2 when the CPU has it.
+*/
+
+const size_t k_hll_p = 14;
+const size_t k_hll_registers = 1 << k_hll_p;
+const size_t k_hll_q = 64 - k_hll_p; // hash bits left for the rank
+const size_t k_hll_header = 16;
+const size_t k_hll_dense_bytes = k_hll_registers * 6 / 8;
+const size_t k_hll_dense_size = k_hll_header + k_hll_dense_bytes;
+const uint64_t k_hll_stale = 1ull << 63;
+
+enum {
+    HLL_DENSE = 0,
+    HLL_SPARSE = 1,
+};
+
+// ------------------ Hashing ------------------------
+
+// register index and value (position of the first 1 bit) of an element
+void hll_position(uint64_t hash, uint32_t &index, uint8_t &val) {
+    index = (uint32_t)(hash & (k_hll_registers - 1));
+    uint64_t rest = (hash >> k_hll_p) | (1ull << k_hll_q); // ends the count
+    val = (uint8_t)(__builtin_ctzll(rest) + 1);
+}
+
+// ------------------ Header ------------------------
+
+uint8_t hll_enc(const char *hll) { return (uint8_t)hll[4]; }
+
+uint64_t hll_card(const char *hll) {
+    uint64_t card = 0;
+    memcpy(&card, hll + 8, 8);
+    return card;
+}
+
+void hll_set_card(char *hll, uint64_t card) { memcpy(hll + 8, &card, 8); }
+
+void hll_init(char *hll, uint8_t enc) {
+    memset(hll, 0, k_hll_header);
+    memcpy(hll, "HYLL", 4);
+    hll[4] = (char)enc;
+    hll_set_card(hll, 0);
+}
+
+// sparse entries are read as u32, the buffer may be unaligned
+uint32_t hll_sparse_at(const char *hll, size_t i) {
+    uint32_t e = 0;
+    memcpy(&e, hll + k_hll_header + 4 * i, 4);
+    return e;
+}
+
+// a string holding an HLL, sparse entries sorted and in range, so a
+// string set by a client cannot break the kernels
+bool hll_check(const char *hll, size_t len) {
+    if (len < k_hll_header || memcmp(hll, "HYLL", 4) != 0) {
+        return false;
+    }
+    if (hll_enc(hll) == HLL_DENSE) {
+        return len == k_hll_dense_size;
+    }
+    if (hll_enc(hll) != HLL_SPARSE || (len - k_hll_header) % 4 != 0) {
+        return false;
+    }
+
+    size_t n = (len - k_hll_header) / 4;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t e = hll_sparse_at(hll, i);
+        if ((e >> 8) >= k_hll_registers || (e & 0xff) == 0 ||
+            (e & 0xff) > k_hll_q + 1 ||
+            (i > 0 && (hll_sparse_at(hll, i - 1) >> 8) >= (e >> 8))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ------------------ Dense encoding ------------------------
+
+uint8_t hll_dense_get(const uint8_t *regs, size_t i) {
+    size_t bit = i * 6;
+    unsigned fb = bit & 7;
+    unsigned v = regs[bit / 8] >> fb;
+    if (fb > 2) {
+        v |= regs[bit / 8 + 1] << (8 - fb);
+    }
+    return (uint8_t)(v & 63);
+}
+
+void hll_dense_set(uint8_t *regs, size_t i, uint8_t val) {
+    size_t bit = i * 6;
+    unsigned fb = bit & 7;
+    regs[bit / 8] = (uint8_t)((regs[bit / 8] & ~(63u << fb)) | (val << fb));
+    if (fb > 2) {
+        unsigned hi = 8 - fb; // bits in the next byte
+        regs[bit / 8 + 1] =
+            (uint8_t)((regs[bit / 8 + 1] & ~(63u >> hi)) | (val >> hi));
+    }
+}
+
+// returns true if the register grew
+bool hll_dense_add(char *hll, uint64_t hash) {
+    uint32_t index = 0;
+    uint8_t val = 0;
+    hll_position(hash, index, val);
+
+    uint8_t *regs = (uint8_t *)hll + k_hll_header;
+    if (hll_dense_get(regs, index) >= val) {
+        return false;
+    }
+    hll_dense_set(regs, index, val);
+    return true;
+}
+
+// pack byte registers into a dense HLL of k_hll_dense_size bytes
+void hll_dense_from(char *hll, const uint8_t *max) {
+    hll_init(hll, HLL_DENSE);
+    uint8_t *regs = (uint8_t *)hll + k_hll_header;
+    for (size_t g = 0; g < k_hll_registers / 4; g++) {
+        // 4 registers in 3 bytes
+        const uint8_t *m = max + 4 * g;
+        uint32_t w = m[0] | m[1] << 6 | m[2] << 12 | m[3] << 18;
+        regs[3 * g] = (uint8_t)w;
+        regs[3 * g + 1] = (uint8_t)(w >> 8);
+        regs[3 * g + 2] = (uint8_t)(w >> 16);
+    }
+    hll_set_card(hll, k_hll_stale);
+}
+
+// ------------------ Sparse encoding ------------------------
+
+// Returns 1 if a register grew, 0 if not, -1 if a new entry would make
+// the HLL longer than max_len. The buffer has room for one more entry.
+int hll_sparse_add(char *hll, size_t &len, size_t max_len, uint64_t hash) {
+    uint32_t index = 0;
+    uint8_t val = 0;
+    hll_position(hash, index, val);
+
+    // first entry at or after the index
+    size_t lo = 0, hi = (len - k_hll_header) / 4;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((hll_sparse_at(hll, mid) >> 8) < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    char *p = hll + k_hll_header + 4 * lo;
+    uint32_t e = index << 8 | val;
+    if (p < hll + len && (hll_sparse_at(hll, lo) >> 8) == index) {
+        if ((hll_sparse_at(hll, lo) & 0xff) >= val) {
+            return 0;
+        }
+        memcpy(p, &e, 4);
+        return 1;
+    }
+
+    if (len + 4 > max_len) {
+        return -1;
+    }
+    memmove(p + 4, p, hll + len - p);
+    memcpy(p, &e, 4);
+    len += 4;
+    return 1;
+}
+
+// ------------------ Merge and count ------------------------
+
+#if defined(__x86_64__)
+
+// Unpack 32 registers (24 bytes) per step: each 128-bit lane takes 12
+// bytes, a shuffle spreads every 3 bytes over a 32-bit word and shifts
+// move the 4 registers of a word into its 4 bytes.
+__attribute__((target("avx2"))) void hll_dense_max_avx2(const uint8_t *regs,
+                                                        uint8_t *max) {
+    const __m256i spread = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, //
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i low6 = _mm256_set1_epi32(0x3f);
+
+    // the last step runs scalar, a 16-byte load there would read past
+    // the end of the string
+    size_t steps = k_hll_registers / 32 - 1;
+    for (size_t s = 0; s < steps; s++) {
+        const uint8_t *src = regs + 24 * s;
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+            _mm_loadu_si128((const __m128i *)(src + 12)), 1);
+        __m256i w = _mm256_shuffle_epi8(v, spread);
+
+        // byte k of a word gets bits [6k, 6k + 6) of it
+        __m256i r = _mm256_and_si256(w, low6);
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(w, 2),
+                                                _mm256_slli_epi32(low6, 8)));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(w, 4),
+                                                _mm256_slli_epi32(low6, 16)));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(w, 6),
+                                                _mm256_slli_epi32(low6, 24)));
+
+        __m256i *dst = (__m256i *)(max + 32 * s);
+        _mm256_storeu_si256(
+            dst, _mm256_max_epu8(_mm256_loadu_si256(dst), r));
+    }
+    for (size_t i = 32 * steps; i < k_hll_registers; i++) {
+        max[i] = std::max(max[i], hll_dense_get(regs, i));
+    }
+}
+
+// passes over the registers worth more than the scalar histogram
+const unsigned k_hll_hist_passes = 24;
+
+// Histogram of register values: find the range of values present with
+// min/max, then count each one with compares. Registers cluster around
+// log2(n / m), so there are few passes over 16 KB of L1. Returns false,
+// leaving the histogram alone, if the range is too wide for that.
+__attribute__((target("avx2"))) bool hll_histogram_avx2(const uint8_t *max,
+                                                        uint32_t *hist) {
+    __m256i lo = _mm256_set1_epi8(-1), hi = _mm256_setzero_si256();
+    for (size_t i = 0; i < k_hll_registers; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(max + i));
+        lo = _mm256_min_epu8(lo, v);
+        hi = _mm256_max_epu8(hi, v);
+    }
+    uint8_t los[32], his[32];
+    _mm256_storeu_si256((__m256i *)los, lo);
+    _mm256_storeu_si256((__m256i *)his, hi);
+    uint8_t vmin = *std::min_element(los, los + 32);
+    uint8_t vmax = *std::max_element(his, his + 32);
+    if ((unsigned)(vmax - vmin) >= k_hll_hist_passes) {
+        return false;
+    }
+
+    for (unsigned val = vmin; val <= vmax; val++) {
+        __m256i target = _mm256_set1_epi8((char)val);
+        __m256i total = _mm256_setzero_si256();
+        // byte counters, summed before they can wrap
+        for (size_t block = 0; block < k_hll_registers; block += 32 * 128) {
+            __m256i counts = _mm256_setzero_si256();
+            for (size_t i = block; i < block + 32 * 128; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(max + i));
+                counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(v, target));
+            }
+            total = _mm256_add_epi64(
+                total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+        uint64_t sums[4];
+        _mm256_storeu_si256((__m256i *)sums, total);
+        hist[val & 63] = (uint32_t)(sums[0] + sums[1] + sums[2] + sums[3]);
+    }
+    return true;
+}
+
+bool hll_has_avx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+#endif
+
+// max[i] = max(max[i], register i) over a checked HLL
+void hll_merge(const char *hll, size_t len, uint8_t *max) {
+    if (hll_enc(hll) == HLL_SPARSE) {
+        size_t n = (len - k_hll_header) / 4;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t e = hll_sparse_at(hll, i);
+            max[e >> 8] = std::max(max[e >> 8], (uint8_t)(e & 0xff));
+        }
+        return;
+    }
+
+    const uint8_t *regs = (const uint8_t *)hll + k_hll_header;
+#if defined(__x86_64__)
+    if (hll_has_avx2()) {
+        return hll_dense_max_avx2(regs, max);
+    }
+#endif
+    for (size_t g = 0; g < k_hll_registers / 4; g++) {
+        const uint8_t *b = regs + 3 * g;
+        uint32_t w = b[0] | b[1] << 8 | b[2] << 16;
+        for (size_t k = 0; k < 4; k++) {
+            uint8_t v = (w >> (6 * k)) & 63;
+            max[4 * g + k] = std::max(max[4 * g + k], v);
+        }
+    }
+}
+
+double hll_sigma(double x) {
+    if (x == 1.) {
+        return INFINITY;
+    }
+    double y = 1, z = x, prev = 0;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+double hll_tau(double x) {
+    if (x == 0. || x == 1.) {
+        return 0.;
+    }
+    double y = 1.0, z = 1 - x, prev = 0;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2) * y;
+    } while (prev != z);
+    return z / 3;
+}
+
+// cardinality estimate from one byte per register
+uint64_t hll_estimate(const uint8_t *max) {
+    uint32_t hist[64] = {};
+    bool done = false;
+#if defined(__x86_64__)
+    done = hll_has_avx2() && hll_histogram_avx2(max, hist);
+#endif
+    if (!done) {
+        // 4 banks, so repeated values do not serialize the loop
+        uint32_t banks[4][64] = {};
+        for (size_t i = 0; i < k_hll_registers; i += 4) {
+            banks[0][max[i] & 63]++;
+            banks[1][max[i + 1] & 63]++;
+            banks[2][max[i + 2] & 63]++;
+            banks[3][max[i + 3] & 63]++;
+        }
+        for (size_t v = 0; v < 64; v++) {
+            hist[v] = banks[0][v] + banks[1][v] + banks[2][v] + banks[3][v];
+        }
+    }
+
+    double m = (double)k_hll_registers;
+    double z = m * hll_tau((m - hist[k_hll_q + 1]) / m);
+    for (size_t j = k_hll_q; j >= 1; j--) {
+        z += hist[j];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(hist[0] / m);
+    return (uint64_t)llroundl(0.5 / log(2) * m * m / z);
+}
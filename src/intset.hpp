@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+    Intersection kernels for sorted arrays of distinct int64_t.
+    Each one writes the common values to `out` in order and returns how
+    many there are, `out` needs room for min(na, nb) + 4 values.
+    - scalar: a two-pointer merge without data-dependent branches
+    - gallop: a search of the larger array per value of the smaller one,
+      used when the sizes differ by more than k_gallop_ratio
+    - avx2: compares blocks of 4 against 4 per step, picked at runtime
+      when the CPU has AVX2 so the build needs no -march flag
+*/
+
+const size_t k_gallop_ratio = 32;
+
+size_t intset_inter_scalar(const int64_t *a, size_t na, const int64_t *b,
+                           size_t nb, int64_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        int64_t x = a[i], y = b[j];
+        out[n] = x; // kept only on a match
+        n += x == y;
+        i += x <= y;
+        j += y <= x;
+    }
+    return n;
+}
+
+// `a` is the smaller array
+size_t intset_inter_gallop(const int64_t *a, size_t na, const int64_t *b,
+                           size_t nb, int64_t *out) {
+    const int64_t *lo = b, *end = b + nb;
+    size_t n = 0;
+    for (size_t i = 0; i < na && lo < end; i++) {
+        // double the step past the value, then binary search the last one
+        size_t step = 1;
+        while (step < (size_t)(end - lo) && lo[step] < a[i]) {
+            step *= 2;
+        }
+        const int64_t *hi = lo + std::min(step + 1, (size_t)(end - lo));
+        lo = std::lower_bound(lo + step / 2, hi, a[i]);
+        if (lo < end && *lo == a[i]) {
+            out[n++] = a[i];
+        }
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+
+// permutevar8x32 indices moving the 64-bit lanes of a 4-bit mask to the
+// front, indexed by the mask
+struct IntsetCompress {
+    uint32_t idx[16][8] = {};
+
+    IntsetCompress() {
+        for (uint32_t mask = 0; mask < 16; mask++) {
+            uint32_t k = 0;
+            for (uint32_t lane = 0; lane < 4; lane++) {
+                if (mask & (1u << lane)) {
+                    idx[mask][2 * k] = 2 * lane;
+                    idx[mask][2 * k + 1] = 2 * lane + 1;
+                    k++;
+                }
+            }
+        }
+    }
+};
+
+const IntsetCompress k_intset_compress;
+
+__attribute__((target("avx2"))) size_t
+intset_inter_avx2(const int64_t *a, size_t na, const int64_t *b, size_t nb,
+                  int64_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+
+        // every lane of a against every lane of b, through rotations of b
+        __m256i eq = _mm256_cmpeq_epi64(va, vb);
+        eq = _mm256_or_si256(
+            eq, _mm256_cmpeq_epi64(
+                    va, _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        eq = _mm256_or_si256(
+            eq, _mm256_cmpeq_epi64(
+                    va, _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        eq = _mm256_or_si256(
+            eq, _mm256_cmpeq_epi64(
+                    va, _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+
+        // store the matched lanes of a packed at the front
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        __m256i idx = _mm256_loadu_si256(
+            (const __m256i *)k_intset_compress.idx[mask]);
+        _mm256_storeu_si256((__m256i *)(out + n),
+                            _mm256_permutevar8x32_epi32(va, idx));
+        n += __builtin_popcount(mask);
+
+        // drop the block(s) with the smaller last value
+        int64_t a_last = a[i + 3], b_last = b[j + 3];
+        i += a_last <= b_last ? 4 : 0;
+        j += b_last <= a_last ? 4 : 0;
+    }
+    return n + intset_inter_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+bool intset_has_avx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+#endif
+
+// pick a kernel by the sizes and the CPU
+size_t intset_inter(const int64_t *a, size_t na, const int64_t *b, size_t nb,
+                    int64_t *out) {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (na * k_gallop_ratio < nb) {
+        return intset_inter_gallop(a, na, b, nb, out);
+    }
+#if defined(__x86_64__)
+    if (intset_has_avx2()) {
+        return intset_inter_avx2(a, na, b, nb, out);
+    }
+#endif
+    return intset_inter_scalar(a, na, b, nb, out);
+}
@@ -1,20 +1,36 @@
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <map>
 #include <vector>
 
+#include "aof.hpp"
+#include "bitops.hpp"
+#include "bloom.hpp"
+#include "config.hpp"
+#include "hash.hpp"
 #include "hashtable.hpp"
 #include "heap.hpp"
+#include "hll.hpp"
 #include "list.hpp"
+#include "memory.hpp"
+#include "quicklist.hpp"
+#include "set.hpp"
+#include "sketch.hpp"
+#include "snapshot.hpp"
 #include "thread_pool.hpp"
+#include "timeseries.hpp"
 #include "utils.hpp"
 #include "zset.hpp"
 
 #include <arpa/inet.h>
+#include <malloc.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 // Logging if DEBUG mode
@@ -30,11 +46,12 @@
 #define PORT_NO 1234 // Port number
 #define IP_ADDR 0    // wildcard IP 0.0.0.0
 
-#define MAX_MSG_LEN 4069
-#define MAX_MSG_ARGS 64
+#define MAX_STR_LEN (64 << 20) // longest string value, bitmaps included
 
 #define IDLE_TIMEOUT_MS 5000
 
+struct Job;
+
 struct Conn {
     int fd = -1;
 
@@ -50,15 +67,68 @@ struct Conn {
     // timer
     uint64_t last_active_ms = 0;
     DList idle_node;
+
+    // a command running in the thread pool, later requests wait for it
+    Job *job = NULL;
+    bool waiting = false; // in waiting_conns, retried after the next job
+
+    // appendfsync always: replies wait for the log to be synced this far
+    uint64_t aof_wait = 0;
+    bool held = false; // in g_aof.held
 };
 
 struct Response {
     resp_status_code status = OK;
     std::vector<uint8_t> data;
+    Job *job = NULL;   // set by commands that reply later, see job_run()
+    bool wait = false; // retry the command once a background job is done
+};
+
+// A command finishing in the thread pool. The reply is built back on
+// the event loop, where the result is also committed.
+struct Job {
+    Conn *conn = NULL;                      // NULL once the client is gone
+    void (*run)(Job *) = NULL;              // in the thread pool
+    void (*done)(Job *, Response &) = NULL; // on the event loop, frees the job
+    std::vector<std::string> cmd;           // for done() to log
 };
 
 // ---------------- KV Store Func ----------------
 
+struct Entry;
+
+// active defrag progress
+struct Defrag {
+    bool active = false;
+    size_t cursor = 0;             // next db bucket
+    std::vector<Entry *> large;    // zsets and hashes with nodes to move
+    size_t large_cursor = 0;       // next zset rank or hash bucket to visit
+    uint64_t next_run_us = 0;      // throttle for active-defrag-cycle-max
+
+    // stats
+    uint64_t moved = 0;
+    uint64_t time_us = 0;
+    uint64_t released_slabs = 0;
+};
+
+const uint64_t k_expire_slice_us = 1000;      // time slice with no backlog
+const uint64_t k_expire_slice_max_us = 25000; // longest under a backlog
+const size_t k_expire_batch = 32;             // keys between clock checks
+const uint64_t k_expire_window_ms = 100;      // for expired per second
+
+// active expiry budget and stats
+struct Expire {
+    uint64_t slice_us = k_expire_slice_us; // budget of the next cycle
+
+    // stats
+    uint64_t expired = 0;      // by the cycle
+    uint64_t expired_lazy = 0; // found on access
+    uint64_t time_us = 0;
+    uint64_t rate = 0;            // expired per second, last window
+    uint64_t window_start_ms = 0; // window for the rate
+    uint64_t window_expired = 0;  // expired before the window
+};
+
 // global state store
 struct {
 
@@ -72,48 +142,302 @@ struct {
 
     // heap for entry TTL
     std::vector<HeapItem> heap;
+    // clock for TTL checks, refreshed once per event loop iteration so a
+    // key found by one lookup of a command is still there in the next
+    uint64_t now_ms = 0;
+    Expire expire;
+    // set while the snapshot and the log are loaded, keys do not expire
+    // then so that replayed commands find what they found when logged
+    bool loading = false;
 
     // thread pool
     ThreadPool thread_pool;
 
+    // bytes queued for lazy free, not yet released
+    std::atomic<size_t> lazyfree_pending{0};
+    bool collecting = false; // slab objects freed there, left to collect
+
+    // jobs handed back by the thread pool, signalled through job_fd
+    int job_fd = -1; // eventfd
+    pthread_mutex_t job_mu;
+    std::vector<Job *> jobs_done;
+
+    // connections whose next command waits for a zset to be released
+    std::vector<Conn *> waiting_conns;
+
+    // LRU clock, refreshed once per event loop iteration
+    uint32_t lru_clock = 0;
+
+    // access frequencies for the LFU policies
+    Sketch sketch;
+
+    // active defrag
+    Defrag defrag;
+
+    // zsets with trims to purge, see trim_cron()
+    std::vector<ZSet *> trimming;
+    uint64_t trim_next_us = 0;
+
+    // stats
+    uint64_t stat_evicted = 0;
+    uint64_t stat_rejected = 0; // writes refused by LFU admission
+
 } g_data;
 
 // Value types
-// TODO: add support for list, hash, set
 enum {
     T_INIT = 0,
     T_STR = 1,  // string
     T_ZSET = 2, // sorted set
+    T_HASH = 3, // hash
+    T_LIST = 4, // list
+    T_SET = 5,  // set
+    T_BLOOM = 6, // scalable Bloom filter
+    T_TS = 7,    // time series
+};
+
+// String value encodings
+enum {
+    ENC_EMBSTR = 0, // value bytes embedded right after the key
+    ENC_RAW = 1,    // value bytes in a separate heap buffer
+    ENC_INT = 2,    // int64_t in the union, decimal bytes made on read
 };
 
+// string values up to this size are embedded in the Entry allocation
+const size_t k_embstr_max = 64;
+
 // KV pair for the top-level hashtable
+// one allocation: [Entry][key bytes][embedded value bytes]
 struct Entry {
     struct HNode node; // hashtable node
-    std::string key;
 
     // TTL
-    size_t heap_idx = -1; // arr ind to heap item
+    size_t heap_idx; // arr ind to heap item
+
+    // packed metadata
+    uint32_t type : 4; // value type
+    uint32_t enc : 4;  // string encoding
+    uint32_t lru : 24; // last access, in LRU clock ticks
+    uint32_t klen;
+    uint32_t vlen; // string value length
+    uint32_t vcap; // string value capacity (embedded or raw)
+
+    // value storage, selected by type
+    union {
+        char *raw;  // T_STR with ENC_RAW
+        int64_t ival; // T_STR with ENC_INT
+        ZSet *zset; // T_ZSET
+        Hash *hash; // T_HASH
+        QList *list; // T_LIST
+        Set *set;    // T_SET
+        Bloom *bloom; // T_BLOOM
+        TSeries *ts;  // T_TS
+    };
+
+    char key[0]; // flexible array, key + embedded value
+};
 
-    // type
-    uint32_t type = T_INIT;
+// compare an Entry against a lookup key (HKey)
+bool entry_eq(HNode *node, HNode *key) {
+    Entry *ent = container_of(node, Entry, node);
+    HKey *hkey = container_of(key, HKey, node);
 
-    // either str or Zset
-    std::string val;
-    ZSet zset;
-};
+    if (ent->klen != hkey->len) {
+        return false;
+    }
+
+    return memcmp(ent->key, hkey->name, ent->klen) == 0;
+}
 
-bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return le->key == re->key;
+char *entry_str(Entry *ent) {
+    return ent->enc == ENC_EMBSTR ? ent->key + ent->klen : ent->raw;
 }
 
-Entry *entry_new(uint32_t type) {
-    Entry *ent = new Entry();
+Entry *entry_new(uint32_t type, const std::string &key, const char *val,
+                 size_t vlen) {
+    bool embed = vlen <= k_embstr_max;
+    size_t size = sizeof(Entry) + key.size() + (embed ? vlen : 0);
+
+    Entry *ent = (Entry *)mem_alloc(size);
+    ent->node.next = NULL;
+    ent->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    ent->heap_idx = -1;
     ent->type = type;
+    ent->lru = g_data.lru_clock;
+    ent->klen = (uint32_t)key.size();
+    ent->vlen = (uint32_t)vlen;
+    ent->raw = NULL;
+    memcpy(ent->key, key.data(), key.size());
+
+    if (embed) {
+        // use the allocator's slack as extra embedded capacity
+        ent->enc = ENC_EMBSTR;
+        ent->vcap =
+            (uint32_t)(mem_usable(ent) - sizeof(Entry) - key.size());
+    } else {
+        ent->enc = ENC_RAW;
+        ent->vcap = (uint32_t)vlen;
+        ent->raw = (char *)mem_alloc(vlen);
+    }
+
+    if (vlen) {
+        memcpy(entry_str(ent), val, vlen);
+    }
+
+    if (type == T_ZSET) {
+        ent->zset = new (mem_alloc(sizeof(ZSet))) ZSet();
+    } else if (type == T_HASH) {
+        ent->hash = new (mem_alloc(sizeof(Hash))) Hash();
+    } else if (type == T_LIST) {
+        ent->list = new (mem_alloc(sizeof(QList))) QList();
+    } else if (type == T_SET) {
+        ent->set = new (mem_alloc(sizeof(Set))) Set();
+    } else if (type == T_BLOOM) {
+        ent->bloom = new (mem_alloc(sizeof(Bloom))) Bloom();
+    } else if (type == T_TS) {
+        ent->ts = new (mem_alloc(sizeof(TSeries))) TSeries();
+    }
+
+    return ent;
+}
+
+// bytes for an embedded value after the key
+uint32_t entry_emb_cap(Entry *ent) {
+    return (uint32_t)(mem_usable(ent) - sizeof(Entry) - ent->klen);
+}
+
+// overwrite a string value, in place when it fits
+void entry_set_str(Entry *ent, const char *val, size_t vlen) {
+    if (ent->enc == ENC_INT) {
+        ent->enc = ENC_EMBSTR;
+        ent->vcap = entry_emb_cap(ent);
+    }
+    if (vlen > ent->vcap) {
+        // outgrew the current buffer, move the value out of line
+        if (ent->enc == ENC_RAW) {
+            mem_free(ent->raw);
+        }
+        ent->raw = (char *)mem_alloc(vlen);
+        ent->enc = ENC_RAW;
+        ent->vcap = (uint32_t)vlen;
+    }
+
+    memcpy(entry_str(ent), val, vlen);
+    ent->vlen = (uint32_t)vlen;
+}
+
+// overwrite a string value with an integer, no bytes are kept for it
+void entry_set_int(Entry *ent, int64_t val) {
+    if (ent->enc == ENC_RAW) {
+        mem_free(ent->raw);
+    }
+    ent->enc = ENC_INT;
+    ent->ival = val;
+    ent->vlen = ent->vcap = 0;
+}
+
+// Turn an integer value back into its decimal bytes, for commands that
+// write the bytes of a string.
+void entry_decode_str(Entry *ent) {
+    if (ent->enc != ENC_INT) {
+        return;
+    }
+    char buf[24];
+    size_t n = i64_to_str(ent->ival, buf);
+    entry_set_str(ent, buf, n);
+}
+
+// make room for a string value of `cap` bytes in place, keeping the value
+void entry_reserve_str(Entry *ent, size_t cap) {
+    if (cap <= ent->vcap) {
+        return;
+    }
+
+    // grow by half so repeated small appends stay cheap
+    cap = std::max(cap, (size_t)ent->vcap + ent->vcap / 2);
+    char *raw = (char *)mem_alloc(cap);
+    memcpy(raw, entry_str(ent), ent->vlen);
+    if (ent->enc == ENC_RAW) {
+        mem_free(ent->raw);
+    }
+    ent->raw = raw;
+    ent->enc = ENC_RAW;
+    ent->vcap = (uint32_t)mem_usable(raw);
+}
+
+bool lfu_enabled() {
+    return g_config.maxmemory_policy == MM_ALLKEYS_LFU ||
+           g_config.maxmemory_policy == MM_VOLATILE_LFU;
+}
+
+// count an access in the frequency sketch, hits and misses alike
+void lfu_touch(uint64_t hcode) {
+    // keep about 16 counters per key, resizing drops the history
+    size_t want = 2 * hm_size(&g_data.db);
+    if (!g_data.sketch.table || g_data.sketch.words * 16 < want) {
+        sketch_init(&g_data.sketch, std::max(want * 2, (size_t)1024));
+    }
+    sketch_increment(&g_data.sketch, hcode);
+}
+
+void entry_del(Entry *ent);
+void aof_feed_del(Entry *ent);
+
+// the TTL of the entry has passed
+bool entry_expired(Entry *ent) {
+    return !g_data.loading && ent->heap_idx != (size_t)-1 &&
+           g_data.heap[ent->heap_idx].val < g_data.now_ms;
+}
+
+Entry *entry_lookup(const std::string &key) {
+    HKey hkey;
+    hkey.node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    hkey.name = key.data();
+    hkey.len = key.size();
+
+    if (lfu_enabled()) {
+        lfu_touch(hkey.node.hcode);
+    }
+
+    HNode *node = hm_lookup(&g_data.db, &hkey.node, &entry_eq);
+    if (!node) {
+        return NULL;
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent)) {
+        // not reached by the expiry cycle yet
+        aof_feed_del(ent);
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+        g_data.expire.expired_lazy++;
+        return NULL;
+    }
+    ent->lru = g_data.lru_clock; // record the access
     return ent;
 }
 
+// bytes held by an entry and everything it owns
+size_t entry_mem(Entry *ent) {
+    size_t n = mem_usable(ent);
+    if (ent->type == T_STR && ent->enc == ENC_RAW) {
+        n += mem_usable(ent->raw);
+    } else if (ent->type == T_ZSET) {
+        n += zset_mem(ent->zset);
+    } else if (ent->type == T_HASH) {
+        n += hash_mem(ent->hash);
+    } else if (ent->type == T_LIST) {
+        n += ql_mem(ent->list);
+    } else if (ent->type == T_SET) {
+        n += set_mem(ent->set);
+    } else if (ent->type == T_BLOOM) {
+        n += bloom_mem(ent->bloom);
+    } else if (ent->type == T_TS) {
+        n += ts_mem(ent->ts);
+    }
+    return n;
+}
+
 void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
     if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
         // setting a negative TTL means removing a TTL
@@ -127,307 +451,3789 @@ void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
     }
 }
 
+// set the TTL to end at a Unix time in ms, a past one expires the key
+void entry_set_expire_at(Entry *ent, int64_t unix_ms) {
+    int64_t ttl_ms = unix_ms - (int64_t)get_realtime_msec();
+    entry_set_ttl(ent, std::max(ttl_ms, (int64_t)0));
+}
+
 void entry_del_sync(Entry *ent) {
-    if (ent->type == T_ZSET) {
-        zset_clear(&ent->zset);
+    switch (ent->type) {
+    case T_STR:
+        if (ent->enc == ENC_RAW) {
+            mem_free(ent->raw);
+        }
+        break;
+    case T_ZSET:
+        zset_clear(ent->zset);
+        mem_free(ent->zset);
+        break;
+    case T_HASH:
+        hash_clear(ent->hash);
+        mem_free(ent->hash);
+        break;
+    case T_LIST:
+        ql_clear(ent->list);
+        mem_free(ent->list);
+        break;
+    case T_SET:
+        set_clear(ent->set);
+        mem_free(ent->set);
+        break;
+    case T_BLOOM:
+        bloom_clear(ent->bloom);
+        mem_free(ent->bloom);
+        break;
+    case T_TS:
+        ts_clear(ent->ts);
+        mem_free(ent->ts);
+        break;
     }
-    delete ent;
+    mem_free(ent);
+}
+
+void entry_del_func(void *arg) {
+    Entry *ent = (Entry *)arg;
+    size_t size = entry_mem(ent);
+    mem_lazyfree_begin();
+    entry_del_sync(ent);
+    mem_lazyfree_end(g_data.lazyfree_pending, size);
 }
 
-void entry_del_func(void *arg) { entry_del_sync((Entry *)arg); }
+void defrag_forget(Entry *ent);
+void trim_forget(ZSet *zset);
+
+// containers larger than this are freed in the thread pool
+const size_t k_large_container_size = 1000;
+// longest time spent collecting their objects per loop iteration
+const uint64_t k_collect_slice_us = 1000;
 
 void entry_del(Entry *ent) {
     entry_set_ttl(ent, -1); // remove from TTL heap
+    defrag_forget(ent);
+    if (ent->type == T_ZSET) {
+        trim_forget(ent->zset);
+    }
+
+    if (ent->type == T_ZSET && ent->zset->readers) {
+        // still read by background jobs, the last one frees it
+        ent->zset->detached = true;
+        ent->type = T_INIT;
+    }
 
     // run dectructor in thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    const size_t k_large_container_size = 1000;
+    size_t members = 0;
+    if (ent->type == T_ZSET) {
+        members = zset_size(ent->zset) + ent->zset->trimmed;
+    } else if (ent->type == T_HASH) {
+        members = hash_size(ent->hash);
+    } else if (ent->type == T_LIST) {
+        members = ql_size(ent->list);
+    } else if (ent->type == T_SET) {
+        members = set_size(ent->set);
+    } else if (ent->type == T_TS) {
+        members = ent->ts->nchunks; // one allocation each
+    }
 
-    if (set_size > k_large_container_size) {
+    if (members > k_large_container_size) {
+        g_data.lazyfree_pending += entry_mem(ent);
         thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
     } else {
         entry_del_sync(ent); // small; avoid context switches
     }
 }
 
-void conn_destroy(Conn *conn) {
-    (void)close(conn->fd);
-    g_data.fd_to_conn[conn->fd] = NULL;
-    dlist_detach(&conn->idle_node);
-    delete conn;
+void zset_del_func(void *arg) {
+    ZSet *zset = (ZSet *)arg;
+    size_t size = zset_mem(zset);
+    mem_lazyfree_begin();
+    zset_clear(zset);
+    mem_free(zset);
+    mem_lazyfree_end(g_data.lazyfree_pending, size);
+}
+
+// free a zset no key owns
+void zset_del(ZSet *zset) {
+    if (zset_size(zset) + zset->trimmed > k_large_container_size) {
+        g_data.lazyfree_pending += zset_mem(zset);
+        thread_pool_queue(&g_data.thread_pool, &zset_del_func, zset);
+    } else {
+        zset_clear(zset);
+        mem_free(zset);
+    }
+}
+
+// A zset read by background jobs must not change. Its writers wait
+// for the jobs instead of copying a possibly huge set on the event loop.
+bool zset_busy(Entry *ent, Response &out) {
+    if (!ent->zset->readers) {
+        return false;
+    }
+    out.wait = true;
+    return true;
+}
+
+// a background job is done reading a zset
+void zset_release(ZSet *zset) {
+    assert(zset->readers > 0);
+    if (--zset->readers == 0 && zset->detached) {
+        zset_del(zset);
+    }
+}
+
+// ---------------- Eviction ----------------
+
+// LRU clock resolution, 24 bits of 10ms ticks wrap after ~46 hours
+const uint64_t k_lru_resolution_ms = 10;
+const uint32_t k_lru_max = (1 << 24) - 1;
+
+uint32_t lru_clock() {
+    return (uint32_t)(get_monotonic_msec() / k_lru_resolution_ms) & k_lru_max;
+}
+
+// ticks since last access, handles clock wrap around
+uint32_t entry_idle(Entry *ent) {
+    return (g_data.lru_clock - ent->lru) & k_lru_max;
+}
+
+// memory counted against maxmemory
+size_t evict_mem_used() {
+    size_t used = mem_used();
+    size_t pending = g_data.lazyfree_pending.load();
+    return used > pending ? used - pending : 0;
+}
+
+// true if a should be evicted before b
+bool evict_better(Entry *a, Entry *b, bool lfu) {
+    if (lfu) {
+        uint32_t fa = sketch_estimate(&g_data.sketch, a->node.hcode);
+        uint32_t fb = sketch_estimate(&g_data.sketch, b->node.hcode);
+        if (fa != fb) {
+            return fa < fb;
+        }
+    }
+    return entry_idle(a) > entry_idle(b);
+}
+
+// pick the best victim out of a few sampled keys, skipping `keep`
+Entry *evict_sample(Entry *keep, bool volatile_only, bool lfu) {
+    const size_t k_max_samples = 64;
+    size_t n = std::min((size_t)g_config.maxmemory_samples, k_max_samples);
+
+    Entry *samples[k_max_samples];
+    size_t found = 0;
+
+    if (volatile_only) {
+        // keys with a TTL are exactly the heap items
+        for (; found < n && !g_data.heap.empty(); found++) {
+            size_t pos = rand_u64() % g_data.heap.size();
+            samples[found] =
+                container_of(g_data.heap[pos].ref, Entry, heap_idx);
+        }
+    } else {
+        HNode *nodes[k_max_samples];
+        found = hm_sample(&g_data.db, nodes, n);
+        for (size_t i = 0; i < found; i++) {
+            samples[i] = container_of(nodes[i], Entry, node);
+        }
+    }
+
+    Entry *best = NULL;
+    for (size_t i = 0; i < found; i++) {
+        if (samples[i] == keep) {
+            continue;
+        }
+        if (!best || evict_better(samples[i], best, lfu)) {
+            best = samples[i];
+        }
+    }
+    return best;
+}
+
+Entry *evict_pick(Entry *keep) {
+    switch (g_config.maxmemory_policy) {
+    case MM_ALLKEYS_LRU:
+        return evict_sample(keep, false, false);
+    case MM_VOLATILE_LRU:
+        return evict_sample(keep, true, false);
+    case MM_ALLKEYS_LFU:
+        return evict_sample(keep, false, true);
+    case MM_VOLATILE_LFU:
+        return evict_sample(keep, true, true);
+    case MM_ALLKEYS_RANDOM: {
+        HNode *nodes[2];
+        size_t n = hm_sample(&g_data.db, nodes, 2);
+        for (size_t i = 0; i < n; i++) {
+            if (container_of(nodes[i], Entry, node) != keep) {
+                return container_of(nodes[i], Entry, node);
+            }
+        }
+        return NULL;
+    }
+    case MM_VOLATILE_TTL: {
+        // the heap top is the key closest to expiring,
+        // otherwise one of its children
+        for (size_t pos = 0; pos < 3 && pos < g_data.heap.size(); pos++) {
+            Entry *ent = container_of(g_data.heap[pos].ref, Entry, heap_idx);
+            if (ent != keep) {
+                return ent;
+            }
+        }
+        return NULL;
+    }
+    default:
+        return NULL; // noeviction
+    }
+}
+
+// TinyLFU admission: a new key must not be colder than what it evicts
+bool lfu_admit(const std::string &key) {
+    Entry *victim = evict_pick(NULL);
+    if (!victim) {
+        return true;
+    }
+
+    uint64_t hcode = str_hash((uint8_t *)key.data(), key.size());
+    return sketch_estimate(&g_data.sketch, hcode) >
+           sketch_estimate(&g_data.sketch, victim->node.hcode);
+}
+
+// Evict keys until we are under maxmemory before writing to `ent`,
+// or to a new `key` when ent is NULL.
+// Returns false if the write must be rejected.
+bool evict_for_write(Entry *ent, const std::string &key) {
+    // the log holds the deletes of evictions, replay does not evict
+    if (g_data.loading || !g_config.maxmemory ||
+        evict_mem_used() <= g_config.maxmemory) {
+        return true;
+    }
+
+    if (!ent && lfu_enabled() && g_config.lfu_admission && !lfu_admit(key)) {
+        g_data.stat_rejected++;
+        return false;
+    }
+
+    while (evict_mem_used() > g_config.maxmemory) {
+        Entry *victim = evict_pick(ent);
+        if (!victim) {
+            return false;
+        }
+
+        LOG("Evicting key: " << std::string(victim->key, victim->klen));
+
+        aof_feed_del(victim);
+        hm_delete(&g_data.db, &victim->node, &hnode_same);
+        entry_del(victim);
+        g_data.stat_evicted++;
+    }
+
+    return true;
+}
+
+// ---------------- Active Defrag ----------------
+
+const uint64_t k_defrag_slice_us = 1000;     // longest time slice
+const uint64_t k_defrag_check_us = 100'000;  // waste check interval
+const size_t k_defrag_small = 128;           // containers moved in one go
+const size_t k_defrag_resident_slabs = 16;   // empty slabs kept for reuse
+
+// share of slab bytes defrag could win back, in percent
+int64_t defrag_waste(size_t &wasted) {
+    size_t total = 0;
+    slab_heap_usage(total, wasted);
+    return total ? (int64_t)(100 * wasted / total) : 0;
+}
+
+// stop tracking a container that is being deleted
+void defrag_forget(Entry *ent) {
+    std::vector<Entry *> &large = g_data.defrag.large;
+    for (size_t i = 0; i < large.size(); i++) {
+        if (large[i] != ent) {
+            continue;
+        }
+        if (i + 1 == large.size()) {
+            g_data.defrag.large_cursor = 0;
+        }
+        large.erase(large.begin() + i);
+        return;
+    }
+}
+
+// Move an entry and its value out of sparse slabs.
+// `from` is the hash chain pointer to the entry.
+Entry *defrag_entry(Entry *ent, HNode **from) {
+    Defrag &df = g_data.defrag;
+
+    if (Entry *copy = (Entry *)mem_defrag(ent)) {
+        *from = &copy->node;
+        if (copy->heap_idx != (size_t)-1) {
+            g_data.heap[copy->heap_idx].ref = &copy->heap_idx;
+        }
+        ent = copy;
+        df.moved++;
+    }
+
+    if (ent->type == T_STR && ent->enc == ENC_RAW) {
+        if (void *raw = mem_defrag(ent->raw)) {
+            ent->raw = (char *)raw;
+            df.moved++;
+        }
+    } else if (ent->type == T_ZSET && !ent->zset->readers) {
+        // g_data.trimming holds the address of a zset with trims
+        void *zset = ent->zset->trims ? NULL : mem_defrag(ent->zset);
+        if (zset) {
+            ent->zset = (ZSet *)zset;
+            df.moved++;
+        }
+        if (void *arr = mem_defrag(ent->zset->arr)) {
+            ent->zset->arr = (char *)arr;
+            df.moved++;
+        }
+        hm_defrag(&ent->zset->hmap);
+    } else if (ent->type == T_HASH) {
+        if (void *hash = mem_defrag(ent->hash)) {
+            ent->hash = (Hash *)hash;
+            df.moved++;
+        }
+        if (void *arr = mem_defrag(ent->hash->arr)) {
+            ent->hash->arr = (char *)arr;
+            df.moved++;
+        }
+        if (void *table = mem_defrag(ent->hash->table)) {
+            ent->hash->table = (HashTable *)table;
+            df.moved++;
+        }
+        if (ent->hash->table) {
+            hm_defrag(&ent->hash->table->hmap);
+        }
+    } else if (ent->type == T_LIST) {
+        if (void *list = mem_defrag(ent->list)) {
+            ent->list = (QList *)list;
+            ql_relink(ent->list);
+            df.moved++;
+        }
+    } else if (ent->type == T_SET) {
+        if (void *set = mem_defrag(ent->set)) {
+            ent->set = (Set *)set;
+            df.moved++;
+        }
+        if (void *ints = mem_defrag(ent->set->ints)) {
+            ent->set->ints = (int64_t *)ints;
+            df.moved++;
+        }
+        if (void *table = mem_defrag(ent->set->table)) {
+            ent->set->table = (SetTable *)table;
+            df.moved++;
+        }
+        if (ent->set->table) {
+            hm_defrag(&ent->set->table->hmap);
+        }
+    } else if (ent->type == T_BLOOM) {
+        if (void *bloom = mem_defrag(ent->bloom)) {
+            ent->bloom = (Bloom *)bloom;
+            df.moved++;
+        }
+        size_t moved = 0;
+        bloom_defrag(ent->bloom, moved);
+        df.moved += moved;
+    } else if (ent->type == T_TS) {
+        if (void *ts = mem_defrag(ent->ts)) {
+            ent->ts = (TSeries *)ts;
+            df.moved++;
+        }
+        if (void *chunks = mem_defrag(ent->ts->chunks)) {
+            ent->ts->chunks = (TSChunk **)chunks;
+            df.moved++;
+        }
+    }
+
+    return ent;
+}
+
+// Move the nodes of one zset leaf, one hash or set bucket or a batch of
+// list or time series chunks. Returns false once the container is done,
+// or a job reads the zset.
+bool defrag_nodes(Entry *ent, size_t &cursor, size_t &moved) {
+    if (ent->type == T_ZSET) {
+        return !ent->zset->readers &&
+               zset_defrag_leaf(ent->zset, cursor, moved);
+    } else if (ent->type == T_LIST) {
+        return ql_defrag_chunks(ent->list, cursor, moved);
+    } else if (ent->type == T_SET) {
+        return set_defrag_bucket(ent->set, cursor, moved);
+    } else if (ent->type == T_TS) {
+        return ts_defrag_chunks(ent->ts, cursor, moved);
+    }
+    return hash_defrag_bucket(ent->hash, cursor, moved);
+}
+
+// Run defrag until the deadline. Returns true when a full pass is done.
+bool defrag_slice(uint64_t deadline_us) {
+    Defrag &df = g_data.defrag;
+
+    for (size_t steps = 0;; steps++) {
+        if ((steps & 15) == 0 && get_monotonic_usec() >= deadline_us) {
+            return false;
+        }
+
+        // finish the nodes of large containers first, one zset leaf,
+        // hash or set bucket or batch of list or time series chunks per
+        // step
+        if (!df.large.empty()) {
+            size_t moved = 0;
+            if (!defrag_nodes(df.large.back(), df.large_cursor, moved)) {
+                df.large.pop_back();
+                df.large_cursor = 0;
+            }
+            df.moved += moved;
+            continue;
+        }
+
+        HNode **from = hm_bucket(&g_data.db, df.cursor++);
+        if (!from) {
+            df.cursor = 0;
+            return true; // pass complete
+        }
+
+        for (; *from; from = &(*from)->next) {
+            Entry *ent = defrag_entry(container_of(*from, Entry, node), from);
+            size_t size = 0;
+            if (ent->type == T_ZSET && !ent->zset->readers) {
+                size = zset_size(ent->zset);
+            } else if (ent->type == T_HASH && ent->hash->table) {
+                size = hash_size(ent->hash);
+            } else if (ent->type == T_LIST) {
+                size = ql_size(ent->list);
+            } else if (ent->type == T_SET && ent->set->table) {
+                size = set_size(ent->set);
+            } else if (ent->type == T_TS) {
+                size = ent->ts->nchunks;
+            } else {
+                continue;
+            }
+
+            if (size <= k_defrag_small) {
+                size_t moved = 0;
+                for (size_t cursor = 0; defrag_nodes(ent, cursor, moved);) {
+                }
+                df.moved += moved;
+            } else {
+                df.large.push_back(ent);
+            }
+        }
+    }
+}
+
+// called from the event loop, spends at most active-defrag-cycle-max
+// percent of the time defragging
+void defrag_cron() {
+    Defrag &df = g_data.defrag;
+
+    // return pages of empty slabs to the OS
+    df.released_slabs += slab_release_empty(k_defrag_resident_slabs);
+
+    if (!g_config.activedefrag) {
+        df.active = false;
+        df.large.clear();
+        return;
+    }
+
+    uint64_t now = get_monotonic_usec();
+    if (now < df.next_run_us) {
+        return;
+    }
+
+    size_t wasted = 0;
+    if (!df.active) {
+        int64_t pct = defrag_waste(wasted);
+        if (pct < g_config.defrag_threshold_start ||
+            wasted < g_config.defrag_ignore_bytes) {
+            df.next_run_us = now + k_defrag_check_us;
+            return;
+        }
+        LOG("Starting active defrag, waste: " << pct << "%");
+        df.active = true;
+        df.cursor = 0;
+    }
+
+    bool done = defrag_slice(now + k_defrag_slice_us);
+
+    // sleep long enough to stay under the CPU budget
+    uint64_t end = get_monotonic_usec();
+    uint64_t pct_max = (uint64_t)g_config.defrag_cycle_max;
+    df.time_us += end - now;
+    df.next_run_us = end + (end - now) * (100 - pct_max) / pct_max;
+
+    if (done) {
+        int64_t pct = defrag_waste(wasted);
+        if (pct <= g_config.defrag_threshold_stop ||
+            wasted < g_config.defrag_ignore_bytes) {
+            LOG("Active defrag done, waste: " << pct << "%");
+            df.active = false;
+        }
+    }
+}
+
+// ---------------- Trim Purge ----------------
+
+const uint64_t k_trim_slice_us = 1000; // longest time slice
+const uint64_t k_trim_pause_us = 4000; // between slices, 20% of the time
+const size_t k_trim_batch = 256;       // members between clock checks
+
+void ztrim_del_func(void *arg) {
+    ZTrim *trim = (ZTrim *)arg;
+    size_t size = ztrim_mem(trim);
+    mem_lazyfree_begin();
+    ztrim_free(trim);
+    mem_lazyfree_end(g_data.lazyfree_pending, size);
+}
+
+// free a purged trim
+void ztrim_del(ZTrim *trim) {
+    if (trim->tree.size > k_large_container_size) {
+        g_data.lazyfree_pending += ztrim_mem(trim);
+        thread_pool_queue(&g_data.thread_pool, &ztrim_del_func, trim);
+    } else {
+        ztrim_free(trim);
+    }
+}
+
+// A range was just cut from the zset. Small trims are purged now,
+// large ones by trim_cron(), which lists every zset with trims.
+void trim_start(ZSet *zset, ZTrim *trim) {
+    if (trim->tree.size <= k_large_container_size) {
+        ztrim_del(zset_purge(zset, trim->tree.size));
+    } else if (!trim->next) {
+        g_data.trimming.push_back(zset);
+    }
+}
+
+// stop purging a zset that is being deleted, its trims go with it
+void trim_forget(ZSet *zset) {
+    std::vector<ZSet *> &zsets = g_data.trimming;
+    for (size_t i = 0; i < zsets.size(); i++) {
+        if (zsets[i] == zset) {
+            zsets.erase(zsets.begin() + i);
+            return;
+        }
+    }
+}
+
+// called from the event loop, unlinks trimmed members from their
+// hashtables in short slices
+void trim_cron() {
+    uint64_t now = get_monotonic_usec();
+    if (g_data.trimming.empty() || now < g_data.trim_next_us) {
+        return;
+    }
+
+    uint64_t end = now;
+    while (!g_data.trimming.empty() && end < now + k_trim_slice_us) {
+        ZSet *zset = g_data.trimming.back();
+        if (ZTrim *trim = zset_purge(zset, k_trim_batch)) {
+            ztrim_del(trim);
+            if (!zset->trims) {
+                g_data.trimming.pop_back();
+            }
+        }
+        end = get_monotonic_usec();
+    }
+    g_data.trim_next_us = end + k_trim_pause_us;
+}
+
+// ---------------- Active Expiry ----------------
+
+// expired keys per second over the last full window
+uint64_t expire_rate(uint64_t now_ms) {
+    Expire &ex = g_data.expire;
+    uint64_t total = ex.expired + ex.expired_lazy;
+    uint64_t elapsed = now_ms - ex.window_start_ms;
+    if (elapsed >= k_expire_window_ms) {
+        ex.rate = (total - ex.window_expired) * 1000 / elapsed;
+        ex.window_start_ms = now_ms;
+        ex.window_expired = total;
+    }
+    return ex.rate;
+}
+
+// Called from the event loop, deletes keys past their TTL from the top
+// of the heap for up to one slice. The slice doubles while expired keys
+// outlast it and drops back once they are gone, so a mass expiry gets
+// more of the loop without starving clients for long.
+void expire_cron() {
+    Expire &ex = g_data.expire;
+    uint64_t now_ms = get_monotonic_msec();
+    uint64_t start = get_monotonic_usec();
+
+    size_t n = 0;
+    while (!g_data.heap.empty() && g_data.heap[0].val < now_ms) {
+        if (n % k_expire_batch == k_expire_batch - 1 &&
+            get_monotonic_usec() >= start + ex.slice_us) {
+            break;
+        }
+        Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
+        aof_feed_del(ent);
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent); // delete the key
+        n++;
+    }
+    ex.expired += n;
+
+    bool backlog = !g_data.heap.empty() && g_data.heap[0].val < now_ms;
+    ex.slice_us = backlog ? std::min(2 * ex.slice_us, k_expire_slice_max_us)
+                          : k_expire_slice_us;
+    if (n) {
+        ex.time_us += get_monotonic_usec() - start;
+    }
+    expire_rate(now_ms);
+}
+
+// ---------------- Append Only File ----------------
+
+// commands logged when they succeed, sorted for lookup
+const char *k_aof_write_cmds[] = {
+    "bf.add",      "bf.madd",          "bf.reserve",
+    "bitop",       "decr",             "decrby",
+    "del",         "expire",           "expireat",
+    "hdel",        "hincrby",          "hset",
+    "incr",        "incrby",           "incrbyfloat",
+    "lpop",        "lpush",            "ltrim",
+    "persist",     "pfadd",            "pfmerge",
+    "rpop",        "rpush",            "sadd",
+    "set",         "setbit",           "srem",
+    "ts.add",      "zadd",             "zinterstore",
+    "zrem",        "zremrangebyrank",  "zremrangebyscore",
+    "zunionstore",
+};
+
+const uint64_t k_aof_everysec_ms = 1000;
+
+// the log and the clients waiting for it
+struct Aof {
+    AofFile file;
+    std::vector<Conn *> held; // replies held until an fsync
+    uint64_t sync_ms = 0;     // last fsync request
+
+    // stats
+    uint64_t write_errors = 0;
+    uint64_t loaded_cmds = 0; // replayed at startup
+    uint64_t load_ms = 0;
+} g_aof;
+
+void do_request(std::vector<std::string> &cmd, Response &out);
+bool parse_req(const uint8_t *data, size_t len, uint64_t max_args,
+               std::vector<std::string> &cmd);
+void handle_requests(Conn *conn);
+void conn_destroy(Conn *conn);
+
+bool aof_enabled() { return g_aof.file.fd >= 0; }
+
+bool aof_is_write(const std::string &name) {
+    return std::binary_search(
+        std::begin(k_aof_write_cmds), std::end(k_aof_write_cmds),
+        name.c_str(),
+        [](const char *a, const char *b) { return strcmp(a, b) < 0; });
+}
+
+// Log a command that succeeded, returns true if it was logged. A TTL is
+// logged as the Unix time it ends at, so replay does not extend it.
+bool aof_feed(const std::vector<std::string> &cmd, resp_status_code status) {
+    if (!aof_enabled() || status != OK || !aof_is_write(cmd[0])) {
+        return false;
+    }
+    int64_t ttl_ms = 0;
+    if (cmd[0] == "expire" && str_to_i64(cmd[2], ttl_ms)) {
+        if (ttl_ms < 0) {
+            aof_append(g_aof.file, {"persist", cmd[1]});
+        } else {
+            int64_t at = (int64_t)get_realtime_msec() + ttl_ms;
+            aof_append(g_aof.file, {"expireat", cmd[1], std::to_string(at)});
+        }
+        return true;
+    }
+    aof_append(g_aof.file, cmd);
+    return true;
+}
+
+// log a write a command makes on the side, ahead of the command
+void aof_feed_cmd(const std::vector<std::string> &cmd) {
+    if (aof_enabled()) {
+        aof_append(g_aof.file, cmd);
+    }
+}
+
+// log a key deleted by expiry or eviction
+void aof_feed_del(Entry *ent) {
+    aof_feed_cmd({"del", std::string(ent->key, ent->klen)});
+}
+
+// With appendfsync always, a client's replies wait for the fsync of
+// its writes. Held clients neither read nor write until then.
+bool aof_hold(Conn *conn) {
+    if (!aof_enabled() || g_config.appendfsync != AOF_FSYNC_ALWAYS ||
+        conn->aof_wait <= g_aof.file.synced) {
+        return false;
+    }
+    if (!conn->held) {
+        conn->held = true;
+        g_aof.held.push_back(conn);
+    }
+    return true;
+}
+
+// reply to the clients whose writes are synced now
+void aof_release() {
+    if (g_aof.held.empty()) {
+        return;
+    }
+    std::vector<Conn *> held;
+    held.swap(g_aof.held);
+    for (Conn *conn : held) {
+        conn->held = false;
+        handle_requests(conn); // holds it again if not synced yet
+        if (conn->want_close) {
+            conn_destroy(conn);
+        }
+    }
+}
+
+// Called once per event loop iteration before it sleeps: write what the
+// iteration logged in one go and ask for an fsync per the policy.
+void aof_flush() {
+    AofFile &aof = g_aof.file;
+    if (!aof_enabled()) {
+        return;
+    }
+    if (!aof.buf.empty() && !aof_write(aof)) {
+        g_aof.write_errors++; // retried on the next iteration
+    }
+
+    uint64_t written = aof_written(aof);
+    if (g_config.appendfsync == AOF_FSYNC_NO || written <= aof.synced) {
+        return;
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    if (g_config.appendfsync == AOF_FSYNC_ALWAYS ||
+        now_ms >= g_aof.sync_ms + k_aof_everysec_ms) {
+        g_aof.sync_ms = now_ms;
+        aof_request_sync(aof);
+    }
+}
+
+// the next everysec fsync, -1 if none is due
+uint64_t aof_next_sync_ms() {
+    AofFile &aof = g_aof.file;
+    if (!aof_enabled() || g_config.appendfsync != AOF_FSYNC_EVERYSEC ||
+        aof.offset <= aof.synced) {
+        return (uint64_t)-1;
+    }
+    return g_aof.sync_ms + k_aof_everysec_ms;
+}
+
+// where a snapshot taken now leaves the log
+SnapAof aof_mark() {
+    SnapAof mark;
+    mark.snap_id = snap_new_id();
+    if (aof_enabled()) {
+        mark.aof_id = g_aof.file.id;
+        mark.aof_offset = g_aof.file.offset;
+    }
+    return mark;
+}
+
+// Replay the log after the snapshot in `mark`, then keep appending to
+// it. A missing log is started empty, a log cut short in its last
+// record (a crash during a write) is truncated to the records before.
+// Returns false if the log does not follow the snapshot or is damaged.
+bool aof_load(const std::string &path, const SnapAof &mark) {
+    if (access(path.c_str(), F_OK) != 0) {
+        return aof_create(path, mark.snap_id, g_aof.file);
+    }
+    SnapReader r;
+    std::string err;
+    uint64_t id = 0, base = 0;
+    if (!snap_map(path, r, err) || !aof_read_header(r, id, base)) {
+        LOG("Unable to load " << path << ": not a log");
+        snap_close(r);
+        return false;
+    }
+
+    // from the snapshot on if it was taken with this log, from the start
+    // if the log was started after it
+    uint64_t size = r.map_size;
+    if (id == mark.aof_id && mark.aof_offset > size) {
+        // the snapshot holds writes the log lost, start over from it
+        snap_close(r);
+        return aof_create(path, mark.snap_id, g_aof.file);
+    }
+    if (id == mark.aof_id) {
+        r.p = (const uint8_t *)r.map + mark.aof_offset;
+    } else if (base != mark.snap_id) {
+        LOG("Unable to load " << path << ": it does not follow "
+                              << g_config.dbfilename);
+        snap_close(r);
+        return false;
+    }
+
+    uint64_t start_ms = get_monotonic_msec();
+    const uint8_t *body = NULL;
+    uint32_t len = 0;
+    int rv = 0;
+    while (true) {
+        const uint8_t *record = r.p;
+        rv = aof_next(r, body, len);
+        if (rv == 0 || rv == -1) {
+            size = (uint64_t)(record - (const uint8_t *)r.map);
+            break;
+        }
+        std::vector<std::string> cmd;
+        // logged under the limits of their time, which may have been raised
+        if (rv < 0 || !parse_req(body, len, k_max_msg_args, cmd) ||
+            cmd.empty()) {
+            LOG("Unable to load " << path << ": damaged record at "
+                                  << record - (const uint8_t *)r.map);
+            snap_close(r);
+            return false;
+        }
+        Response resp;
+        do_request(cmd, resp);
+        if (resp.job) {
+            // no client is waiting, finish it here
+            resp.job->run(resp.job);
+            resp.job->done(resp.job, resp);
+        }
+        g_aof.loaded_cmds++;
+    }
+    snap_close(r);
+    g_aof.load_ms = get_monotonic_msec() - start_ms;
+
+    if (rv < 0) {
+        LOG("Truncating " << path << " to " << size << " bytes");
+        if (truncate(path.c_str(), (off_t)size) != 0) {
+            return false;
+        }
+    }
+    return aof_reopen(path, id, size, g_aof.file);
+}
+
+// ---------------- Snapshots ----------------
+
+const uint64_t k_snap_report_keys = 1024;  // keys between clock checks
+const uint64_t k_snap_report_ms = 100;     // between progress reports
+const uint64_t k_snap_cow_ms = 1000;       // between copy-on-write samples
+const uint64_t k_snap_poll_ms = 100;       // parent checks on the child
+
+// progress of a save, sent by a bgsave child through a pipe
+struct SnapProgress {
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t cow_bytes = 0;
+};
+
+void snap_put_field(const char *field, size_t flen, const char *val,
+                    size_t vlen, void *arg) {
+    SnapWriter &w = *(SnapWriter *)arg;
+    snap_put_str(w, field, flen);
+    snap_put_str(w, val, vlen);
+}
+
+void snap_put_member(const char *name, size_t len, void *arg) {
+    snap_put_str(*(SnapWriter *)arg, name, len);
+}
+
+void snap_put_entry(SnapWriter &w, Entry *ent) {
+    switch (ent->type) {
+    case T_STR:
+        if (ent->enc == ENC_INT) {
+            snap_put_u8(w, SNAP_INT);
+            snap_put_str(w, ent->key, ent->klen);
+            snap_put_int(w, ent->ival);
+        } else {
+            snap_put_u8(w, SNAP_STR);
+            snap_put_str(w, ent->key, ent->klen);
+            snap_put_str(w, entry_str(ent), ent->vlen);
+        }
+        break;
+    case T_ZSET: {
+        snap_put_u8(w, SNAP_ZSET);
+        snap_put_str(w, ent->key, ent->klen);
+        snap_put_len(w, zset_size(ent->zset));
+        for (ZIter it = zset_at(ent->zset, 0); ziter_valid(it);
+             ziter_next(it)) {
+            ZMember m = ziter_get(it);
+            snap_put_dbl(w, m.score);
+            snap_put_str(w, m.name, m.len);
+        }
+        break;
+    }
+    case T_HASH:
+        snap_put_u8(w, SNAP_HASH);
+        snap_put_str(w, ent->key, ent->klen);
+        snap_put_len(w, hash_size(ent->hash));
+        hash_foreach(ent->hash, &snap_put_field, &w);
+        break;
+    case T_LIST:
+        snap_put_u8(w, SNAP_LIST);
+        snap_put_str(w, ent->key, ent->klen);
+        snap_put_len(w, ql_size(ent->list));
+        if (ql_size(ent->list)) {
+            for (QIter it = ql_seek(ent->list, 0); qiter_valid(it);
+                 qiter_next(it)) {
+                snap_put_str(w, qiter_val(it), qiter_len(it));
+            }
+        }
+        break;
+    case T_SET:
+        snap_put_u8(w, SNAP_SET);
+        snap_put_str(w, ent->key, ent->klen);
+        snap_put_len(w, set_size(ent->set));
+        set_foreach(ent->set, &snap_put_member, &w);
+        break;
+    case T_BLOOM: {
+        Bloom *bf = ent->bloom;
+        snap_put_u8(w, SNAP_BLOOM);
+        snap_put_str(w, ent->key, ent->klen);
+        snap_put_len(w, bf->expansion);
+        snap_put_dbl(w, bf->error_rate);
+        snap_put_len(w, bf->nlayers);
+        for (uint32_t i = 0; i < bf->nlayers; i++) {
+            BloomLayer &l = bf->layers[i];
+            snap_put_len(w, l.nblocks);
+            snap_put_len(w, l.k);
+            snap_put_len(w, l.capacity);
+            snap_put_len(w, l.count);
+            snap_put(w, l.blocks, l.nblocks * 64);
+        }
+        break;
+    }
+    case T_TS: {
+        TSeries *ts = ent->ts;
+        snap_put_u8(w, SNAP_TS);
+        snap_put_str(w, ent->key, ent->klen);
+        snap_put_len(w, ts->nchunks);
+        for (size_t i = 0; i < ts->nchunks; i++) {
+            TSChunk *c = ts->chunks[i];
+            snap_put_int(w, c->first_ts);
+            snap_put_int(w, c->last_ts);
+            snap_put_int(w, c->last_delta);
+            snap_put(w, &c->first_val, 8);
+            snap_put(w, &c->last_val, 8);
+            snap_put_len(w, c->count);
+            snap_put_len(w, c->nbits);
+            snap_put_u8(w, c->leading);
+            snap_put_u8(w, c->trailing);
+            snap_put(w, c->data, (c->nbits + 63) / 64 * 8);
+        }
+        break;
+    }
+    }
+}
+
+// Write every live key to `path` through a temporary file, renamed over
+// it once synced. A bgsave child reports progress to `report_fd`.
+bool snap_save(const std::string &path, const SnapAof &mark, int report_fd,
+               SnapProgress &prog) {
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    SnapWriter w;
+    w.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0) {
+        LOG("Unable to open " << tmp);
+        return false;
+    }
+    w.buf.reserve(k_snap_block);
+    snap_put(w, k_snap_magic, sizeof(k_snap_magic));
+    snap_put_u8(w, SNAP_AOF);
+    snap_put(w, &mark.snap_id, 8);
+    snap_put(w, &mark.aof_id, 8);
+    snap_put_len(w, mark.aof_offset);
+
+    // the point in time of the snapshot
+    uint64_t now_ms = get_monotonic_msec();
+    uint64_t unix_ms = get_realtime_msec();
+    uint64_t report_ms = now_ms, cow_ms = now_ms;
+
+    for (size_t pos = 0;; pos++) {
+        HNode **from = hm_bucket(&g_data.db, pos);
+        if (!from) {
+            break;
+        }
+        for (HNode *node = *from; node; node = node->next) {
+            Entry *ent = container_of(node, Entry, node);
+            if (ent->heap_idx != (size_t)-1) {
+                uint64_t at = g_data.heap[ent->heap_idx].val;
+                if (at < now_ms) {
+                    continue; // expired
+                }
+                snap_put_u8(w, SNAP_EXPIRE);
+                snap_put_int(w, (int64_t)(unix_ms + (at - now_ms)));
+            }
+            snap_put_entry(w, ent);
+
+            if (++prog.keys % k_snap_report_keys || report_fd < 0) {
+                continue;
+            }
+            uint64_t ms = get_monotonic_msec();
+            if (ms - report_ms < k_snap_report_ms) {
+                continue;
+            }
+            report_ms = ms;
+            if (ms - cow_ms >= k_snap_cow_ms) {
+                cow_ms = ms;
+                prog.cow_bytes = proc_private_dirty();
+            }
+            prog.bytes = w.bytes;
+            ssize_t rv = write(report_fd, &prog, sizeof(prog)); // or drop it
+            (void)rv;
+        }
+    }
+
+    bool ok = snap_finish(w, prog.keys) && fsync(w.fd) == 0;
+    ok = close(w.fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        LOG("Unable to write " << tmp);
+        unlink(tmp.c_str());
+    }
+    prog.bytes = w.bytes;
+    return ok;
+}
+
+// one value read from a snapshot into a new entry, NULL if damaged
+Entry *snap_get_entry(SnapReader &r, uint8_t type) {
+    size_t klen = 0;
+    const char *key = snap_get_str(r, klen);
+    if (!key) {
+        return NULL;
+    }
+    std::string name(key, klen);
+
+    Entry *ent = NULL;
+    switch (type) {
+    case SNAP_STR: {
+        size_t n = 0;
+        const char *val = snap_get_str(r, n);
+        if (!val || n > MAX_STR_LEN) {
+            return NULL;
+        }
+        return entry_new(T_STR, name, val, n);
+    }
+    case SNAP_INT:
+        ent = entry_new(T_STR, name, NULL, 0);
+        entry_set_int(ent, snap_get_int(r));
+        break;
+    case SNAP_ZSET: {
+        ent = entry_new(T_ZSET, name, NULL, 0);
+        std::vector<ZMember> members;
+        for (uint64_t n = snap_get_len(r); n && !r.failed; n--) {
+            ZMember m;
+            m.score = snap_get_dbl(r);
+            m.name = snap_get_str(r, m.len);
+            members.push_back(m);
+        }
+        if (!r.failed) {
+            zset_insert_bulk(ent->zset, members.data(), members.size());
+        }
+        break;
+    }
+    case SNAP_HASH:
+        ent = entry_new(T_HASH, name, NULL, 0);
+        for (uint64_t n = snap_get_len(r); n && !r.failed; n--) {
+            size_t flen = 0, vlen = 0;
+            const char *field = snap_get_str(r, flen);
+            const char *val = snap_get_str(r, vlen);
+            if (!r.failed) {
+                hash_set(ent->hash, field, flen, val, vlen);
+            }
+        }
+        break;
+    case SNAP_LIST:
+        ent = entry_new(T_LIST, name, NULL, 0);
+        for (uint64_t n = snap_get_len(r); n && !r.failed; n--) {
+            size_t len = 0;
+            const char *val = snap_get_str(r, len);
+            if (!r.failed) {
+                ql_push(ent->list, val, len, false);
+            }
+        }
+        break;
+    case SNAP_SET:
+        ent = entry_new(T_SET, name, NULL, 0);
+        for (uint64_t n = snap_get_len(r); n && !r.failed; n--) {
+            size_t len = 0;
+            const char *val = snap_get_str(r, len);
+            if (!r.failed) {
+                set_add(ent->set, val, len);
+            }
+        }
+        break;
+    case SNAP_BLOOM: {
+        ent = entry_new(T_BLOOM, name, NULL, 0);
+        Bloom *bf = ent->bloom;
+        uint64_t expansion = snap_get_len(r);
+        bf->error_rate = snap_get_dbl(r);
+        uint64_t nlayers = snap_get_len(r);
+        bf->expansion = (uint32_t)expansion;
+        r.failed |= expansion > 32768 || nlayers == 0 ||
+                    !(bf->error_rate > 0 && bf->error_rate < 1);
+        for (; nlayers && !r.failed; nlayers--) {
+            uint64_t nblocks = snap_get_len(r);
+            uint64_t k = snap_get_len(r);
+            uint64_t capacity = snap_get_len(r);
+            uint64_t count = snap_get_len(r);
+            r.failed |= nblocks == 0 || nblocks >= k_bloom_max_blocks ||
+                        k == 0 || k > k_bloom_max_k;
+            const uint8_t *blocks =
+                r.failed ? NULL : snap_get_raw(r, nblocks * 64);
+            if (blocks) {
+                BloomLayer *l =
+                    bloom_push_layer(bf, nblocks, (uint32_t)k, capacity);
+                memcpy(l->blocks, blocks, nblocks * 64);
+                l->count = count;
+            }
+        }
+        break;
+    }
+    case SNAP_TS: {
+        ent = entry_new(T_TS, name, NULL, 0);
+        TSeries *ts = ent->ts;
+        for (uint64_t n = snap_get_len(r); n && !r.failed; n--) {
+            TSChunk tmp = {};
+            tmp.first_ts = snap_get_int(r);
+            tmp.last_ts = snap_get_int(r);
+            tmp.last_delta = snap_get_int(r);
+            const uint8_t *first_val = snap_get_raw(r, 8);
+            const uint8_t *last_val = snap_get_raw(r, 8);
+            uint64_t count = snap_get_len(r);
+            uint64_t nbits = snap_get_len(r);
+            tmp.leading = snap_get_u8(r);
+            tmp.trailing = snap_get_u8(r);
+            const uint8_t *data =
+                nbits > UINT32_MAX ? NULL
+                                   : snap_get_raw(r, (nbits + 63) / 64 * 8);
+            if (!data || count == 0 || count > UINT32_MAX) {
+                r.failed = true;
+                break;
+            }
+            TSChunk *c = ts_chunk_push(ts);
+            if (nbits > c->cap_bits) {
+                r.failed = true;
+                break;
+            }
+            uint32_t cap_bits = c->cap_bits;
+            *c = tmp;
+            c->cap_bits = cap_bits;
+            memcpy(&c->first_val, first_val, 8);
+            memcpy(&c->last_val, last_val, 8);
+            c->count = (uint32_t)count;
+            c->nbits = (uint32_t)nbits;
+            memcpy(c->data, data, (nbits + 63) / 64 * 8);
+            ts->count += count;
+        }
+        break;
+    }
+    default:
+        return NULL;
+    }
+
+    if (r.failed) {
+        entry_del_sync(ent);
+        return NULL;
+    }
+    return ent;
+}
+
+// Load a snapshot into an empty database. A missing file loads nothing,
+// a damaged one returns false.
+bool snap_load(const std::string &path, uint64_t &keys, SnapAof &mark) {
+    if (access(path.c_str(), F_OK) != 0) {
+        return true;
+    }
+    SnapReader r;
+    std::string err;
+    if (!snap_open(path, r, err)) {
+        LOG("Unable to load " << path << ": " << err);
+        return false;
+    }
+
+    // Keys that expired while down are skipped, unless the log follows:
+    // its commands ran while they were there, and it deletes them.
+    uint64_t unix_ms = get_realtime_msec();
+    bool skip_expired = !g_config.appendonly;
+    uint64_t records = 0;
+    bool ok = false;
+    if (r.p < r.end && *r.p == SNAP_AOF) {
+        r.p++;
+        const uint8_t *ids = snap_get_raw(r, 16);
+        mark.aof_offset = snap_get_len(r);
+        if (ids) {
+            memcpy(&mark.snap_id, ids, 8);
+            memcpy(&mark.aof_id, ids + 8, 8);
+        }
+    }
+    while (!r.failed) {
+        uint8_t type = snap_get_u8(r);
+        int64_t expire_at = -1;
+        if (type == SNAP_EXPIRE) {
+            expire_at = snap_get_int(r);
+            type = snap_get_u8(r);
+        }
+        if (type == SNAP_END) {
+            ok = snap_get_len(r) == records && !r.failed && r.p == r.end;
+            break;
+        }
+
+        Entry *ent = snap_get_entry(r, type);
+        if (!ent) {
+            break;
+        }
+        records++;
+        HKey hkey;
+        hkey.node.hcode = ent->node.hcode;
+        hkey.name = ent->key;
+        hkey.len = ent->klen;
+        if (hm_lookup(&g_data.db, &hkey.node, &entry_eq)) {
+            entry_del_sync(ent); // a key twice
+            break;
+        }
+        if (skip_expired && expire_at >= 0 &&
+            (uint64_t)expire_at <= unix_ms) {
+            entry_del_sync(ent); // expired while down
+            continue;
+        }
+        hm_insert(&g_data.db, &ent->node);
+        if (expire_at >= 0) {
+            entry_set_expire_at(ent, expire_at);
+        }
+        keys++;
+    }
+    snap_close(r);
+
+    if (!ok) {
+        LOG("Unable to load " << path << ": damaged record " << records);
+    }
+    return ok;
+}
+
+// bgsave children and stats of the last save
+struct Snapshot {
+    pid_t child = -1;
+    int pipe_fd = -1;        // progress reports of the child
+    uint64_t start_ms = 0;   // of the running save
+    uint64_t keys_total = 0; // in the database at the fork
+    SnapProgress progress;   // latest report
+
+    // stats
+    bool last_ok = true;
+    uint64_t last_unix_ms = 0; // end of the last successful save
+    uint64_t last_keys = 0;
+    uint64_t last_bytes = 0;
+    uint64_t last_ms = 0;
+    uint64_t last_cow_bytes = 0;
+    uint64_t last_fork_us = 0;
+    uint64_t loaded_keys = 0; // at startup
+
+    SnapAof mark; // of the running save
+} g_snap;
+
+void snap_done(bool ok, const SnapProgress &prog, uint64_t start_ms,
+               const SnapAof &mark) {
+    g_snap.last_ok = ok;
+    if (ok && aof_enabled() && mark.aof_id == g_aof.file.id) {
+        // replay starts after the snapshot, the log before it is not needed
+        aof_drop_before(g_aof.file, mark.aof_offset);
+    }
+    if (ok) {
+        g_snap.last_unix_ms = get_realtime_msec();
+        g_snap.last_keys = prog.keys;
+        g_snap.last_bytes = prog.bytes;
+        g_snap.last_ms = get_monotonic_msec() - start_ms;
+        g_snap.last_cow_bytes = prog.cow_bytes;
+    }
+}
+
+// called from the event loop, keeps the latest progress report of a
+// bgsave child and reaps it once it exits
+void snap_cron() {
+    if (g_snap.child < 0) {
+        return;
+    }
+
+    // reaped first, so that its last report is already in the pipe
+    int status = 0;
+    pid_t pid = waitpid(g_snap.child, &status, WNOHANG);
+    SnapProgress prog;
+    while (read(g_snap.pipe_fd, &prog, sizeof(prog)) == sizeof(prog)) {
+        g_snap.progress = prog;
+    }
+    if (pid == 0) {
+        return; // still running
+    }
+    bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    snap_done(ok, g_snap.progress, g_snap.start_ms, g_snap.mark);
+    if (!ok) {
+        std::string tmp = g_config.dbfilename + ".tmp." + std::to_string(pid);
+        unlink(tmp.c_str());
+    }
+    LOG("Background save " << (ok ? "done" : "failed") << ", "
+                           << g_snap.progress.keys << " keys");
+    close(g_snap.pipe_fd);
+    g_snap.pipe_fd = -1;
+    g_snap.child = -1;
+}
+
+void do_save(std::vector<std::string> &, Response &out) {
+    // command: save
+    // writes the snapshot from the event loop, blocking clients
+    if (g_snap.child >= 0) {
+        out.status = RES_ERR; // a bgsave is running
+        return out_nil(out.data);
+    }
+
+    SnapProgress prog;
+    SnapAof mark = aof_mark();
+    uint64_t start_ms = get_monotonic_msec();
+    bool ok = snap_save(g_config.dbfilename, mark, -1, prog);
+    snap_done(ok, prog, start_ms, mark);
+    if (!ok) {
+        out.status = RES_ERR;
+    }
+    out_nil(out.data);
+}
+
+void do_bgsave(std::vector<std::string> &, Response &out) {
+    // command: bgsave
+    // forks a child writing the snapshot, the pages of the fork are
+    // shared until either side writes them
+    int fds[2];
+    if (g_snap.child >= 0 || pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        out.status = RES_ERR;
+        return out_nil(out.data);
+    }
+
+    SnapAof mark = aof_mark();
+    uint64_t start_us = get_monotonic_usec();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: the database as of the fork, then exit without running
+        // the destructors of the parent's state
+        close(fds[0]);
+        SnapProgress prog;
+        bool ok = snap_save(g_config.dbfilename, mark, fds[1], prog);
+        prog.cow_bytes = proc_private_dirty();
+        ssize_t rv = write(fds[1], &prog, sizeof(prog));
+        (void)rv;
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        g_snap.last_ok = false;
+        out.status = RES_ERR;
+        return out_nil(out.data);
+    }
+
+    g_snap.child = pid;
+    g_snap.pipe_fd = fds[0];
+    g_snap.mark = mark;
+    g_snap.start_ms = start_us / 1000;
+    g_snap.keys_total = hm_size(&g_data.db);
+    g_snap.progress = SnapProgress{};
+    g_snap.last_fork_us = get_monotonic_usec() - start_us;
+    out_nil(out.data);
+}
+
+// ---------------- Background Jobs ----------------
+
+// In the thread pool: run the job, then hand it back to the event loop.
+void job_run(void *arg) {
+    Job *job = (Job *)arg;
+    job->run(job);
+
+    pthread_mutex_lock(&g_data.job_mu);
+    g_data.jobs_done.push_back(job);
+    pthread_mutex_unlock(&g_data.job_mu);
+
+    uint64_t one = 1;
+    ssize_t rv = write(g_data.job_fd, &one, sizeof(one));
+    (void)rv;
+}
+
+void conn_destroy(Conn *conn) {
+    if (conn->job) {
+        conn->job->conn = NULL; // the reply is dropped
+    }
+    if (conn->waiting) {
+        std::vector<Conn *> &waiting = g_data.waiting_conns;
+        waiting.erase(std::find(waiting.begin(), waiting.end(), conn));
+    }
+    if (conn->held) {
+        std::vector<Conn *> &held = g_aof.held;
+        held.erase(std::find(held.begin(), held.end(), conn));
+    }
+    (void)close(conn->fd);
+    g_data.fd_to_conn[conn->fd] = NULL;
+    dlist_detach(&conn->idle_node);
+    delete conn;
+}
+
+void do_get(std::vector<std::string> &cmd, Response &out) {
+    // hashtable lookup
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+
+    if (ent->type != T_STR) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    if (ent->enc == ENC_INT) {
+        char buf[20];
+        return out_str(out.data, buf, i64_to_str(ent->ival, buf));
+    }
+
+    // copy value to resp
+    assert(ent->vlen <= MAX_STR_LEN);
+    out_str(out.data, entry_str(ent), ent->vlen);
+}
+
+void do_set(std::vector<std::string> &cmd, Response &out) {
+    const std::string &val = cmd[2];
+
+    // hashtable lookup
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    if (ent && ent->type != T_STR) {
+        // set overwrites values of any type
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+        ent = NULL;
+    }
+
+    // values that read back the same as a number are kept as one
+    int64_t num = 0;
+    bool is_int = str_is_i64(val.data(), val.size(), num);
+
+    if (!ent) {
+        // not found, allocate and insert new entry
+        ent = entry_new(T_STR, cmd[1], val.data(), is_int ? 0 : val.size());
+        hm_insert(&g_data.db, &ent->node);
+    } else {
+        entry_set_ttl(ent, -1); // a new value, like one of another type
+        if (!is_int) {
+            entry_set_str(ent, val.data(), val.size());
+        }
+    }
+    if (is_int) {
+        entry_set_int(ent, num);
+    }
+
+    out_nil(out.data);
+}
+
+// lookup a string for a counter update, a missing key starts at 0
+Entry *counter_for_write(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!evict_for_write(ent, key)) {
+        out.status = ERR_OOM;
+        out_nil(out.data);
+        return NULL;
+    }
+
+    if (!ent) {
+        ent = entry_new(T_STR, key, NULL, 0);
+        entry_set_int(ent, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_STR) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    return ent;
+}
+
+void do_incrby(std::vector<std::string> &cmd, Response &out, int64_t sign) {
+    // command: incr|decr <key>, incrby|decrby <key> <increment>
+    // replies the new value, the TTL is kept
+    int64_t incr = 1;
+    if ((cmd.size() == 3 && !str_to_i64(cmd[2], incr)) ||
+        __builtin_mul_overflow(incr, sign, &incr)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = counter_for_write(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+
+    int64_t num = 0;
+    if (ent->enc == ENC_INT) {
+        num = ent->ival;
+    } else if (!str_is_i64(entry_str(ent), ent->vlen, num)) {
+        out.status = ERR_BAD_ARG; // not an integer
+        return out_nil(out.data);
+    }
+    if (__builtin_add_overflow(num, incr, &num)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    entry_set_int(ent, num);
+    out_int(out.data, num);
+}
+
+void do_incrbyfloat(std::vector<std::string> &cmd, Response &out) {
+    // command: incrbyfloat <key> <increment>
+    // replies the new value, stored as its shortest decimal string
+    double incr = 0;
+    if (!str_to_dbl(cmd[2], incr) || !std::isfinite(incr)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = counter_for_write(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+
+    double num = 0;
+    if (ent->enc == ENC_INT) {
+        num = (double)ent->ival;
+    } else if (!str_to_dbl(std::string(entry_str(ent), ent->vlen), num)) {
+        out.status = ERR_BAD_ARG; // not a number
+        return out_nil(out.data);
+    }
+    num += incr;
+    if (!std::isfinite(num)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    char buf[32];
+    size_t n = dbl_to_str(num, buf);
+    int64_t ival = 0;
+    if (str_is_i64(buf, n, ival)) {
+        entry_set_int(ent, ival);
+    } else {
+        entry_set_str(ent, buf, n);
+    }
+    out_dbl(out.data, num);
+}
+
+void do_del(std::vector<std::string> &cmd, Response &out) {
+    // lookup key
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)cmd[1].data(), cmd[1].size());
+    key.name = cmd[1].data();
+    key.len = cmd[1].size();
+
+    // hashtable delete
+    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
+    bool found = false;
+    if (node) { // deallocate the pair
+        Entry *ent = container_of(node, Entry, node);
+        found = !entry_expired(ent);
+        g_data.expire.expired_lazy += !found;
+        entry_del(ent);
+    }
+    if (!found) {
+        out.status = RES_NX;
+    }
+
+    out_int(out.data, found ? 1 : 0);
+}
+
+void do_expire(std::vector<std::string> &cmd, Response &out) {
+    // command: expire <key> <time>
+    int64_t ttl_ms = 0;
+    if (!str_to_i64(cmd[2], ttl_ms)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    // lookup entry
+    Entry *ent = entry_lookup(cmd[1]);
+
+    if (ent) {
+        entry_set_ttl(ent, ttl_ms);
+    } else {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+
+    return out_nil(out.data);
+}
+
+void do_expireat(std::vector<std::string> &cmd, Response &out) {
+    // command: expireat <key> <unix time in ms>
+    // a time in the past expires the key
+    int64_t unix_ms = 0;
+    if (!str_to_i64(cmd[2], unix_ms) || unix_ms < 0) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+    entry_set_expire_at(ent, unix_ms);
+    return out_nil(out.data);
+}
+
+void do_persist(std::vector<std::string> &cmd, Response &out) {
+    // command: persist <key>
+
+    // lookup entry
+    Entry *ent = entry_lookup(cmd[1]);
+
+    if (ent) {
+        entry_set_ttl(ent, -1);
+    } else {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+
+    return out_nil(out.data);
+}
+
+void do_zadd(std::vector<std::string> &cmd, Response &out) {
+    // command: zadd <key> <score> <name> [<score> <name> ...]
+    // nothing is written unless every score parses
+    std::vector<ZMember> members((cmd.size() - 2) / 2);
+    for (size_t i = 0; i < members.size(); i++) {
+        ZMember &m = members[i];
+        const std::string &name = cmd[3 + 2 * i];
+        if (!str_to_dbl(cmd[2 + 2 * i], m.score) || std::isnan(m.score)) {
+            out.status = ERR_BAD_ARG;
+            return out_nil(out.data);
+        }
+        m.name = name.data();
+        m.len = name.size();
+    }
+
+    // lookup or create zset
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    if (!ent) {
+        // insert new key
+        ent = entry_new(T_ZSET, cmd[1], NULL, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else {
+        if (ent->type != T_ZSET) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+    }
+
+    if (zset_busy(ent, out)) {
+        return;
+    }
+
+    // add or update the tuples
+    if (members.size() == 1) {
+        zset_insert(ent->zset, members[0].name, members[0].len,
+                    members[0].score);
+    } else {
+        zset_insert_bulk(ent->zset, members.data(), members.size());
+    }
+
+    return out_nil(out.data);
+}
+
+void do_zrem(std::vector<std::string> &cmd, Response &out) {
+    // command: zrem <key> <name>
+
+    // lookup zset
+    Entry *ent = entry_lookup(cmd[1]);
+
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else {
+        if (ent->type != T_ZSET) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+    }
+
+    if (zset_busy(ent, out)) {
+        return;
+    }
+
+    const std::string &name = cmd[2];
+    if (zset_remove(ent->zset, name.data(), name.size())) {
+        return out_int(out.data, 1);
+    } else {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+}
+
+void do_zscore(std::vector<std::string> &cmd, Response &out) {
+    // command: zscore <key> <name>
+
+    // lookup zset
+    Entry *ent = entry_lookup(cmd[1]);
+
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else {
+        if (ent->type != T_ZSET) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+    }
+
+    const std::string &name = cmd[2];
+    double score = 0;
+    if (zset_score(ent->zset, name.data(), name.size(), score)) {
+        return out_dbl(out.data, score);
+    } else {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+}
+
+void do_zquery(std::vector<std::string> &cmd, Response &out) {
+    // command: zquery <key> <score> <name> <offset> <limit>
+
+    double score = 0;
+    if (!str_to_dbl(cmd[2], score)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    const std::string &name = cmd[3];
+
+    int64_t offset = 0, limit = 0;
+    if (!str_to_i64(cmd[4], offset) || !str_to_i64(cmd[5], limit)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    // lookup zset
+    Entry *ent = entry_lookup(cmd[1]);
+
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else {
+        if (ent->type != T_ZSET) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+    }
+
+    if (limit <= 0) {
+        out_arr_begin(out.data);
+        return;
+    }
+
+    // seek to the key
+    ZIter it = zset_seek(ent->zset, score, name.data(), name.size());
+    it = zset_offset(it, offset);
+
+    // output
+    size_t cursor = out_arr_begin(out.data);
+    int64_t n = 0;
+
+    while (ziter_valid(it) && n < limit) {
+        ZMember m = ziter_get(it);
+        out_str(out.data, m.name, m.len);
+        out_dbl(out.data, m.score);
+        ziter_next(it);
+        n += 2;
+    }
+
+    out_arr_end(out.data, cursor, (uint32_t)n);
+}
+
+// lookup a zset for reading, sets the error status if there is none
+ZSet *zset_for_read(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
+        out.status = RES_NX;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (ent->type != T_ZSET) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    return ent->zset;
+}
+
+// score range bound, a leading "(" makes it exclusive
+bool parse_score_bound(const std::string &s, double &score, bool &exclusive) {
+    exclusive = !s.empty() && s[0] == '(';
+    return str_to_dbl(exclusive ? s.substr(1) : s, score) && !std::isnan(score);
+}
+
+// output `n` (name, score) pairs from rank `start`, descending if `rev`
+void out_zrange(std::vector<uint8_t> &out, ZSet *zset, size_t start, size_t n,
+                bool rev) {
+    size_t cursor = out_arr_begin(out);
+    uint32_t count = 0;
+
+    ZIter it = zset_at(zset, start);
+    for (; ziter_valid(it) && n > 0; n--) {
+        ZMember m = ziter_get(it);
+        out_str(out, m.name, m.len);
+        out_dbl(out, m.score);
+        count += 2;
+        rev ? ziter_prev(it) : ziter_next(it);
+    }
+
+    out_arr_end(out, cursor, count);
+}
+
+// A zscan cursor is the last member returned: 16 hex digits of its
+// score's bits, then its name. "0" starts from the lowest member.
+std::string zscan_cursor(const ZMember &m) {
+    uint64_t bits = 0;
+    memcpy(&bits, &m.score, 8);
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)bits);
+    return std::string(hex, 16) + std::string(m.name, m.len);
+}
+
+bool parse_zscan_cursor(const std::string &s, double &score) {
+    if (s.size() < 16) {
+        return false;
+    }
+    std::string hex = s.substr(0, 16);
+    for (char c : hex) {
+        if (!isxdigit((unsigned char)c)) {
+            return false;
+        }
+    }
+    uint64_t bits = strtoull(hex.c_str(), NULL, 16);
+    memcpy(&score, &bits, 8);
+    return !std::isnan(score);
+}
+
+void do_zscan(std::vector<std::string> &cmd, Response &out) {
+    // command: zscan <key> <cursor> <count>
+    // replies the next cursor, "0" after the last page, then up to
+    // <count> (name, score) pairs
+    const std::string &from = cmd[2];
+    double score = 0;
+    int64_t count = 0;
+    if ((from != "0" && !parse_zscan_cursor(from, score)) ||
+        !str_to_i64(cmd[3], count) || count <= 0) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    ZSet *zset = zset_for_read(cmd[1], out);
+    if (!zset) {
+        return;
+    }
+
+    // resume right after the cursor member, even if it was removed since,
+    // so members that did not change are never repeated or skipped
+    ZIter it = zset_at(zset, 0);
+    if (from != "0") {
+        const char *name = from.data() + 16;
+        size_t len = from.size() - 16;
+        it = zset_seek(zset, score, name, len);
+        if (ziter_valid(it)) {
+            ZMember m = ziter_get(it);
+            if (m.score == score && m.len == len &&
+                memcmp(m.name, name, len) == 0) {
+                ziter_next(it);
+            }
+        }
+    }
+
+    // the last member of the page is the next cursor, unless none follow
+    std::string next = "0";
+    ZIter last = zset_offset(it, count - 1);
+    if (ziter_valid(last)) {
+        ZMember m = ziter_get(last);
+        ziter_next(last);
+        if (ziter_valid(last)) {
+            next = zscan_cursor(m);
+        }
+    }
+
+    size_t cursor = out_arr_begin(out.data);
+    out_str(out.data, next.data(), next.size());
+    uint32_t n = 1;
+    for (; ziter_valid(it) && count > 0; count--) {
+        ZMember m = ziter_get(it);
+        out_str(out.data, m.name, m.len);
+        out_dbl(out.data, m.score);
+        n += 2;
+        ziter_next(it);
+    }
+    out_arr_end(out.data, cursor, n);
+}
+
+void do_zrank(std::vector<std::string> &cmd, Response &out, bool rev) {
+    // command: zrank <key> <name>, zrevrank <key> <name>
+    ZSet *zset = zset_for_read(cmd[1], out);
+    if (!zset) {
+        return;
+    }
+
+    size_t rank = 0;
+    if (!zset_rank(zset, cmd[2].data(), cmd[2].size(), rank)) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+    return out_int(out.data, rev ? zset_size(zset) - 1 - rank : rank);
+}
+
+void do_zcount(std::vector<std::string> &cmd, Response &out) {
+    // command: zcount <key> <min> <max>
+    double min = 0, max = 0;
+    bool min_ex = false, max_ex = false;
+    if (!parse_score_bound(cmd[2], min, min_ex) ||
+        !parse_score_bound(cmd[3], max, max_ex)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    ZSet *zset = zset_for_read(cmd[1], out);
+    if (!zset) {
+        return;
+    }
+
+    // members in [lo, hi) by rank
+    size_t lo = zset_rank_score(zset, min, min_ex);
+    size_t hi = zset_rank_score(zset, max, !max_ex);
+    return out_int(out.data, hi > lo ? hi - lo : 0);
+}
+
+void do_zrange(std::vector<std::string> &cmd, Response &out, bool rev) {
+    // command: zrange <key> <start> <stop>, zrevrange <key> <start> <stop>
+    // negative positions count from the end
+    int64_t start = 0, stop = 0;
+    if (!str_to_i64(cmd[2], start) || !str_to_i64(cmd[3], stop)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    ZSet *zset = zset_for_read(cmd[1], out);
+    if (!zset) {
+        return;
+    }
+
+    int64_t size = (int64_t)zset_size(zset);
+    start = start < 0 ? std::max(start + size, (int64_t)0) : start;
+    stop = stop < 0 ? stop + size : std::min(stop, size - 1);
+    if (start > stop) {
+        out_arr_begin(out.data);
+        return;
+    }
+
+    size_t first = rev ? (size_t)(size - 1 - start) : (size_t)start;
+    return out_zrange(out.data, zset, first, (size_t)(stop - start + 1), rev);
+}
+
+void do_zrangebyscore(std::vector<std::string> &cmd, Response &out, bool rev) {
+    // command: zrangebyscore <key> <min> <max> [<offset> <count>],
+    //          zrevrangebyscore <key> <max> <min> [<offset> <count>]
+    // a negative count returns everything after the offset
+    double min = 0, max = 0;
+    bool min_ex = false, max_ex = false;
+    const std::string &min_arg = rev ? cmd[3] : cmd[2];
+    const std::string &max_arg = rev ? cmd[2] : cmd[3];
+    if (!parse_score_bound(min_arg, min, min_ex) ||
+        !parse_score_bound(max_arg, max, max_ex)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    int64_t offset = 0, count = -1;
+    if (cmd.size() == 6 &&
+        (!str_to_i64(cmd[4], offset) || !str_to_i64(cmd[5], count) ||
+         offset < 0)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    ZSet *zset = zset_for_read(cmd[1], out);
+    if (!zset) {
+        return;
+    }
+
+    // members in [lo, hi) by rank
+    size_t lo = zset_rank_score(zset, min, min_ex);
+    size_t hi = zset_rank_score(zset, max, !max_ex);
+    if (hi <= lo + (size_t)offset) {
+        out_arr_begin(out.data);
+        return;
+    }
+
+    size_t n = hi - lo - (size_t)offset;
+    if (count >= 0) {
+        n = std::min(n, (size_t)count);
+    }
+    size_t first = rev ? hi - 1 - (size_t)offset : lo + (size_t)offset;
+    return out_zrange(out.data, zset, first, n, rev);
+}
+
+void do_zremrange(std::vector<std::string> &cmd, Response &out,
+                  bool by_score) {
+    // command: zremrangebyrank <key> <start> <stop>,
+    //          zremrangebyscore <key> <min> <max>
+    // replies the number of members removed
+    int64_t start = 0, stop = 0;
+    double min = 0, max = 0;
+    bool min_ex = false, max_ex = false;
+    bool ok = by_score ? parse_score_bound(cmd[2], min, min_ex) &&
+                             parse_score_bound(cmd[3], max, max_ex)
+                       : str_to_i64(cmd[2], start) && str_to_i64(cmd[3], stop);
+    if (!ok) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else if (ent->type != T_ZSET) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    if (zset_busy(ent, out)) {
+        return;
+    }
+
+    // members in [lo, hi) by rank
+    ZSet *zset = ent->zset;
+    size_t lo = 0, hi = 0;
+    if (by_score) {
+        lo = zset_rank_score(zset, min, min_ex);
+        hi = zset_rank_score(zset, max, !max_ex);
+    } else {
+        int64_t size = (int64_t)zset_size(zset);
+        start = start < 0 ? std::max(start + size, (int64_t)0) : start;
+        stop = stop < 0 ? stop + size : std::min(stop, size - 1);
+        if (start <= stop) {
+            lo = (size_t)start;
+            hi = (size_t)stop + 1;
+        }
+    }
+    if (hi <= lo) {
+        return out_int(out.data, 0);
+    }
+
+    if (hi - lo == zset_size(zset)) {
+        // removing everything removes the key, freed lazily if large
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    } else if (ZTrim *trim = zset_remove_range(zset, lo, hi)) {
+        trim_start(zset, trim);
+    }
+    return out_int(out.data, hi - lo);
+}
+
+// inputs with more members in total are combined in the thread pool
+const size_t k_zstore_async_min = 10000;
+
+// zunionstore / zinterstore running in the thread pool
+struct ZStoreJob {
+    Job job;
+    std::string dst;
+    std::vector<ZSet *> inputs; // frozen until the job is done
+    std::vector<ZSet *> by_key; // per input key as of the request, or NULL
+    std::vector<double> weights;
+    int agg = ZAGG_SUM;
+    bool inter = false;
+    ZSet *result = NULL;
+    SlabHeap *heap = NULL; // the result is built in it
+};
+
+// replace `dst` with `result`, replying with its size
+void zstore_commit(const std::string &dst, ZSet *result, Response &out) {
+    Entry *ent = entry_lookup(dst);
+    if (!evict_for_write(ent, dst)) {
+        zset_del(result);
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    if (ent) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+
+    // an empty result leaves no key
+    size_t size = zset_size(result);
+    if (size == 0) {
+        zset_del(result);
+    } else {
+        ent = entry_new(T_ZSET, dst, NULL, 0);
+        mem_free(ent->zset); // empty placeholder
+        ent->zset = result;
+        hm_insert(&g_data.db, &ent->node);
+    }
+    return out_int(out.data, (int64_t)size);
+}
+
+void zstore_run(Job *job) {
+    ZStoreJob *zj = container_of(job, ZStoreJob, job);
+    SlabHeap *own = slab_heap_swap(zj->heap);
+    zj->result = new (mem_alloc(sizeof(ZSet))) ZSet();
+    zset_combine(zj->result, zj->inputs.data(), zj->weights.data(),
+                 zj->inputs.size(), zj->agg, zj->inter);
+    slab_heap_swap(own);
+}
+
+const size_t k_zstore_log_batch = 1024; // members per logged zadd
+
+// true if every input key still holds the set the job read
+bool zstore_inputs_kept(ZStoreJob *zj, const std::vector<std::string> &cmd) {
+    for (size_t i = 0; i < zj->by_key.size(); i++) {
+        Entry *ent = entry_lookup(cmd[3 + i]);
+        ZSet *now = ent && ent->type == T_ZSET ? ent->zset : NULL;
+        if (now != zj->by_key[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// log `dst` as it is now: a del, then its members in batches
+void zstore_feed_result(const std::string &dst) {
+    aof_feed_cmd({"del", dst});
+    Entry *ent = entry_lookup(dst);
+    if (!ent) {
+        return;
+    }
+    std::vector<std::string> zadd = {"zadd", dst};
+    char buf[32];
+    for (ZIter it = zset_at(ent->zset, 0); ziter_valid(it); ziter_next(it)) {
+        ZMember m = ziter_get(it);
+        zadd.emplace_back(buf, dbl_to_str(m.score, buf));
+        zadd.emplace_back(m.name, m.len);
+        if (zadd.size() == 2 + 2 * k_zstore_log_batch) {
+            aof_feed_cmd(zadd);
+            zadd.resize(2);
+        }
+    }
+    if (zadd.size() > 2) {
+        aof_feed_cmd(zadd);
+    }
+}
+
+// The store is logged once committed, so writes to `dst` made while the
+// job ran replay ahead of it as they ran. If an input key was deleted,
+// replaced or created meanwhile, those writes are logged ahead of the
+// store too, and replaying the command would read them: the result is
+// logged instead.
+void zstore_done(Job *job, Response &out) {
+    ZStoreJob *zj = container_of(job, ZStoreJob, job);
+    bool kept = job->cmd.empty() || zstore_inputs_kept(zj, job->cmd);
+    for (ZSet *zset : zj->inputs) {
+        zset_release(zset);
+    }
+    // the event loop frees and defrags the result from now on
+    slab_heap_adopt(zj->heap);
+    zstore_commit(zj->dst, zj->result, out);
+    if (out.status == OK && !job->cmd.empty()) {
+        if (kept) {
+            aof_feed(job->cmd, out.status);
+        } else {
+            zstore_feed_result(zj->dst);
+        }
+    }
+    delete zj;
+}
+
+void do_zstore(std::vector<std::string> &cmd, Response &out, bool inter) {
+    // command: zunionstore <dst> <numkeys> <key> ... [weights <w> ...]
+    //          [aggregate sum|min|max], and zinterstore alike
+    int64_t nkeys = 0;
+    if (!str_to_i64(cmd[2], nkeys) || nkeys <= 0 ||
+        (uint64_t)nkeys > cmd.size() - 3) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    std::vector<double> weights((size_t)nkeys, 1.0);
+    int agg = ZAGG_SUM;
+    for (size_t pos = 3 + (size_t)nkeys; pos < cmd.size();) {
+        if (cmd[pos] == "weights" && pos + (size_t)nkeys < cmd.size()) {
+            for (size_t i = 0; i < weights.size(); i++) {
+                if (!str_to_dbl(cmd[pos + 1 + i], weights[i]) ||
+                    std::isnan(weights[i])) {
+                    out.status = ERR_BAD_ARG;
+                    return out_nil(out.data);
+                }
+            }
+            pos += 1 + (size_t)nkeys;
+        } else if (cmd[pos] == "aggregate" && pos + 1 < cmd.size() &&
+                   parse_enum(cmd[pos + 1], k_zset_aggregates,
+                              ARRAY_LEN(k_zset_aggregates), agg)) {
+            pos += 2;
+        } else {
+            out.status = ERR_BAD_ARG;
+            return out_nil(out.data);
+        }
+    }
+
+    // the input sets, a missing key is an empty set
+    ZStoreJob *job = new ZStoreJob();
+    job->dst = cmd[1];
+    job->agg = agg;
+    job->inter = inter;
+    bool missing = false;
+    size_t total = 0;
+    for (size_t i = 0; i < weights.size(); i++) {
+        Entry *ent = entry_lookup(cmd[3 + i]);
+        if (!ent) {
+            missing = true;
+            job->by_key.push_back(NULL);
+            continue;
+        }
+        if (ent->type != T_ZSET) {
+            delete job;
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+        job->by_key.push_back(ent->zset);
+        job->inputs.push_back(ent->zset);
+        job->weights.push_back(weights[i]);
+        total += zset_size(ent->zset);
+    }
+    if (inter && missing) {
+        job->inputs.clear(); // nothing is in every set
+        total = 0;
+    }
+
+    if (total <= k_zstore_async_min) {
+        ZSet *result = new (mem_alloc(sizeof(ZSet))) ZSet();
+        zset_combine(result, job->inputs.data(), job->weights.data(),
+                     job->inputs.size(), agg, inter);
+        zstore_commit(job->dst, result, out);
+        delete job;
+        return;
+    }
+
+    // large: combine in the thread pool, the inputs stay as they are now
+    for (ZSet *zset : job->inputs) {
+        zset->readers++;
+    }
+    job->heap = slab_job_heap();
+    job->job.run = &zstore_run;
+    job->job.done = &zstore_done;
+    out.job = &job->job;
+}
+
+// lookup a hash for reading, sets the error status if there is none
+Hash *hash_for_read(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
+        out.status = RES_NX;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (ent->type != T_HASH) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    return ent->hash;
+}
+
+// lookup or create a hash for writing, NULL with the status set on error
+Entry *hash_for_write(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!evict_for_write(ent, key)) {
+        out.status = ERR_OOM;
+        out_nil(out.data);
+        return NULL;
+    }
+
+    if (!ent) {
+        ent = entry_new(T_HASH, key, NULL, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_HASH) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    return ent;
+}
+
+void do_hset(std::vector<std::string> &cmd, Response &out) {
+    // command: hset <key> <field> <value> [<field> <value> ...]
+    // replies the number of fields added
+    Entry *ent = hash_for_write(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+
+    size_t bytes = 0;
+    for (size_t i = 2; i + 1 < cmd.size(); i += 2) {
+        bytes += 2 + cmd[i].size() + cmd[i + 1].size();
+    }
+    if (cmd.size() > 4) {
+        hash_reserve(ent->hash, (cmd.size() - 2) / 2, bytes);
+    }
+
+    int64_t added = 0;
+    for (size_t i = 2; i + 1 < cmd.size(); i += 2) {
+        added += hash_set(ent->hash, cmd[i].data(), cmd[i].size(),
+                          cmd[i + 1].data(), cmd[i + 1].size());
+    }
+    return out_int(out.data, added);
+}
+
+void do_hget(std::vector<std::string> &cmd, Response &out) {
+    // command: hget <key> <field>
+    Hash *hash = hash_for_read(cmd[1], out);
+    if (!hash) {
+        return;
+    }
+
+    const char *val = NULL;
+    size_t vlen = 0;
+    if (!hash_get(hash, cmd[2].data(), cmd[2].size(), val, vlen)) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    }
+    return out_str(out.data, val, vlen);
+}
+
+void do_hmget(std::vector<std::string> &cmd, Response &out) {
+    // command: hmget <key> <field> [<field> ...]
+    // replies a value or nil per field, all nil if there is no key
+    Entry *ent = entry_lookup(cmd[1]);
+    if (ent && ent->type != T_HASH) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    out_arr(out.data, cmd.size() - 2);
+    for (size_t i = 2; i < cmd.size(); i++) {
+        const char *val = NULL;
+        size_t vlen = 0;
+        if (ent &&
+            hash_get(ent->hash, cmd[i].data(), cmd[i].size(), val, vlen)) {
+            out_str(out.data, val, vlen);
+        } else {
+            out_nil(out.data);
+        }
+    }
+}
+
+void do_hdel(std::vector<std::string> &cmd, Response &out) {
+    // command: hdel <key> <field> [<field> ...]
+    // replies the number of fields removed, removing the last one
+    // deletes the key
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else if (ent->type != T_HASH) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        removed += hash_remove(ent->hash, cmd[i].data(), cmd[i].size());
+    }
+
+    if (hash_size(ent->hash) == 0) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out.data, removed);
+}
+
+void out_hfield(const char *field, size_t flen, const char *val, size_t vlen,
+                void *arg) {
+    std::vector<uint8_t> &out = *(std::vector<uint8_t> *)arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
+}
+
+void do_hgetall(std::vector<std::string> &cmd, Response &out) {
+    // command: hgetall <key>
+    // replies (field, value) pairs in no particular order
+    Hash *hash = hash_for_read(cmd[1], out);
+    if (!hash) {
+        return;
+    }
+
+    out_arr(out.data, 2 * hash_size(hash));
+    hash_foreach(hash, &out_hfield, &out.data);
+}
+
+void do_hincrby(std::vector<std::string> &cmd, Response &out) {
+    // command: hincrby <key> <field> <increment>
+    // a missing field counts as 0, replies the new value
+    int64_t incr = 0;
+    if (!str_to_i64(cmd[3], incr)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = hash_for_write(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+
+    const std::string &field = cmd[2];
+    const char *val = NULL;
+    size_t vlen = 0;
+    int64_t num = 0;
+    if (hash_get(ent->hash, field.data(), field.size(), val, vlen) &&
+        !str_to_i64(std::string(val, vlen), num)) {
+        out.status = ERR_BAD_ARG; // not an integer
+        return out_nil(out.data);
+    }
+    if (__builtin_add_overflow(num, incr, &num)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    std::string str = std::to_string(num);
+    hash_set(ent->hash, field.data(), field.size(), str.data(), str.size());
+    return out_int(out.data, num);
+}
+
+// lookup a list for reading, sets the error status if there is none
+QList *list_for_read(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
+        out.status = RES_NX;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (ent->type != T_LIST) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    return ent->list;
+}
+
+// normalize list positions like zrange, false if the range is empty
+bool list_range(QList *ql, int64_t &start, int64_t &stop) {
+    int64_t size = (int64_t)ql_size(ql);
+    start = start < 0 ? std::max(start + size, (int64_t)0) : start;
+    stop = stop < 0 ? stop + size : std::min(stop, size - 1);
+    return start <= stop;
+}
+
+void ql_del_func(void *arg) {
+    QList *ql = (QList *)arg;
+    size_t size = ql_mem(ql);
+    mem_lazyfree_begin();
+    ql_clear(ql);
+    mem_free(ql);
+    mem_lazyfree_end(g_data.lazyfree_pending, size);
+}
+
+void do_push(std::vector<std::string> &cmd, Response &out, bool front) {
+    // command: lpush <key> <value> [<value> ...], rpush ...
+    // replies the new length
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    if (!ent) {
+        ent = entry_new(T_LIST, cmd[1], NULL, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_LIST) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    for (size_t i = 2; i < cmd.size(); i++) {
+        ql_push(ent->list, cmd[i].data(), cmd[i].size(), front);
+    }
+    return out_int(out.data, (int64_t)ql_size(ent->list));
+}
+
+void do_pop(std::vector<std::string> &cmd, Response &out, bool front) {
+    // command: lpop <key>, rpop <key>
+    // popping the last element deletes the key
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else if (ent->type != T_LIST) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    const char *val = NULL;
+    size_t len = 0;
+    ql_peek(ent->list, front, val, len);
+    out_str(out.data, val, len);
+
+    ql_pop(ent->list, front);
+    if (ql_size(ent->list) == 0) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+}
+
+void do_llen(std::vector<std::string> &cmd, Response &out) {
+    // command: llen <key>
+    QList *ql = list_for_read(cmd[1], out);
+    if (!ql) {
+        return;
+    }
+    return out_int(out.data, (int64_t)ql_size(ql));
+}
+
+void do_lrange(std::vector<std::string> &cmd, Response &out) {
+    // command: lrange <key> <start> <stop>
+    // negative positions count from the end
+    int64_t start = 0, stop = 0;
+    if (!str_to_i64(cmd[2], start) || !str_to_i64(cmd[3], stop)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    QList *ql = list_for_read(cmd[1], out);
+    if (!ql) {
+        return;
+    }
+    if (!list_range(ql, start, stop)) {
+        out_arr_begin(out.data);
+        return;
+    }
+
+    size_t n = (size_t)(stop - start + 1);
+    out_arr(out.data, n);
+    QIter it = ql_seek(ql, (size_t)start);
+    for (size_t i = 0; i < n; i++, qiter_next(it)) {
+        out_str(out.data, qiter_val(it), qiter_len(it));
+    }
+}
+
+void do_ltrim(std::vector<std::string> &cmd, Response &out) {
+    // command: ltrim <key> <start> <stop>
+    // keeps the elements in [start, stop], keeping none deletes the key
+    int64_t start = 0, stop = 0;
+    if (!str_to_i64(cmd[2], start) || !str_to_i64(cmd[3], stop)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else if (ent->type != T_LIST) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    if (!list_range(ent->list, start, stop)) {
+        // removing everything removes the key, freed lazily if large
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+        return out_nil(out.data);
+    }
+
+    // whole chunks cut off are freed like a deleted list
+    QList *dropped = new (mem_alloc(sizeof(QList))) QList();
+    ql_trim(ent->list, (size_t)start, (size_t)stop, dropped);
+    if (ql_size(dropped) > k_large_container_size) {
+        g_data.lazyfree_pending += ql_mem(dropped);
+        thread_pool_queue(&g_data.thread_pool, &ql_del_func, dropped);
+    } else {
+        ql_clear(dropped);
+        mem_free(dropped);
+    }
+    out_nil(out.data);
+}
+
+// lookup a set for reading, sets the error status if there is none
+Set *set_for_read(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
+        out.status = RES_NX;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (ent->type != T_SET) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    return ent->set;
+}
+
+void do_sadd(std::vector<std::string> &cmd, Response &out) {
+    // command: sadd <key> <member> [<member> ...]
+    // replies the number of members added
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    if (!ent) {
+        ent = entry_new(T_SET, cmd[1], NULL, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_SET) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    Set *set = ent->set;
+    if (!set->table && cmd.size() > 3) {
+        // integers that fit the intset are merged in at once
+        std::vector<int64_t> vals;
+        int64_t val = 0;
+        for (size_t i = 2; i < cmd.size(); i++) {
+            if (!set_int(cmd[i].data(), cmd[i].size(), val)) {
+                break;
+            }
+            vals.push_back(val);
+        }
+        if (vals.size() == cmd.size() - 2 &&
+            set->n + vals.size() <= (uint64_t)g_config.set_max_intset_entries) {
+            return out_int(out.data, (int64_t)set_add_ints(set, vals));
+        }
+    }
+
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        added += set_add(set, cmd[i].data(), cmd[i].size());
+    }
+    return out_int(out.data, added);
+}
+
+void do_srem(std::vector<std::string> &cmd, Response &out) {
+    // command: srem <key> <member> [<member> ...]
+    // replies the number of members removed, removing the last one
+    // deletes the key
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!ent) {
+        out.status = RES_NX;
+        return out_nil(out.data);
+    } else if (ent->type != T_SET) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        removed += set_remove(ent->set, cmd[i].data(), cmd[i].size());
+    }
+
+    if (set_size(ent->set) == 0) {
+        hm_delete(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out.data, removed);
+}
+
+void do_sismember(std::vector<std::string> &cmd, Response &out) {
+    // command: sismember <key> <member>
+    // replies 1 or 0
+    Set *set = set_for_read(cmd[1], out);
+    if (!set) {
+        return;
+    }
+    return out_int(out.data, set_contains(set, cmd[2].data(), cmd[2].size()));
+}
+
+void do_scard(std::vector<std::string> &cmd, Response &out) {
+    // command: scard <key>
+    Set *set = set_for_read(cmd[1], out);
+    if (!set) {
+        return;
+    }
+    return out_int(out.data, (int64_t)set_size(set));
+}
+
+// The sets of sinter/sunion/sdiff, a missing key is an empty set (NULL).
+// False with the status set if a key holds another type.
+bool sets_for_read(std::vector<std::string> &cmd, std::vector<Set *> &sets,
+                   Response &out) {
+    for (size_t i = 1; i < cmd.size(); i++) {
+        Entry *ent = entry_lookup(cmd[i]);
+        if (ent && ent->type != T_SET) {
+            out.status = ERR_BAD_TYPE;
+            out_nil(out.data);
+            return false;
+        }
+        sets.push_back(ent ? ent->set : NULL);
+    }
+    return true;
+}
+
+bool sets_all_ints(const std::vector<Set *> &sets) {
+    for (Set *set : sets) {
+        if (set && set->table) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void out_ints(std::vector<uint8_t> &out, const int64_t *ints, size_t n) {
+    out_arr(out, n);
+    char buf[24];
+    for (size_t i = 0; i < n; i++) {
+        out_str(out, buf, set_int_str(ints[i], buf));
+    }
+}
+
+// members of one set filtered against the others
+struct SetFilter {
+    std::vector<uint8_t> *out = NULL;
+    Set *const *others = NULL;
+    size_t nothers = 0;
+    bool keep_common = false; // sinter keeps members in all, sdiff in none
+    uint32_t n = 0;
+};
+
+void out_filtered(const char *name, size_t len, void *arg) {
+    SetFilter *f = (SetFilter *)arg;
+    for (size_t i = 0; i < f->nothers; i++) {
+        Set *set = f->others[i];
+        bool found = set && set_contains(set, name, len);
+        if (found != f->keep_common) {
+            return;
+        }
+    }
+    out_str(*f->out, name, len);
+    f->n++;
+}
+
+void out_member(const char *name, size_t len, void *arg) {
+    out_str(*(std::vector<uint8_t> *)arg, name, len);
+}
+
+void add_member(const char *name, size_t len, void *arg) {
+    set_add((Set *)arg, name, len);
+}
+
+void do_sinter(std::vector<std::string> &cmd, Response &out) {
+    // command: sinter <key> [<key> ...]
+    std::vector<Set *> sets;
+    if (!sets_for_read(cmd, sets, out)) {
+        return;
+    }
+
+    // smallest first, a missing key empties the result
+    auto size_of = [](Set *set) { return set ? set_size(set) : 0; };
+    std::sort(sets.begin(), sets.end(),
+              [&](Set *a, Set *b) { return size_of(a) < size_of(b); });
+    if (!sets[0]) {
+        return out_arr(out.data, 0);
+    }
+
+    if (!sets_all_ints(sets)) {
+        // probe the others with each member of the smallest
+        SetFilter f;
+        f.out = &out.data;
+        f.others = sets.data() + 1;
+        f.nothers = sets.size() - 1;
+        f.keep_common = true;
+        size_t cursor = out_arr_begin(out.data);
+        set_foreach(sets[0], &out_filtered, &f);
+        return out_arr_end(out.data, cursor, f.n);
+    }
+
+    // intersect sorted arrays, the running result only shrinks
+    const int64_t *cur = sets[0]->ints;
+    size_t n = sets[0]->n;
+    std::vector<int64_t> acc, tmp;
+    for (size_t i = 1; i < sets.size() && n > 0; i++) {
+        tmp.resize(n + 4);
+        n = intset_inter(cur, n, sets[i]->ints, sets[i]->n, tmp.data());
+        acc.swap(tmp);
+        cur = acc.data();
+    }
+    return out_ints(out.data, cur, n);
+}
+
+void do_sunion(std::vector<std::string> &cmd, Response &out) {
+    // command: sunion <key> [<key> ...]
+    std::vector<Set *> sets;
+    if (!sets_for_read(cmd, sets, out)) {
+        return;
+    }
+
+    if (!sets_all_ints(sets)) {
+        // collect into a scratch table, which dedups
+        Set tmp;
+        set_convert(&tmp);
+        for (Set *set : sets) {
+            if (set) {
+                set_foreach(set, &add_member, &tmp);
+            }
+        }
+        out_arr(out.data, set_size(&tmp));
+        set_foreach(&tmp, &out_member, &out.data);
+        return set_clear(&tmp);
+    }
+
+    std::vector<int64_t> acc, tmp;
+    for (Set *set : sets) {
+        if (set) {
+            tmp.clear();
+            std::set_union(acc.begin(), acc.end(), set->ints,
+                           set->ints + set->n, std::back_inserter(tmp));
+            acc.swap(tmp);
+        }
+    }
+    return out_ints(out.data, acc.data(), acc.size());
+}
+
+void do_sdiff(std::vector<std::string> &cmd, Response &out) {
+    // command: sdiff <key> [<key> ...]
+    // members of the first set in none of the others
+    std::vector<Set *> sets;
+    if (!sets_for_read(cmd, sets, out)) {
+        return;
+    }
+    if (!sets[0]) {
+        return out_arr(out.data, 0);
+    }
+
+    if (!sets_all_ints(sets)) {
+        SetFilter f;
+        f.out = &out.data;
+        f.others = sets.data() + 1;
+        f.nothers = sets.size() - 1;
+        f.keep_common = false;
+        size_t cursor = out_arr_begin(out.data);
+        set_foreach(sets[0], &out_filtered, &f);
+        return out_arr_end(out.data, cursor, f.n);
+    }
+
+    std::vector<int64_t> acc(sets[0]->ints, sets[0]->ints + sets[0]->n);
+    std::vector<int64_t> tmp;
+    for (size_t i = 1; i < sets.size() && !acc.empty(); i++) {
+        if (Set *set = sets[i]) {
+            tmp.clear();
+            std::set_difference(acc.begin(), acc.end(), set->ints,
+                                set->ints + set->n, std::back_inserter(tmp));
+            acc.swap(tmp);
+        }
+    }
+    return out_ints(out.data, acc.data(), acc.size());
+}
+
+// a string value holding a HyperLogLog
+bool entry_is_hll(Entry *ent) {
+    return ent->type == T_STR && ent->enc != ENC_INT &&
+           hll_check(entry_str(ent), ent->vlen);
+}
+
+// rewrite a sparse HyperLogLog as dense
+void hll_to_dense(Entry *ent) {
+    uint8_t max[k_hll_registers] = {};
+    hll_merge(entry_str(ent), ent->vlen, max);
+
+    std::vector<char> dense(k_hll_dense_size);
+    hll_dense_from(dense.data(), max);
+    entry_set_str(ent, dense.data(), dense.size());
+}
+
+void do_pfadd(std::vector<std::string> &cmd, Response &out) {
+    // command: pfadd <key> [<element> ...]
+    // replies 1 if the key was created or the estimate may have changed
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    bool created = false;
+    if (!ent) {
+        char hll[k_hll_header];
+        hll_init(hll, HLL_SPARSE);
+        ent = entry_new(T_STR, cmd[1], hll, k_hll_header);
+        hm_insert(&g_data.db, &ent->node);
+        created = true;
+    } else if (!entry_is_hll(ent)) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+
+    size_t max_len = k_hll_header + (size_t)g_config.hll_sparse_max_bytes;
+    bool grew = false;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        uint64_t hash = str_hash64(cmd[i].data(), cmd[i].size());
+        if (hll_enc(entry_str(ent)) == HLL_SPARSE) {
+            entry_reserve_str(ent, ent->vlen + 4);
+            size_t len = ent->vlen;
+            int res = hll_sparse_add(entry_str(ent), len, max_len, hash);
+            ent->vlen = (uint32_t)len;
+            if (res >= 0) {
+                grew |= res > 0;
+                continue;
+            }
+            hll_to_dense(ent); // full
+        }
+        grew |= hll_dense_add(entry_str(ent), hash);
+    }
+
+    if (grew) {
+        hll_set_card(entry_str(ent), k_hll_stale);
+    }
+    return out_int(out.data, created || grew);
+}
+
+void do_pfcount(std::vector<std::string> &cmd, Response &out) {
+    // command: pfcount <key> [<key> ...]
+    // replies the estimated number of distinct elements over the union,
+    // missing keys count as empty
+    if (cmd.size() == 2) {
+        // one key, use and refresh the cached estimate
+        Entry *ent = entry_lookup(cmd[1]);
+        if (!ent) {
+            return out_int(out.data, 0);
+        } else if (!entry_is_hll(ent)) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+
+        char *hll = entry_str(ent);
+        uint64_t card = hll_card(hll);
+        if (card & k_hll_stale) {
+            uint8_t max[k_hll_registers] = {};
+            hll_merge(hll, ent->vlen, max);
+            card = hll_estimate(max);
+            hll_set_card(hll, card);
+        }
+        return out_int(out.data, (int64_t)card);
+    }
+
+    uint8_t max[k_hll_registers] = {};
+    for (size_t i = 1; i < cmd.size(); i++) {
+        Entry *ent = entry_lookup(cmd[i]);
+        if (!ent) {
+            continue;
+        } else if (!entry_is_hll(ent)) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+        hll_merge(entry_str(ent), ent->vlen, max);
+    }
+    return out_int(out.data, (int64_t)hll_estimate(max));
+}
+
+void do_pfmerge(std::vector<std::string> &cmd, Response &out) {
+    // command: pfmerge <dst> <src> [<src> ...]
+    // stores the union of dst and the sources in dst, dense
+    Entry *dst = entry_lookup(cmd[1]);
+    if (!evict_for_write(dst, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    uint8_t max[k_hll_registers] = {};
+    for (size_t i = 1; i < cmd.size(); i++) {
+        Entry *ent = entry_lookup(cmd[i]);
+        if (!ent) {
+            continue;
+        } else if (!entry_is_hll(ent)) {
+            out.status = ERR_BAD_TYPE;
+            return out_nil(out.data);
+        }
+        hll_merge(entry_str(ent), ent->vlen, max);
+    }
+
+    std::vector<char> dense(k_hll_dense_size);
+    hll_dense_from(dense.data(), max);
+    if (!dst) {
+        dst = entry_new(T_STR, cmd[1], dense.data(), dense.size());
+        hm_insert(&g_data.db, &dst->node);
+    } else {
+        entry_set_str(dst, dense.data(), dense.size());
+    }
+    out_nil(out.data);
+}
+
+// longest bitmap, so that get can still return it whole
+const uint64_t k_bit_max_bytes = MAX_STR_LEN;
+
+// parse a bit offset, false past the longest bitmap
+bool parse_bit_offset(const std::string &s, uint64_t &offset) {
+    int64_t val = 0;
+    if (!str_to_i64(s, val) || val < 0 ||
+        (uint64_t)val >= k_bit_max_bytes * 8) {
+        return false;
+    }
+    offset = (uint64_t)val;
+    return true;
+}
+
+// normalize byte positions like lrange, false if the range is empty
+bool bit_range(size_t len, int64_t &start, int64_t &end) {
+    int64_t size = (int64_t)len;
+    start = start < 0 ? std::max(start + size, (int64_t)0) : start;
+    end = end < 0 ? end + size : std::min(end, size - 1);
+    return start <= end;
+}
+
+// The bytes of a string for a bit command to read. An integer value is
+// formatted into `buf`, the entry keeps its encoding.
+struct BitsRead {
+    Entry *ent = NULL; // NULL for a missing key
+    size_t len = 0;
+    char buf[24];
+};
+
+const uint8_t *bits_data(const BitsRead &bits) {
+    if (!bits.ent) {
+        return NULL;
+    }
+    return (const uint8_t *)(bits.ent->enc == ENC_INT ? bits.buf
+                                                      : entry_str(bits.ent));
+}
+
+// lookup a string for a bit command, sets the error status if it is not
+// a string, missing keys are not an error
+bool bits_for_read(const std::string &key, BitsRead &bits, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (ent && ent->type != T_STR) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return false;
+    }
+    bits.ent = ent;
+    if (!ent) {
+        bits.len = 0;
+    } else if (ent->enc == ENC_INT) {
+        bits.len = i64_to_str(ent->ival, bits.buf); // its decimal digits
+    } else {
+        bits.len = ent->vlen;
+    }
+    return true;
+}
+
+void do_setbit(std::vector<std::string> &cmd, Response &out) {
+    // command: setbit <key> <offset> 0|1
+    // replies the previous bit, the string grows with zeros to fit
+    uint64_t offset = 0;
+    if (!parse_bit_offset(cmd[2], offset) ||
+        (cmd[3] != "0" && cmd[3] != "1")) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    if (!ent) {
+        ent = entry_new(T_STR, cmd[1], NULL, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_STR) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
+    entry_decode_str(ent);
+
+    size_t byte = offset / 8;
+    if (byte >= ent->vlen) {
+        entry_reserve_str(ent, byte + 1);
+        memset(entry_str(ent) + ent->vlen, 0, byte + 1 - ent->vlen);
+        ent->vlen = (uint32_t)(byte + 1);
+    }
+
+    uint8_t *p = (uint8_t *)entry_str(ent) + byte;
+    uint8_t mask = (uint8_t)(0x80 >> (offset % 8));
+    bool old = *p & mask;
+    *p = cmd[3] == "1" ? *p | mask : *p & ~mask;
+    out_int(out.data, old);
+}
+
+void do_getbit(std::vector<std::string> &cmd, Response &out) {
+    // command: getbit <key> <offset>
+    // bits past the end of the string, or of a missing key, are 0
+    uint64_t offset = 0;
+    if (!parse_bit_offset(cmd[2], offset)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    BitsRead bits;
+    if (!bits_for_read(cmd[1], bits, out)) {
+        return;
+    }
+    size_t byte = offset / 8;
+    if (byte >= bits.len) {
+        return out_int(out.data, 0);
+    }
+    uint8_t val = bits_data(bits)[byte];
+    out_int(out.data, (val >> (7 - offset % 8)) & 1);
+}
+
+void do_bitcount(std::vector<std::string> &cmd, Response &out) {
+    // command: bitcount <key> [<start> <end>]
+    // positions are bytes, inclusive, negative ones count from the end
+    int64_t start = 0, end = -1;
+    if (cmd.size() == 4 &&
+        (!str_to_i64(cmd[2], start) || !str_to_i64(cmd[3], end))) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    BitsRead bits;
+    if (!bits_for_read(cmd[1], bits, out)) {
+        return;
+    }
+    if (!bit_range(bits.len, start, end)) {
+        return out_int(out.data, 0);
+    }
+    const uint8_t *p = bits_data(bits);
+    out_int(out.data, (int64_t)bit_count(p + start, (size_t)(end - start + 1)));
+}
+
+void do_bitpos(std::vector<std::string> &cmd, Response &out) {
+    // command: bitpos <key> 0|1 [<start> [<end>]]
+    // replies the position of the first such bit in the byte range, or
+    // -1. Without an end the string counts as followed by zeros, so a
+    // search for 0 over all ones replies the first bit past it.
+    int64_t start = 0, end = -1;
+    if ((cmd[2] != "0" && cmd[2] != "1") ||
+        (cmd.size() >= 4 && !str_to_i64(cmd[3], start)) ||
+        (cmd.size() == 5 && !str_to_i64(cmd[4], end))) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+    bool bit = cmd[2] == "1";
+
+    BitsRead bits;
+    if (!bits_for_read(cmd[1], bits, out)) {
+        return;
+    }
+    if (bits.len == 0) {
+        return out_int(out.data, bit ? -1 : 0);
+    }
+    if (!bit_range(bits.len, start, end)) {
+        return out_int(out.data, -1);
+    }
+
+    const uint8_t *p = bits_data(bits) + start;
+    int64_t pos = bit_pos(p, (size_t)(end - start + 1), bit);
+    if (pos >= 0) {
+        return out_int(out.data, start * 8 + pos);
+    }
+    if (!bit && cmd.size() < 5) {
+        return out_int(out.data, (end + 1) * 8);
+    }
+    out_int(out.data, -1);
+}
+
+void do_bitop(std::vector<std::string> &cmd, Response &out) {
+    // command: bitop and|or|xor|not <dst> <key> [<key> ...]
+    // stores the result in dst and replies its length. Shorter inputs
+    // and missing keys count as zeros, not takes one key. An empty
+    // result deletes dst.
+    static const char *k_ops[] = {"and", "or", "xor", "not"};
+    int op = -1;
+    for (int i = 0; i < 4; i++) {
+        op = cmd[1] == k_ops[i] ? i : op;
+    }
+    if (op < 0 || (op == BITOP_NOT && cmd.size() != 4)) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    // evict first, it could pick an input
+    Entry *dst = entry_lookup(cmd[2]);
+    if (!evict_for_write(dst, cmd[2])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    std::vector<BitsRead> srcs(cmd.size() - 3);
+    size_t len = 0;
+    for (size_t i = 0; i < srcs.size(); i++) {
+        if (!bits_for_read(cmd[3 + i], srcs[i], out)) {
+            return;
+        }
+        len = std::max(len, srcs[i].len);
+    }
+
+    // the first input is copied, each next one applied over the result
+    std::vector<uint8_t> res(len, 0);
+    for (size_t i = 0; i < srcs.size(); i++) {
+        size_t n = srcs[i].len;
+        const uint8_t *p = n ? bits_data(srcs[i]) : NULL;
+        if (op == BITOP_NOT) {
+            bitop(op, res.data(), p, n);
+        } else if (i == 0) {
+            std::copy(p, p + n, res.begin());
+        } else {
+            bitop(op, res.data(), p, n);
+            if (op == BITOP_AND) {
+                std::fill(res.begin() + n, res.end(), 0);
+            }
+        }
+    }
+
+    if (dst && (len == 0 || dst->type != T_STR)) {
+        hm_delete(&g_data.db, &dst->node, &hnode_same);
+        entry_del(dst);
+        dst = NULL;
+    }
+    if (len == 0) {
+        return out_int(out.data, 0);
+    }
+    if (!dst) {
+        dst = entry_new(T_STR, cmd[2], (const char *)res.data(), len);
+        hm_insert(&g_data.db, &dst->node);
+    } else {
+        entry_set_str(dst, (const char *)res.data(), len);
+    }
+    out_int(out.data, (int64_t)len);
+}
+
+// lookup a Bloom filter for reading, missing keys are not an error
+bool bloom_for_read(const std::string &key, Entry *&ent, Response &out) {
+    ent = entry_lookup(key);
+    if (ent && ent->type != T_BLOOM) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return false;
+    }
+    return true;
+}
+
+// lookup or create a Bloom filter for adding, NULL on error
+Entry *bloom_for_write(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!evict_for_write(ent, key)) {
+        out.status = ERR_OOM;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (ent && ent->type != T_BLOOM) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (!ent) {
+        ent = entry_new(T_BLOOM, key, NULL, 0);
+        bool ok = bloom_init(ent->bloom, (uint64_t)g_config.bf_initial_size,
+                             g_config.bf_error_rate,
+                             (uint32_t)g_config.bf_expansion_factor);
+        assert(ok); // the config bounds keep the first layer small
+        (void)ok;
+        hm_insert(&g_data.db, &ent->node);
+
+        // logged with the parameters it got, the config may differ on
+        // replay
+        char rate[32];
+        aof_feed_cmd({"bf.reserve", key,
+                      std::string(rate, dbl_to_str(g_config.bf_error_rate,
+                                                   rate)),
+                      std::to_string(g_config.bf_initial_size), "expansion",
+                      std::to_string(g_config.bf_expansion_factor)});
+    }
+    return ent;
+}
+
+void do_bf_reserve(std::vector<std::string> &cmd, Response &out) {
+    // command: bf.reserve <key> <error_rate> <capacity>
+    //          [expansion <n>] [nonscaling]
+    // creates an empty filter, fails if the key exists
+    double rate = 0;
+    int64_t capacity = 0, expansion = g_config.bf_expansion_factor;
+    bool ok = parse_rate(cmd[2], rate) && parse_positive(cmd[3], capacity);
+    for (size_t i = 4; ok && i < cmd.size(); i++) {
+        if (cmd[i] == "expansion" && i + 1 < cmd.size()) {
+            ok = parse_expansion(cmd[++i], expansion);
+        } else if (cmd[i] == "nonscaling") {
+            expansion = 0;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+
+    Entry *ent = entry_lookup(cmd[1]);
+    if (ent) {
+        out.status = RES_ERR;
+        return out_nil(out.data);
+    }
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+
+    ent = entry_new(T_BLOOM, cmd[1], NULL, 0);
+    if (!bloom_init(ent->bloom, (uint64_t)capacity, rate,
+                    (uint32_t)expansion)) {
+        entry_del(ent); // too large
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
+    }
+    hm_insert(&g_data.db, &ent->node);
+    out_nil(out.data);
+}
+
+// hashes of the elements from cmd[2] on
+std::vector<uint64_t> bloom_hashes(std::vector<std::string> &cmd) {
+    std::vector<uint64_t> hashes;
+    hashes.reserve(cmd.size() - 2);
+    for (size_t i = 2; i < cmd.size(); i++) {
+        hashes.push_back(str_hash64(cmd[i].data(), cmd[i].size()));
+    }
+    return hashes;
 }
 
-void do_get(std::vector<std::string> &cmd, Response &out) {
-    // sample Entry for lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        out.status = RES_NX;
+void do_bf_add(std::vector<std::string> &cmd, Response &out) {
+    // command: bf.add <key> <element>
+    // replies 1 if the element is new, 0 if it may have been added
+    // before, creating the filter from the bf-* config
+    Entry *ent = bloom_for_write(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    int res = bloom_add(ent->bloom, str_hash64(cmd[2].data(), cmd[2].size()));
+    if (res < 0) {
+        out.status = RES_ERR; // full
         return out_nil(out.data);
     }
-
-    // copy value to resp
-    const std::string &val = container_of(node, Entry, node)->val;
-    assert(val.size() <= MAX_MSG_LEN);
-    out_str(out.data, val.data(), val.size());
+    out_int(out.data, res);
 }
 
-void do_set(std::vector<std::string> &cmd, Response &out) {
-    // sample Entry for lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+void do_bf_madd(std::vector<std::string> &cmd, Response &out) {
+    // command: bf.madd <key> <element> [<element> ...]
+    // replies bf.add's result per element, -1 once the filter is full
+    Entry *ent = bloom_for_write(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    std::vector<uint64_t> hashes = bloom_hashes(cmd);
+    std::vector<int> res(hashes.size());
+    bloom_madd(ent->bloom, hashes.data(), hashes.size(), res.data());
 
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        // not found, allocate and insert new entry
-        Entry *ent = entry_new(T_STR);
+    out_arr(out.data, res.size());
+    for (int r : res) {
+        out_int(out.data, r);
+    }
+}
 
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->val.swap(cmd[2]);
+void do_bf_exists(std::vector<std::string> &cmd, Response &out) {
+    // command: bf.exists <key> <element>
+    // replies 1 if the element may have been added, 0 if it was not
+    Entry *ent = NULL;
+    if (!bloom_for_read(cmd[1], ent, out)) {
+        return;
+    }
+    uint64_t hash = str_hash64(cmd[2].data(), cmd[2].size());
+    out_int(out.data, ent && bloom_has(ent->bloom, hash));
+}
 
-        hm_insert(&g_data.db, &ent->node);
-    } else {
-        container_of(node, Entry, node)->val.swap(cmd[2]);
+void do_bf_mexists(std::vector<std::string> &cmd, Response &out) {
+    // command: bf.mexists <key> <element> [<element> ...]
+    // replies bf.exists's result per element
+    Entry *ent = NULL;
+    if (!bloom_for_read(cmd[1], ent, out)) {
+        return;
+    }
+    std::vector<uint64_t> hashes = bloom_hashes(cmd);
+    std::vector<int> res(hashes.size(), 0);
+    if (ent) {
+        bloom_mhas(ent->bloom, hashes.data(), hashes.size(), res.data());
     }
 
-    out_nil(out.data);
+    out_arr(out.data, res.size());
+    for (int r : res) {
+        out_int(out.data, r);
+    }
 }
 
-void do_del(std::vector<std::string> &cmd, Response &out) {
-    // sample Entry for lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+void out_stat(std::vector<uint8_t> &out, uint32_t &n, const char *name,
+              int64_t val) {
+    out_str(out, name, strlen(name));
+    out_int(out, val);
+    n += 2;
+}
 
-    // hashtable delete
-    node = hm_delete(&g_data.db, &key.node, &entry_eq);
-    if (node) { // deallocate the pair
-        entry_del(container_of(node, Entry, node));
-    } else {
+// lookup a time series for reading, sets the error status if there is none
+TSeries *ts_for_read(const std::string &key, Response &out) {
+    Entry *ent = entry_lookup(key);
+    if (!ent) {
         out.status = RES_NX;
+        out_nil(out.data);
+        return NULL;
+    }
+    if (ent->type != T_TS) {
+        out.status = ERR_BAD_TYPE;
+        out_nil(out.data);
+        return NULL;
     }
+    return ent->ts;
+}
 
-    out_int(out.data, node ? 1 : 0);
+// a sample timestamp in ms, "*" for the server's clock
+bool parse_ts_time(const std::string &s, int64_t &t) {
+    if (s == "*") {
+        t = (int64_t)get_realtime_msec();
+        return true;
+    }
+    return str_to_i64(s, t) && t >= 0;
 }
 
-void do_expire(std::vector<std::string> &cmd, Response &out) {
-    // command: expire <key> <time>
-    int64_t ttl_ms = 0;
-    if (!str_to_i64(cmd[2], ttl_ms)) {
-        out.status = ERR_BAD_ARG;
-        return out_nil(out.data);
+// a range bound, "-" and "+" for the oldest and newest samples
+bool parse_ts_bound(const std::string &s, int64_t &t) {
+    if (s == "-" || s == "+") {
+        t = s == "-" ? 0 : INT64_MAX;
+        return true;
     }
+    return str_to_i64(s, t);
+}
 
-    // lookup entry
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+void do_ts_add(std::vector<std::string> &cmd, Response &out) {
+    // command: ts.add <key> <timestamp>|* <value> [<timestamp> <value> ...]
+    // appends samples in increasing timestamp order after the last one,
+    // replies the last timestamp. Nothing is added if one is out of order.
+    std::vector<std::pair<int64_t, double>> samples;
+    for (size_t i = 2; i + 1 < cmd.size(); i += 2) {
+        int64_t t = 0;
+        double val = 0;
+        if (!parse_ts_time(cmd[i], t) || !str_to_dbl(cmd[i + 1], val) ||
+            std::isnan(val) || (!samples.empty() && t <= samples.back().first)) {
+            out.status = ERR_BAD_ARG;
+            return out_nil(out.data);
+        }
+        if (cmd[i] == "*") {
+            cmd[i] = std::to_string(t); // logged as the time it stood for
+        }
+        samples.push_back({t, val});
+    }
 
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = entry_lookup(cmd[1]);
+    if (!evict_for_write(ent, cmd[1])) {
+        out.status = ERR_OOM;
+        return out_nil(out.data);
+    }
+    if (!ent) {
+        ent = entry_new(T_TS, cmd[1], NULL, 0);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_TS) {
+        out.status = ERR_BAD_TYPE;
+        return out_nil(out.data);
+    }
 
-    if (hnode) {
-        Entry *ent = container_of(hnode, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
-    } else {
-        out.status = RES_NX;
+    TSeries *ts = ent->ts;
+    int64_t last = -1;
+    double last_val = 0;
+    if (ts_size(ts)) {
+        ts_last(ts, last, last_val);
+    }
+    if (samples[0].first <= last) {
+        out.status = ERR_BAD_ARG;
         return out_nil(out.data);
     }
+    for (auto &[t, val] : samples) {
+        ts_append(ts, t, val);
+    }
+    out_int(out.data, samples.back().first);
+}
 
-    return out_nil(out.data);
+void do_ts_get(std::vector<std::string> &cmd, Response &out) {
+    // command: ts.get <key>
+    // replies the last (timestamp, value)
+    TSeries *ts = ts_for_read(cmd[1], out);
+    if (!ts) {
+        return;
+    }
+    int64_t t = 0;
+    double val = 0;
+    ts_last(ts, t, val);
+    out_arr(out.data, 2);
+    out_int(out.data, t);
+    out_dbl(out.data, val);
 }
 
-void do_persist(std::vector<std::string> &cmd, Response &out) {
-    // command: persist <key>
+// Aggregations over the samples of a bucket
+enum {
+    TS_AGG_NONE,
+    TS_AGG_AVG,
+    TS_AGG_MIN,
+    TS_AGG_MAX,
+    TS_AGG_SUM,
+    TS_AGG_COUNT,
+};
 
-    // lookup entry
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+const char *k_ts_aggs[] = {"none", "avg", "min", "max", "sum", "count"};
+
+struct TSBucket {
+    int64_t start = 0;
+    uint64_t count = 0;
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+};
 
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+void ts_bucket_add(TSBucket &b, double val) {
+    b.min = b.count ? std::min(b.min, val) : val;
+    b.max = b.count ? std::max(b.max, val) : val;
+    b.sum += val;
+    b.count++;
+}
 
-    if (hnode) {
-        Entry *ent = container_of(hnode, Entry, node);
-        entry_set_ttl(ent, -1);
-    } else {
-        out.status = RES_NX;
-        return out_nil(out.data);
+double ts_bucket_value(TSBucket &b, int agg) {
+    switch (agg) {
+    case TS_AGG_AVG:
+        return b.sum / (double)b.count;
+    case TS_AGG_MIN:
+        return b.min;
+    case TS_AGG_MAX:
+        return b.max;
+    case TS_AGG_SUM:
+        return b.sum;
+    default:
+        return (double)b.count;
     }
-
-    return out_nil(out.data);
 }
 
-void do_zadd(std::vector<std::string> &cmd, Response &out) {
-    // command: zadd <key> <score> <name>
-    double score = 0;
-    if (!str_to_dbl(cmd[2], score)) {
+void do_ts_range(std::vector<std::string> &cmd, Response &out) {
+    // command: ts.range <key> <from> <to>
+    //          [aggregation avg|min|max|sum|count <bucket_ms>] [count <n>]
+    // replies (timestamp, value) pairs in the inclusive range, or one
+    // pair per non-empty bucket, buckets start at multiples of bucket_ms.
+    // count caps the number of pairs.
+    int64_t from = 0, to = 0, bucket_ms = 0, limit = INT64_MAX;
+    int agg = TS_AGG_NONE;
+    bool ok = parse_ts_bound(cmd[2], from) && parse_ts_bound(cmd[3], to);
+    for (size_t i = 4; ok && i < cmd.size(); i++) {
+        if (cmd[i] == "aggregation" && i + 2 < cmd.size()) {
+            ok = parse_enum(cmd[i + 1], k_ts_aggs, ARRAY_LEN(k_ts_aggs), agg) &&
+                 agg != TS_AGG_NONE && parse_positive(cmd[i + 2], bucket_ms);
+            i += 2;
+        } else if (cmd[i] == "count" && i + 1 < cmd.size()) {
+            ok = parse_positive(cmd[++i], limit);
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok) {
         out.status = ERR_BAD_ARG;
         return out_nil(out.data);
     }
 
-    // lookup or create zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {
-        // insert new key
-        ent = entry_new(T_ZSET);
-
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+    TSeries *ts = ts_for_read(cmd[1], out);
+    if (!ts) {
+        return;
+    }
 
-        hm_insert(&g_data.db, &ent->node);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            out.status = ERR_BAD_TYPE;
-            return out_nil(out.data);
+    size_t cursor = out_arr_begin(out.data);
+    int64_t pairs = 0;
+    TSIter it = ts_seek(ts, from);
+    if (agg == TS_AGG_NONE) {
+        for (; tsiter_valid(it) && tsiter_ts(it) <= to && pairs < limit;
+             tsiter_next(it)) {
+            out_int(out.data, tsiter_ts(it));
+            out_dbl(out.data, tsiter_val(it));
+            pairs++;
         }
+        return out_arr_end(out.data, cursor, (uint32_t)(2 * pairs));
     }
 
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    zset_insert(&ent->zset, name.data(), name.size(), score);
-
-    return out_nil(out.data);
-}
-
-void do_zrem(std::vector<std::string> &cmd, Response &out) {
-    // command: zrem <key> <name>
-
-    // lookup zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-    Entry *ent;
-    if (!hnode) {
-        out.status = RES_NX;
-        return out_nil(out.data);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            out.status = ERR_BAD_TYPE;
-            return out_nil(out.data);
+    TSBucket b;
+    for (; tsiter_valid(it) && tsiter_ts(it) <= to; tsiter_next(it)) {
+        int64_t t = tsiter_ts(it);
+        int64_t start = t - t % bucket_ms;
+        if (b.count && start != b.start) {
+            out_int(out.data, b.start);
+            out_dbl(out.data, ts_bucket_value(b, agg));
+            if (++pairs == limit) {
+                b.count = 0;
+                break;
+            }
+            b = TSBucket{};
         }
+        b.start = start;
+        ts_bucket_add(b, tsiter_val(it));
     }
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(&ent->zset, name.data(), name.size());
-    if (znode) {
-        zset_delete(&ent->zset, znode);
-        return out_int(out.data, znode ? 1 : 0);
-    } else {
-        out.status = RES_NX;
-        return out_nil(out.data);
+    if (b.count) {
+        out_int(out.data, b.start);
+        out_dbl(out.data, ts_bucket_value(b, agg));
+        pairs++;
     }
+    out_arr_end(out.data, cursor, (uint32_t)(2 * pairs));
 }
 
-void do_zscore(std::vector<std::string> &cmd, Response &out) {
-    // command: zscore <key> <name>
-
-    // lookup zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+void do_ts_info(std::vector<std::string> &cmd, Response &out) {
+    // command: ts.info <key>
+    // replies (name, value) pairs about the series and its memory
+    TSeries *ts = ts_for_read(cmd[1], out);
+    if (!ts) {
+        return;
+    }
+    int64_t last = 0;
+    double last_val = 0;
+    ts_last(ts, last, last_val);
 
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    size_t cursor = out_arr_begin(out.data);
+    uint32_t n = 0;
+    out_stat(out.data, n, "samples", ts_size(ts));
+    out_stat(out.data, n, "chunks", ts->nchunks);
+    out_stat(out.data, n, "memory_bytes", ts_mem(ts));
+    out_stat(out.data, n, "first_timestamp", ts->chunks[0]->first_ts);
+    out_stat(out.data, n, "last_timestamp", last);
+    out_arr_end(out.data, cursor, n);
+}
 
-    Entry *ent;
-    if (!hnode) {
+void do_config(std::vector<std::string> &cmd, Response &out) {
+    // command: config get <name> | config set <name> <value>
+    const ConfigOption *opt = config_find(cmd[2]);
+    if (!opt) {
         out.status = RES_NX;
         return out_nil(out.data);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            out.status = ERR_BAD_TYPE;
-            return out_nil(out.data);
-        }
     }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(&ent->zset, name.data(), name.size());
-    if (znode) {
-        return out_dbl(out.data, znode->score);
-    } else {
-        out.status = RES_NX;
+    if (cmd[1] == "get" && cmd.size() == 3) {
+        std::string val = opt->get();
+        return out_str(out.data, val.data(), val.size());
+    } else if (cmd[1] == "set" && cmd.size() == 4 && !opt->startup &&
+               opt->set(cmd[3])) {
         return out_nil(out.data);
     }
+
+    out.status = ERR_BAD_ARG;
+    return out_nil(out.data);
 }
 
-void do_zquery(std::vector<std::string> &cmd, Response &out) {
-    // command: zquery <key> <score> <name> <offset> <limit>
+// append a (name, value) pair, counting array items in n
+void info_memory(std::vector<uint8_t> &out, uint32_t &n) {
+    out_stat(out, n, "keys", hm_size(&g_data.db));
+    out_stat(out, n, "used_memory", evict_mem_used());
+    out_stat(out, n, "lazyfree_pending", g_data.lazyfree_pending);
+    out_stat(out, n, "maxmemory", g_config.maxmemory);
+    out_stat(out, n, "evicted_keys", g_data.stat_evicted);
+    out_stat(out, n, "rejected_writes", g_data.stat_rejected);
+}
 
-    double score = 0;
-    if (!str_to_dbl(cmd[2], score)) {
-        out.status = ERR_BAD_ARG;
-        return out_nil(out.data);
-    }
+void info_slab(std::vector<uint8_t> &out, uint32_t &n) {
+    out_stat(out, n, "slab_arena_bytes", slab_arena()->used.load());
 
-    const std::string &name = cmd[3];
+    for (const SlabStats &st : slab_stats()) {
+        if (!st.slabs) {
+            continue;
+        }
 
-    int64_t offset = 0, limit = 0;
-    if (!str_to_i64(cmd[4], offset) || !str_to_i64(cmd[5], limit)) {
-        out.status = ERR_BAD_ARG;
-        return out_nil(out.data);
+        // share of slab bytes not holding live objects
+        size_t total = st.slabs * k_slab_size;
+        int64_t frag = (int64_t)(100 * (total - st.used * st.size) / total);
+
+        std::string prefix = "slab_" + std::to_string(st.size) + "_";
+        out_stat(out, n, (prefix + "slabs").c_str(), st.slabs);
+        out_stat(out, n, (prefix + "used").c_str(), st.used);
+        out_stat(out, n, (prefix + "free").c_str(), st.free);
+        out_stat(out, n, (prefix + "frag_pct").c_str(), frag);
     }
+}
 
-    // lookup zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+void info_defrag(std::vector<uint8_t> &out, uint32_t &n) {
+    size_t wasted = 0;
+    int64_t pct = defrag_waste(wasted);
 
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    out_stat(out, n, "defrag_active", g_data.defrag.active);
+    out_stat(out, n, "defrag_waste_pct", pct);
+    out_stat(out, n, "defrag_waste_bytes", wasted);
+    out_stat(out, n, "defrag_moved", g_data.defrag.moved);
+    out_stat(out, n, "defrag_time_us", g_data.defrag.time_us);
+    out_stat(out, n, "defrag_released_slabs", g_data.defrag.released_slabs);
+}
 
-    Entry *ent;
-    if (!hnode) {
-        out.status = RES_NX;
-        return out_nil(out.data);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            out.status = ERR_BAD_TYPE;
-            return out_nil(out.data);
-        }
-    }
+void info_expire(std::vector<uint8_t> &out, uint32_t &n) {
+    Expire &ex = g_data.expire;
+    uint64_t now_ms = get_monotonic_msec();
+    out_stat(out, n, "keys_with_ttl", g_data.heap.size());
+    out_stat(out, n, "expired_keys", ex.expired + ex.expired_lazy);
+    out_stat(out, n, "expired_lazy", ex.expired_lazy);
+    out_stat(out, n, "expired_per_sec", expire_rate(now_ms));
+    out_stat(out, n, "expire_backlog", heap_count_below(g_data.heap, now_ms));
+    out_stat(out, n, "expire_slice_us", ex.slice_us);
+    out_stat(out, n, "expire_time_us", ex.time_us);
+}
 
-    if (limit <= 0) {
-        out_arr_begin(out.data);
-        return;
-    }
+void info_persistence(std::vector<uint8_t> &out, uint32_t &n) {
+    bool running = g_snap.child >= 0;
+    out_stat(out, n, "loaded_keys", g_snap.loaded_keys);
+    out_stat(out, n, "bgsave_in_progress", running);
+    out_stat(out, n, "bgsave_keys_done", running ? g_snap.progress.keys : 0);
+    out_stat(out, n, "bgsave_keys_total", running ? g_snap.keys_total : 0);
+    out_stat(out, n, "bgsave_cow_bytes",
+             running ? g_snap.progress.cow_bytes : 0);
+    out_stat(out, n, "last_save_ok", g_snap.last_ok);
+    out_stat(out, n, "last_save_unix_ms", g_snap.last_unix_ms);
+    out_stat(out, n, "last_save_keys", g_snap.last_keys);
+    out_stat(out, n, "last_save_bytes", g_snap.last_bytes);
+    out_stat(out, n, "last_save_ms", g_snap.last_ms);
+    out_stat(out, n, "last_cow_bytes", g_snap.last_cow_bytes);
+    out_stat(out, n, "last_fork_us", g_snap.last_fork_us);
+
+    AofFile &aof = g_aof.file;
+    out_stat(out, n, "aof_enabled", aof_enabled());
+    out_stat(out, n, "aof_bytes", aof.offset);
+    out_stat(out, n, "aof_fsynced_bytes", aof.synced);
+    out_stat(out, n, "aof_dropped_bytes", aof.dropped);
+    out_stat(out, n, "aof_fsyncs", aof.fsyncs);
+    out_stat(out, n, "aof_fsync_errors", aof.fsync_errors);
+    out_stat(out, n, "aof_write_errors", g_aof.write_errors);
+    out_stat(out, n, "aof_held_clients", g_aof.held.size());
+    out_stat(out, n, "aof_loaded_cmds", g_aof.loaded_cmds);
+    out_stat(out, n, "aof_load_ms", g_aof.load_ms);
+}
 
-    // seek to the key
-    ZNode *znode = zset_seek(&ent->zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+void do_info(std::vector<std::string> &cmd, Response &out) {
+    // command: info [section]
+    std::string section = cmd.size() > 1 ? cmd[1] : "memory";
 
-    // output
     size_t cursor = out_arr_begin(out.data);
-    int64_t n = 0;
-
-    while (znode && n < limit) {
-        out_str(out.data, znode->name, znode->len);
-        out_dbl(out.data, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
+    uint32_t n = 0;
+
+    if (section == "memory") {
+        info_memory(out.data, n);
+    } else if (section == "slab") {
+        info_slab(out.data, n);
+    } else if (section == "defrag") {
+        info_defrag(out.data, n);
+    } else if (section == "expire") {
+        info_expire(out.data, n);
+    } else if (section == "persistence") {
+        info_persistence(out.data, n);
+    } else {
+        out.data.clear();
+        out.status = ERR_BAD_ARG;
+        return out_nil(out.data);
     }
 
-    out_arr_end(out.data, cursor, (uint32_t)n);
+    out_arr_end(out.data, cursor, n);
 }
 
 // ---------------- Helper Functions ----------------
@@ -448,6 +4254,31 @@ int32_t next_timer_ms() {
         next_ms = g_data.heap[0].val;
     }
 
+    // next active defrag slice
+    if (g_data.defrag.active && g_data.defrag.next_run_us / 1000 < next_ms) {
+        next_ms = g_data.defrag.next_run_us / 1000;
+    }
+
+    // next trim purge slice
+    if (!g_data.trimming.empty() && g_data.trim_next_us / 1000 < next_ms) {
+        next_ms = g_data.trim_next_us / 1000;
+    }
+
+    // next everysec fsync of the log
+    if (aof_next_sync_ms() < next_ms) {
+        next_ms = aof_next_sync_ms();
+    }
+
+    // check on a bgsave child
+    if (g_snap.child >= 0 && now_ms + k_snap_poll_ms < next_ms) {
+        next_ms = now_ms + k_snap_poll_ms;
+    }
+
+    // lazily freed objects left to collect
+    if (g_data.collecting) {
+        next_ms = now_ms;
+    }
+
     // timeout value
     if (next_ms == (uint64_t)-1) {
         return -1; // no timers, no timeouts
@@ -464,6 +4295,16 @@ int32_t next_timer_ms() {
 void process_timers() {
     uint64_t now_ms = get_monotonic_msec();
 
+    // reclaim slab objects freed by the thread pool, in a time slice
+    uint64_t collect_end = get_monotonic_usec() + k_collect_slice_us;
+    do {
+        g_data.collecting = slab_collect(slab_heap(), k_slab_collect_batch);
+    } while (g_data.collecting && get_monotonic_usec() < collect_end);
+
+    defrag_cron();
+    trim_cron();
+    snap_cron();
+
     // clear idle connections using linked list
     while (!dlist_empty(&g_data.idle_list)) {
         Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
@@ -474,25 +4315,26 @@ void process_timers() {
             break; // not expired
         }
 
+        if (conn->job || conn->waiting || conn->held) {
+            // waiting on the thread pool or an fsync, not idle
+            conn->last_active_ms = now_ms;
+            dlist_detach(&conn->idle_node);
+            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            continue;
+        }
+
         LOG("Removing idle connection: " << conn->fd);
 
         conn_destroy(conn);
     }
 
-    // evict entries using heap
-    const size_t k_max_works = 2000;
-    size_t nworks = 0;
-    while (!g_data.heap.empty() && g_data.heap[0].val < now_ms &&
-           nworks++ < k_max_works) {
-        Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
-        hm_delete(&g_data.db, &ent->node, &entry_eq);
-        entry_del(ent); // delete the key
-    }
+    expire_cron();
 }
 
 // Request Handler function
 
-bool parse_req(const uint8_t *data, size_t len, std::vector<std::string> &cmd) {
+bool parse_req(const uint8_t *data, size_t len, uint64_t max_args,
+               std::vector<std::string> &cmd) {
     const uint8_t *end = data + len;
     uint32_t nstr = 0;
 
@@ -500,7 +4342,7 @@ bool parse_req(const uint8_t *data, size_t len, std::vector<std::string> &cmd) {
         return false; // protocol error: invalid size
     }
 
-    if (nstr > MAX_MSG_ARGS) {
+    if (nstr > max_args) {
         return false; // safety limit
     }
 
@@ -515,7 +4357,7 @@ bool parse_req(const uint8_t *data, size_t len, std::vector<std::string> &cmd) {
             return false;
         }
 
-        cmd.push_back(s);
+        cmd.push_back(std::move(s));
     }
 
     if (data != end) {
@@ -532,18 +4374,159 @@ Command List:
 
     - set <key> <value>     : Set value in HMap
     - get <key>             : Get Value for key
+    - incr <key>            : Add 1 to an integer value, 0 if missing
+    - decr <key>            : Subtract 1
+    - incrby <key> <n>      : Add n
+    - decrby <key> <n>      : Subtract n
+    - incrbyfloat <key> <x> : Add a float, stored as its shortest string
     - del <key>             : Delete key-value
     - expire <key> <time>   : Set TTL for key, time in ms
+    - expireat <key> <time> : Set TTL to end at a Unix time in ms
     - persist <key>         : Remove TTL for key
 
     ZSet Commands:
 
-    - zadd <key> <score> <name> : Add (name, score) to
+    - zadd <key> <score> <name>
+      [<score> <name> ...]      : Add (name, score) pairs to
                                   Zset of name key
     - zrem <key> <name>         : Remove pair by name
     - zscore <key> <name>       : Get score by name
     - zquery <key> <score>
       <name> <offset> <limit>   : Query ZSet
+    - zscan <key> <cursor>
+      <count>                   : Page through a ZSet in order, cursor
+                                  "0" starts, the reply leads with the
+                                  next cursor ("0" when done)
+    - zrank <key> <name>        : Position by ascending score
+    - zrevrank <key> <name>     : Position by descending score
+    - zcount <key> <min> <max>  : Count members in a score range
+    - zrange <key> <start>
+      <stop>                    : Members by position, ascending
+    - zrevrange <key> <start>
+      <stop>                    : Members by position, descending
+    - zrangebyscore <key> <min>
+      <max> [<offset> <count>]  : Members in a score range, ascending
+    - zrevrangebyscore <key>
+      <max> <min>
+      [<offset> <count>]        : Members in a score range, descending
+
+    - zremrangebyrank <key>
+      <start> <stop>            : Remove members by position
+    - zremrangebyscore <key>
+      <min> <max>               : Remove members in a score range
+
+      Score bounds are inclusive, "(" makes one exclusive,
+      "-inf" and "+inf" are unbounded.
+
+    - zunionstore <dst>
+      <numkeys> <key> ...
+      [weights <w> ...]
+      [aggregate sum|min|max]   : Store the weighted union in dst,
+                                  large inputs run in the thread pool
+    - zinterstore <dst> ...     : Same, for the intersection
+
+    Hash Commands:
+
+    - hset <key> <field> <value>
+      [<field> <value> ...]     : Set fields, replies how many are new
+    - hget <key> <field>        : Get the value of a field
+    - hmget <key> <field> ...   : Values of several fields, nil if absent
+    - hdel <key> <field> ...    : Remove fields, the last one removes
+                                  the key
+    - hgetall <key>             : All (field, value) pairs
+    - hincrby <key> <field> <n> : Add to an integer field
+
+    List Commands:
+
+    - lpush <key> <value> ...   : Push values at the head, replies
+                                  the new length
+    - rpush <key> <value> ...   : Push values at the tail
+    - lpop <key>                : Pop the head, the last one removes
+                                  the key
+    - rpop <key>                : Pop the tail
+    - llen <key>                : Number of elements
+    - lrange <key> <start>
+      <stop>                    : Elements by position
+    - ltrim <key> <start>
+      <stop>                    : Keep only the elements in a range
+
+    Set Commands:
+
+    - sadd <key> <member> ...   : Add members, replies how many are new
+    - srem <key> <member> ...   : Remove members, the last one removes
+                                  the key
+    - sismember <key> <member>  : 1 if a member, else 0
+    - scard <key>               : Number of members
+    - sinter <key> ...          : Members in every set
+    - sunion <key> ...          : Members in any set
+    - sdiff <key> ...           : Members of the first set in no other
+
+      Missing keys count as empty sets in sinter, sunion and sdiff.
+
+    HyperLogLog Commands:
+
+    - pfadd <key> <element> ... : Add elements, replies 1 if the
+                                  estimate may have changed
+    - pfcount <key> ...         : Estimated distinct elements over
+                                  the union of the keys
+    - pfmerge <dst> <src> ...   : Store the union in dst
+
+    Bitmap Commands:
+
+    - setbit <key> <offset> 0|1 : Set a bit, replies the old one,
+                                  the string grows with zeros
+    - getbit <key> <offset>     : A bit, 0 past the end
+    - bitcount <key>
+      [<start> <end>]           : Set bits in a byte range
+    - bitpos <key> 0|1
+      [<start> [<end>]]         : Position of the first 0 or 1 bit
+                                  in a byte range, -1 if none
+    - bitop and|or|xor|not
+      <dst> <key> ...           : Store the bitwise op of the keys
+                                  in dst, replies its length
+
+      Bit 0 is the most significant bit of the first byte.
+
+    Bloom Filter Commands:
+
+    - bf.reserve <key> <rate>
+      <capacity> [expansion <n>]
+      [nonscaling]              : Create an empty filter for a false
+                                  positive rate and a first capacity
+    - bf.add <key> <element>    : Add an element, replies 1 if it is
+                                  new, creates the filter if needed
+    - bf.madd <key> <element>
+      ...                       : Add elements, replies an array
+    - bf.exists <key> <element> : 1 if it may have been added, else 0
+    - bf.mexists <key>
+      <element> ...             : Same, per element
+
+    Time Series Commands:
+
+    - ts.add <key> <time>|*
+      <value> [<time> <value>
+      ...]                      : Append samples, timestamps in ms
+                                  after the last one, replies the
+                                  last timestamp
+    - ts.get <key>              : The last (timestamp, value)
+    - ts.range <key> <from> <to>
+      [aggregation <agg> <ms>]
+      [count <n>]               : (timestamp, value) pairs in a range,
+                                  or per bucket with avg, min, max,
+                                  sum or count; "-" and "+" are the
+                                  oldest and newest samples
+    - ts.info <key>             : Samples, chunks and memory
+
+    Server Commands:
+
+    - config get <name>         : Get a config value
+    - config set <name> <value> : Set a config value
+    - info [section]            : Server stats as (name, value) pairs,
+                                  sections: memory (default), slab,
+                                  defrag, expire, persistence
+    - save                      : Write a snapshot to dbfilename,
+                                  blocking
+    - bgsave                    : Write it from a forked child
 
 */
 
@@ -552,13 +4535,25 @@ void do_request(std::vector<std::string> &cmd, Response &out) {
         return do_get(cmd, out);
     } else if (cmd.size() == 3 && cmd[0] == "set") {
         return do_set(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "incr") {
+        return do_incrby(cmd, out, 1);
+    } else if (cmd.size() == 2 && cmd[0] == "decr") {
+        return do_incrby(cmd, out, -1);
+    } else if (cmd.size() == 3 && cmd[0] == "incrby") {
+        return do_incrby(cmd, out, 1);
+    } else if (cmd.size() == 3 && cmd[0] == "decrby") {
+        return do_incrby(cmd, out, -1);
+    } else if (cmd.size() == 3 && cmd[0] == "incrbyfloat") {
+        return do_incrbyfloat(cmd, out);
     } else if (cmd.size() == 2 && cmd[0] == "del") {
         return do_del(cmd, out);
     } else if (cmd.size() == 3 && cmd[0] == "expire") {
         return do_expire(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "expireat") {
+        return do_expireat(cmd, out);
     } else if (cmd.size() == 2 && cmd[0] == "persist") {
         return do_persist(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
+    } else if (cmd.size() >= 4 && cmd.size() % 2 == 0 && cmd[0] == "zadd") {
         return do_zadd(cmd, out);
     } else if (cmd.size() == 3 && cmd[0] == "zrem") {
         return do_zrem(cmd, out);
@@ -566,6 +4561,114 @@ void do_request(std::vector<std::string> &cmd, Response &out) {
         return do_zscore(cmd, out);
     } else if (cmd.size() == 6 && cmd[0] == "zquery") {
         return do_zquery(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zscan") {
+        return do_zscan(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "zrank") {
+        return do_zrank(cmd, out, false);
+    } else if (cmd.size() == 3 && cmd[0] == "zrevrank") {
+        return do_zrank(cmd, out, true);
+    } else if (cmd.size() == 4 && cmd[0] == "zcount") {
+        return do_zcount(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "zrange") {
+        return do_zrange(cmd, out, false);
+    } else if (cmd.size() == 4 && cmd[0] == "zrevrange") {
+        return do_zrange(cmd, out, true);
+    } else if ((cmd.size() == 4 || cmd.size() == 6) &&
+               cmd[0] == "zrangebyscore") {
+        return do_zrangebyscore(cmd, out, false);
+    } else if ((cmd.size() == 4 || cmd.size() == 6) &&
+               cmd[0] == "zrevrangebyscore") {
+        return do_zrangebyscore(cmd, out, true);
+    } else if (cmd.size() == 4 && cmd[0] == "zremrangebyrank") {
+        return do_zremrange(cmd, out, false);
+    } else if (cmd.size() == 4 && cmd[0] == "zremrangebyscore") {
+        return do_zremrange(cmd, out, true);
+    } else if (cmd.size() >= 4 && cmd[0] == "zunionstore") {
+        return do_zstore(cmd, out, false);
+    } else if (cmd.size() >= 4 && cmd[0] == "zinterstore") {
+        return do_zstore(cmd, out, true);
+    } else if (cmd.size() >= 4 && cmd.size() % 2 == 0 && cmd[0] == "hset") {
+        return do_hset(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "hget") {
+        return do_hget(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "hmget") {
+        return do_hmget(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "hdel") {
+        return do_hdel(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "hgetall") {
+        return do_hgetall(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "hincrby") {
+        return do_hincrby(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "lpush") {
+        return do_push(cmd, out, true);
+    } else if (cmd.size() >= 3 && cmd[0] == "rpush") {
+        return do_push(cmd, out, false);
+    } else if (cmd.size() == 2 && cmd[0] == "lpop") {
+        return do_pop(cmd, out, true);
+    } else if (cmd.size() == 2 && cmd[0] == "rpop") {
+        return do_pop(cmd, out, false);
+    } else if (cmd.size() == 2 && cmd[0] == "llen") {
+        return do_llen(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "lrange") {
+        return do_lrange(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "ltrim") {
+        return do_ltrim(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "sadd") {
+        return do_sadd(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "srem") {
+        return do_srem(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "sismember") {
+        return do_sismember(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "scard") {
+        return do_scard(cmd, out);
+    } else if (cmd.size() >= 2 && cmd[0] == "sinter") {
+        return do_sinter(cmd, out);
+    } else if (cmd.size() >= 2 && cmd[0] == "sunion") {
+        return do_sunion(cmd, out);
+    } else if (cmd.size() >= 2 && cmd[0] == "sdiff") {
+        return do_sdiff(cmd, out);
+    } else if (cmd.size() >= 2 && cmd[0] == "pfadd") {
+        return do_pfadd(cmd, out);
+    } else if (cmd.size() >= 2 && cmd[0] == "pfcount") {
+        return do_pfcount(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "pfmerge") {
+        return do_pfmerge(cmd, out);
+    } else if (cmd.size() == 4 && cmd[0] == "setbit") {
+        return do_setbit(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "getbit") {
+        return do_getbit(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 4) && cmd[0] == "bitcount") {
+        return do_bitcount(cmd, out);
+    } else if (cmd.size() >= 3 && cmd.size() <= 5 && cmd[0] == "bitpos") {
+        return do_bitpos(cmd, out);
+    } else if (cmd.size() >= 4 && cmd[0] == "bitop") {
+        return do_bitop(cmd, out);
+    } else if (cmd.size() >= 4 && cmd.size() <= 7 && cmd[0] == "bf.reserve") {
+        return do_bf_reserve(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "bf.add") {
+        return do_bf_add(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "bf.madd") {
+        return do_bf_madd(cmd, out);
+    } else if (cmd.size() == 3 && cmd[0] == "bf.exists") {
+        return do_bf_exists(cmd, out);
+    } else if (cmd.size() >= 3 && cmd[0] == "bf.mexists") {
+        return do_bf_mexists(cmd, out);
+    } else if (cmd.size() >= 4 && cmd.size() % 2 == 0 && cmd[0] == "ts.add") {
+        return do_ts_add(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "ts.get") {
+        return do_ts_get(cmd, out);
+    } else if (cmd.size() >= 4 && cmd.size() <= 9 && cmd[0] == "ts.range") {
+        return do_ts_range(cmd, out);
+    } else if (cmd.size() == 2 && cmd[0] == "ts.info") {
+        return do_ts_info(cmd, out);
+    } else if ((cmd.size() == 3 || cmd.size() == 4) && cmd[0] == "config") {
+        return do_config(cmd, out);
+    } else if ((cmd.size() == 1 || cmd.size() == 2) && cmd[0] == "info") {
+        return do_info(cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "save") {
+        return do_save(cmd, out);
+    } else if (cmd.size() == 1 && cmd[0] == "bgsave") {
+        return do_bgsave(cmd, out);
     } else {
         out.status = UNKNOWN_CMD;
     }
@@ -646,6 +4749,12 @@ bool try_handling_request(Conn *conn) {
 
     // process the messsage
 
+    // a pending job or a blocked request replies first, the rest wait
+    // behind it (aof_release() can get here while one is in flight)
+    if (conn->job || conn->waiting) {
+        return false;
+    }
+
     // try to parse accumulated buffer
     // Protocol: message header
     if (conn->incoming.size() < 4) {
@@ -669,7 +4778,7 @@ bool try_handling_request(Conn *conn) {
     uint32_t len = 0;
     memcpy(&len, conn->incoming.data(), 4);
 
-    if (len > MAX_MSG_LEN) { // protocol error
+    if (len > g_config.proto_max_msg_len) { // protocol error
         conn->want_close = true;
         return false; // want close
     }
@@ -688,7 +4797,8 @@ bool try_handling_request(Conn *conn) {
     const uint8_t *request = &conn->incoming[4];
 
     std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) == false) {
+    if (parse_req(request, len, (uint64_t)g_config.proto_max_msg_args,
+                  cmd) == false) {
         conn->want_close = true;
         return false;
     }
@@ -701,6 +4811,30 @@ bool try_handling_request(Conn *conn) {
 
     struct Response resp;
     do_request(cmd, resp);
+
+    if (resp.job) {
+        // replied to when the job is done, later requests wait until then
+        if (aof_enabled()) {
+            resp.job->cmd = cmd; // logged by done()
+        }
+        resp.job->conn = conn;
+        conn->job = resp.job;
+        thread_pool_queue(&g_data.thread_pool, &job_run, resp.job);
+        buf_consume(conn->incoming, 4 + len);
+        return false;
+    }
+    if (resp.wait) {
+        // keep the request, it runs again after the next job is done
+        if (!conn->waiting) {
+            conn->waiting = true;
+            g_data.waiting_conns.push_back(conn);
+        }
+        return false;
+    }
+
+    if (aof_feed(cmd, resp.status)) {
+        conn->aof_wait = g_aof.file.offset;
+    }
     make_response(resp, conn->outgoing);
 
     LOG("========================================");
@@ -753,8 +4887,8 @@ void handle_write(Conn *conn) {
 
     // switch state to read if all data written
     if (conn->outgoing.size() == 0) {
-        // want read if all data written
-        conn->want_read = true;
+        // want read if all data written, unless waiting on a job
+        conn->want_read = !conn->job && !conn->waiting;
         conn->want_write = false;
     } else {
         // want write if all data not written
@@ -763,6 +4897,8 @@ void handle_write(Conn *conn) {
     }
 }
 
+void handle_requests(Conn *conn);
+
 void handle_read(Conn *conn) {
     // Do a non blocking read
     uint8_t buf[64 * 1024];
@@ -777,6 +4913,11 @@ void handle_read(Conn *conn) {
     // add data to incoming buffer
     buf_append(conn->incoming, buf, (size_t)rv);
 
+    handle_requests(conn);
+}
+
+// process the buffered requests, then write out the replies
+void handle_requests(Conn *conn) {
     // try to parse incoming messages
     // up until no message if left in buffer
     // (pipilined/batched requests)
@@ -788,6 +4929,13 @@ void handle_read(Conn *conn) {
         }
     }
 
+    if (conn->outgoing.size() > 0 && aof_hold(conn)) {
+        // replied to once the log is synced, see aof_release()
+        conn->want_read = false;
+        conn->want_write = false;
+        return;
+    }
+
     // switch state to write if data is ready to be written
     if (conn->outgoing.size() > 0) {
         // want write if some data in buf to write
@@ -799,13 +4947,79 @@ void handle_read(Conn *conn) {
         return handle_write(conn); // optimization
 
     } else {
-        // want read if no data in buff to write
-        conn->want_read = true;
+        // want read if no data in buff to write, unless waiting on a job
+        conn->want_read = !conn->job && !conn->waiting;
         conn->want_write = false;
     }
 }
 
-int main(void) {
+// Reply to the clients of finished jobs and resume their requests.
+void process_jobs() {
+    uint64_t n = 0;
+    ssize_t rv = read(g_data.job_fd, &n, sizeof(n)); // reset the eventfd
+    (void)rv;
+
+    std::vector<Job *> jobs;
+    pthread_mutex_lock(&g_data.job_mu);
+    jobs.swap(g_data.jobs_done);
+    pthread_mutex_unlock(&g_data.job_mu);
+
+    for (Job *job : jobs) {
+        Conn *conn = job->conn;
+        uint64_t logged_to = g_aof.file.offset;
+        Response resp;
+        job->done(job, resp);
+        bool logged = g_aof.file.offset != logged_to;
+        if (!conn) {
+            continue; // client gone
+        }
+
+        conn->job = NULL;
+        if (logged) {
+            conn->aof_wait = g_aof.file.offset;
+        }
+        make_response(resp, conn->outgoing);
+        handle_requests(conn);
+        if (conn->want_close) {
+            conn_destroy(conn);
+        }
+    }
+
+    // retry the commands waiting for a zset, they may wait again
+    std::vector<Conn *> waiting;
+    waiting.swap(g_data.waiting_conns);
+    for (Conn *conn : waiting) {
+        conn->waiting = false;
+        handle_requests(conn);
+        if (conn->want_close) {
+            conn_destroy(conn);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (!config_parse_args(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+
+    // the snapshot, then the log of the writes after it
+    SnapAof mark;
+    g_data.loading = true;
+    if (!snap_load(g_config.dbfilename, g_snap.loaded_keys, mark)) {
+        return EXIT_FAILURE;
+    }
+    if (g_snap.loaded_keys) {
+        LOG("Loaded " << g_snap.loaded_keys << " keys from "
+                      << g_config.dbfilename);
+    }
+    if (g_config.appendonly && !aof_load(g_config.appendfilename, mark)) {
+        return EXIT_FAILURE;
+    }
+    if (g_aof.loaded_cmds) {
+        LOG("Replayed " << g_aof.loaded_cmds << " commands from "
+                        << g_config.appendfilename);
+    }
+    g_data.loading = false;
 
     int s_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (s_fd == -1) {
@@ -851,6 +5065,17 @@ int main(void) {
     // Initialise Global state
     dlist_init(&g_data.idle_list);
     thread_pool_init(&g_data.thread_pool, 4);
+    pthread_mutex_init(&g_data.job_mu, NULL);
+    g_data.job_fd = eventfd(0, EFD_NONBLOCK);
+    if (g_data.job_fd < 0) {
+        LOG("Unable to create an eventfd");
+        return EXIT_FAILURE;
+    }
+    if (aof_enabled()) {
+        aof_start_sync(g_aof.file, g_data.job_fd);
+    }
+    g_data.lru_clock = lru_clock();
+    g_data.now_ms = get_monotonic_msec();
 
     // list for poll() readiness
     std::vector<struct pollfd> poll_args;
@@ -864,6 +5089,9 @@ int main(void) {
         struct pollfd pfd = {s_fd, POLLIN, 0};
         poll_args.push_back(pfd);
 
+        // then the eventfd for finished jobs
+        poll_args.push_back(pollfd{g_data.job_fd, POLLIN, 0});
+
         // put rest of connection sockets
         for (Conn *conn : g_data.fd_to_conn) {
             if (!conn) {
@@ -886,6 +5114,9 @@ int main(void) {
         // wait for poll to check readiness
         // waits forever (blocking) for atleast one connection
 
+        // the writes of this iteration go to the log before sleeping
+        aof_flush();
+
         int32_t timeout_ms = next_timer_ms();
         int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
 
@@ -896,6 +5127,9 @@ int main(void) {
             LOG("Error while polling connection!");
         }
 
+        g_data.lru_clock = lru_clock();
+        g_data.now_ms = get_monotonic_msec();
+
         // handle the main listening socket
         // when a client is waiting in the kernel accept queue
         // POLLIN event is triggered
@@ -910,8 +5144,8 @@ int main(void) {
         }
 
         // handle connection sockets
-        // skip first
-        for (size_t i = 1; i < poll_args.size(); ++i) {
+        // skip the listening socket and the eventfd
+        for (size_t i = 2; i < poll_args.size(); ++i) {
             uint32_t ready = poll_args[i].revents;
             if (ready == 0) {
                 continue;
@@ -939,6 +5173,12 @@ int main(void) {
             }
         }
 
+        // after the sockets, as replying may close connections
+        if (poll_args[1].revents) {
+            process_jobs();
+            aof_release(); // the fsync thread signals the same eventfd
+        }
+
         process_timers();
     }
 
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+
+#include "slab.hpp"
+
+// ---------------- Memory Accounting ----------------
+
+// bytes currently held through mem_* calls,
+// updated from the event loop and the thread pool
+std::atomic<size_t> g_mem_used{0};
+
+// small objects come from the slab allocator, the rest from malloc
+
+size_t mem_usable(void *ptr) {
+    return slab_owns(ptr) ? slab_obj_size(ptr) : malloc_usable_size(ptr);
+}
+
+size_t mem_used() { return g_mem_used.load(std::memory_order_relaxed); }
+
+void *mem_alloc(size_t size) {
+    void *ptr = slab_alloc(size);
+    if (!ptr) {
+        ptr = malloc(size);
+    }
+    g_mem_used.fetch_add(mem_usable(ptr), std::memory_order_relaxed);
+    return ptr;
+}
+
+void *mem_calloc(size_t n, size_t size) {
+    void *ptr = slab_alloc(n * size);
+    if (ptr) {
+        memset(ptr, 0, n * size);
+    } else {
+        ptr = calloc(n, size);
+    }
+    g_mem_used.fetch_add(mem_usable(ptr), std::memory_order_relaxed);
+    return ptr;
+}
+
+// A lazy free runs in the thread pool while its size is counted as
+// pending. Its frees are summed here instead, and leave g_mem_used in
+// one go with the pending count, so the two never disagree.
+thread_local bool t_mem_lazyfree = false;
+thread_local size_t t_mem_lazyfreed = 0;
+
+void mem_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    if (t_mem_lazyfree) {
+        t_mem_lazyfreed += mem_usable(ptr);
+    } else {
+        g_mem_used.fetch_sub(mem_usable(ptr), std::memory_order_relaxed);
+    }
+    if (slab_owns(ptr)) {
+        slab_free(ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+void mem_lazyfree_begin() {
+    t_mem_lazyfree = true;
+    t_mem_lazyfreed = 0;
+}
+
+// end a lazy free that was counted as `size` bytes of `pending`
+void mem_lazyfree_end(std::atomic<size_t> &pending, size_t size) {
+    t_mem_lazyfree = false;
+    pending -= size; // first, g_mem_used - pending must not go below 0
+    g_mem_used.fetch_sub(t_mem_lazyfreed, std::memory_order_relaxed);
+}
+
+// Move an object out of a sparse slab, see slab_defrag_hint().
+// Returns the new address, or NULL if the object should stay.
+// The caller must fix every pointer to the old address.
+void *mem_defrag(void *ptr) {
+    if (!slab_defrag_hint(ptr)) {
+        return NULL;
+    }
+
+    size_t size = slab_obj_size(ptr);
+    void *moved = slab_alloc(size);
+    if (!moved) {
+        return NULL;
+    }
+
+    memcpy(moved, ptr, size);
+    slab_free(ptr);
+    return moved;
+}
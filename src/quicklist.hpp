@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "hashtable.hpp"
+#include "list.hpp"
+#include "memory.hpp"
+
+/*
+    Lists are a DList ring of chunks, each one allocation packing many
+    elements back to back, so pushes and pops rarely allocate and a walk
+    over the list touches few cache lines.
+    - Pushing at the back appends to the tail chunk, pushing at the front
+      prepends to the head chunk. A chunk with room only on the other side
+      slides its elements over (at most one chunk of bytes), else a new
+      chunk is linked in.
+    - Only the two end chunks can be partly used, so positions are found by
+      skipping whole chunks by their element counts.
+    - An element too large for a chunk gets a chunk of its own.
+*/
+
+// chunk allocation size, the largest slab class
+const size_t k_ql_chunk_size = 1024;
+// chunks moved per defrag step of a large list
+const size_t k_ql_defrag_batch = 16;
+
+// one allocation: [QChunk][data bytes], elements live in data[start, end)
+struct QChunk {
+    DList node;
+    uint32_t n;     // elements
+    uint32_t start; // first byte in use
+    uint32_t end;   // one past the last byte in use
+    uint32_t cap;   // data bytes
+    char data[0];
+};
+
+struct QList {
+    DList chunks;       // QChunk ring, head first
+    size_t size = 0;    // elements
+    size_t nchunks = 0;
+    size_t mem = 0;     // bytes held by chunks
+
+    QList() { dlist_init(&chunks); }
+};
+
+// ------------------ Element encoding ------------------------
+
+// element: [len][bytes][len], the length is one byte below 255, else a 255
+// marker byte and 4 bytes. It is mirrored after the bytes to step backwards.
+size_t qel_hdr(size_t len) { return len < 255 ? 1 : 5; }
+size_t qel_size(size_t len) { return len + 2 * qel_hdr(len); }
+
+void qel_write(char *p, const char *val, size_t len) {
+    size_t hdr = qel_hdr(len);
+    if (hdr == 1) {
+        p[0] = p[1 + len] = (char)(uint8_t)len;
+    } else {
+        uint32_t n = (uint32_t)len;
+        p[0] = p[9 + len] = (char)255;
+        memcpy(p + 1, &n, 4);
+        memcpy(p + 5 + len, &n, 4);
+    }
+    memcpy(p + hdr, val, len);
+}
+
+// length of the element starting at p
+size_t qel_len(const char *p) {
+    if ((uint8_t)p[0] < 255) {
+        return (uint8_t)p[0];
+    }
+    uint32_t n = 0;
+    memcpy(&n, p + 1, 4);
+    return n;
+}
+
+const char *qel_val(const char *p) { return p + qel_hdr(qel_len(p)); }
+
+// start of the element ending right before `end`
+const char *qel_prev(const char *end) {
+    size_t len = (uint8_t)end[-1];
+    if (len == 255) {
+        uint32_t n = 0;
+        memcpy(&n, end - 5, 4);
+        len = n;
+    }
+    return end - qel_size(len);
+}
+
+// ------------------ Chunk functions ------------------------
+
+QChunk *qchunk(DList *node) { return container_of(node, QChunk, node); }
+
+// a chunk with room for at least `need` bytes, not linked yet
+QChunk *qchunk_new(QList *ql, size_t need) {
+    size_t size = std::max(k_ql_chunk_size, sizeof(QChunk) + need);
+    QChunk *c = (QChunk *)mem_alloc(size);
+    c->node.prev = c->node.next = NULL;
+    c->n = c->start = c->end = 0;
+    c->cap = (uint32_t)(mem_usable(c) - sizeof(QChunk));
+
+    ql->nchunks++;
+    ql->mem += mem_usable(c);
+    return c;
+}
+
+void qchunk_del(QList *ql, QChunk *c) {
+    dlist_detach(&c->node);
+    ql->nchunks--;
+    ql->size -= c->n;
+    ql->mem -= mem_usable(c);
+    mem_free(c);
+}
+
+// move a chunk to the back of another list
+void qchunk_move(QList *from, QList *to, QChunk *c) {
+    dlist_detach(&c->node);
+    dlist_insert_before(&to->chunks, &c->node);
+
+    size_t mem = mem_usable(c);
+    from->nchunks--;
+    from->size -= c->n;
+    from->mem -= mem;
+    to->nchunks++;
+    to->size += c->n;
+    to->mem += mem;
+}
+
+// the chunk at one end, NULL if the list is empty
+QChunk *ql_end(QList *ql, bool front) {
+    if (dlist_empty(&ql->chunks)) {
+        return NULL;
+    }
+    return qchunk(front ? ql->chunks.next : ql->chunks.prev);
+}
+
+// ------------------ QList functions ------------------------
+
+size_t ql_size(QList *ql) { return ql->size; }
+
+void ql_push(QList *ql, const char *val, size_t len, bool front) {
+    size_t size = qel_size(len);
+    QChunk *c = ql_end(ql, front);
+
+    if (c && c->cap - (c->end - c->start) >= size) {
+        // fits, slide the elements over if the room is on the other side
+        uint32_t used = c->end - c->start;
+        if (front && c->start < size) {
+            memmove(c->data + c->cap - used, c->data + c->start, used);
+            c->start = c->cap - used;
+            c->end = c->cap;
+        } else if (!front && c->cap - c->end < size) {
+            memmove(c->data, c->data + c->start, used);
+            c->start = 0;
+            c->end = used;
+        }
+    } else {
+        // a new head chunk fills backwards from its end
+        c = qchunk_new(ql, size);
+        c->start = c->end = front ? c->cap : 0;
+        dlist_insert_before(front ? ql->chunks.next : &ql->chunks, &c->node);
+    }
+
+    if (front) {
+        c->start -= (uint32_t)size;
+        qel_write(c->data + c->start, val, len);
+    } else {
+        qel_write(c->data + c->end, val, len);
+        c->end += (uint32_t)size;
+    }
+    c->n++;
+    ql->size++;
+}
+
+// the element at one end, valid until the next write
+bool ql_peek(QList *ql, bool front, const char *&val, size_t &len) {
+    QChunk *c = ql_end(ql, front);
+    if (!c) {
+        return false;
+    }
+    const char *p = front ? c->data + c->start : qel_prev(c->data + c->end);
+    val = qel_val(p);
+    len = qel_len(p);
+    return true;
+}
+
+// remove the element at one end of a non-empty list
+void ql_pop(QList *ql, bool front) {
+    QChunk *c = ql_end(ql, front);
+    assert(c);
+
+    if (front) {
+        c->start += (uint32_t)qel_size(qel_len(c->data + c->start));
+    } else {
+        c->end = (uint32_t)(qel_prev(c->data + c->end) - c->data);
+    }
+    c->n--;
+    ql->size--;
+
+    if (c->n == 0) {
+        qchunk_del(ql, c);
+    }
+}
+
+void ql_clear(QList *ql) {
+    for (DList *node = ql->chunks.next; node != &ql->chunks;) {
+        DList *next = node->next;
+        mem_free(qchunk(node));
+        node = next;
+    }
+    dlist_init(&ql->chunks);
+    ql->size = ql->nchunks = ql->mem = 0;
+}
+
+// bytes held by the list and its chunks
+size_t ql_mem(QList *ql) { return sizeof(QList) + ql->mem; }
+
+// fix the ring after the QList itself was moved
+void ql_relink(QList *ql) {
+    if (ql->nchunks == 0) {
+        dlist_init(&ql->chunks);
+        return;
+    }
+    ql->chunks.next->prev = &ql->chunks;
+    ql->chunks.prev->next = &ql->chunks;
+}
+
+// ------------------ Iterator ------------------------
+
+// position in a list, `chunk` is NULL past the last element
+struct QIter {
+    QList *ql = NULL;
+    QChunk *chunk = NULL;
+    uint32_t off = 0; // element start in chunk->data
+};
+
+// the element at `index` (< size), whole chunks are skipped from the
+// nearer end of the list, then elements from the nearer end of the chunk
+QIter ql_seek(QList *ql, size_t index) {
+    assert(index < ql->size);
+
+    // elements before the position within the chunk
+    QChunk *c = NULL;
+    if (index < ql->size / 2) {
+        c = qchunk(ql->chunks.next);
+        for (; index >= c->n; c = qchunk(c->node.next)) {
+            index -= c->n;
+        }
+    } else {
+        size_t rest = ql->size - index; // elements from the position on
+        c = qchunk(ql->chunks.prev);
+        for (; rest > c->n; c = qchunk(c->node.prev)) {
+            rest -= c->n;
+        }
+        index = c->n - rest;
+    }
+
+    const char *p = NULL;
+    if (index < c->n / 2) {
+        p = c->data + c->start;
+        for (; index > 0; index--) {
+            p += qel_size(qel_len(p));
+        }
+    } else {
+        p = c->data + c->end;
+        for (size_t rest = c->n - index; rest > 0; rest--) {
+            p = qel_prev(p);
+        }
+    }
+
+    QIter it;
+    it.ql = ql;
+    it.chunk = c;
+    it.off = (uint32_t)(p - c->data);
+    return it;
+}
+
+bool qiter_valid(QIter &it) { return it.chunk != NULL; }
+
+const char *qiter_val(QIter &it) { return qel_val(it.chunk->data + it.off); }
+size_t qiter_len(QIter &it) { return qel_len(it.chunk->data + it.off); }
+
+void qiter_next(QIter &it) {
+    it.off += (uint32_t)qel_size(qiter_len(it));
+    if (it.off < it.chunk->end) {
+        return;
+    }
+
+    DList *next = it.chunk->node.next;
+    it.chunk = next == &it.ql->chunks ? NULL : qchunk(next);
+    it.off = it.chunk ? it.chunk->start : 0;
+}
+
+// ------------------ Trim ------------------------
+
+// Keep the elements in [start, stop], stop < size. Whole chunks outside
+// are moved to `dropped` for the caller to free, possibly in the
+// background, the partly kept end chunks are cut in place.
+void ql_trim(QList *ql, size_t start, size_t stop, QList *dropped) {
+    assert(start <= stop && stop < ql->size);
+
+    size_t front = start;
+    size_t back = ql->size - 1 - stop;
+
+    while (front > 0) {
+        QChunk *c = ql_end(ql, true);
+        if (front >= c->n) {
+            front -= c->n;
+            qchunk_move(ql, dropped, c);
+            continue;
+        }
+        for (size_t i = 0; i < front; i++) {
+            c->start += (uint32_t)qel_size(qel_len(c->data + c->start));
+        }
+        c->n -= (uint32_t)front;
+        ql->size -= front;
+        break;
+    }
+
+    while (back > 0) {
+        QChunk *c = ql_end(ql, false);
+        if (back >= c->n) {
+            back -= c->n;
+            qchunk_move(ql, dropped, c);
+            continue;
+        }
+        for (size_t i = 0; i < back; i++) {
+            c->end = (uint32_t)(qel_prev(c->data + c->end) - c->data);
+        }
+        c->n -= (uint32_t)back;
+        ql->size -= back;
+        break;
+    }
+}
+
+// ------------------ Defrag ------------------------
+
+// Move up to k_ql_defrag_batch chunks out of sparse slabs, from chunk
+// number `cursor` on. Returns false past the last chunk.
+bool ql_defrag_chunks(QList *ql, size_t &cursor, size_t &moved) {
+    if (cursor >= ql->nchunks) {
+        return false;
+    }
+
+    DList *node = NULL;
+    if (cursor < ql->nchunks / 2) {
+        node = ql->chunks.next;
+        for (size_t i = 0; i < cursor; i++) {
+            node = node->next;
+        }
+    } else {
+        node = ql->chunks.prev;
+        for (size_t i = ql->nchunks - 1; i > cursor; i--) {
+            node = node->prev;
+        }
+    }
+
+    for (size_t i = 0; i < k_ql_defrag_batch && node != &ql->chunks; i++) {
+        DList *next = node->next;
+        if (QChunk *copy = (QChunk *)mem_defrag(qchunk(node))) {
+            copy->node.prev->next = &copy->node;
+            copy->node.next->prev = &copy->node;
+            moved++;
+        }
+        node = next;
+        cursor++;
+    }
+    return true;
+}
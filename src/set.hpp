@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <vector>
+
+#include "config.hpp"
+#include "hashtable.hpp"
+#include "intset.hpp"
+#include "utils.hpp"
+
+/*
+    Sets have two encodings:
+    - Intset: a sorted array of int64_t, binary searched, while every
+      member is an integer in canonical decimal form.
+    - Table: a hashtable of SMember nodes, each one allocation holding the
+      name.
+    A set starts as an intset and is converted for good once a member is
+    not an integer or it has more than `set-max-intset-entries` members.
+*/
+
+// the table encoding, allocated on conversion
+struct SetTable {
+    HMap hmap;
+    size_t node_mem = 0; // bytes held by SMembers
+};
+
+struct Set {
+    // intset encoding
+    int64_t *ints = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+
+    // table encoding, NULL while the intset is used
+    SetTable *table = NULL;
+};
+
+// one allocation: [SMember][name bytes]
+struct SMember {
+    HNode node;
+    uint32_t len;
+    char name[0];
+};
+
+// ------------------ SMember functions ------------------------
+
+SMember *smember_new(const char *name, size_t len) {
+    SMember *m = (SMember *)mem_alloc(sizeof(SMember) + len);
+    m->node.next = NULL;
+    m->node.hcode = str_hash((uint8_t *)name, len);
+    m->len = (uint32_t)len;
+    memcpy(m->name, name, len);
+    return m;
+}
+
+bool smember_eq(HNode *node, HNode *key) {
+    SMember *m = container_of(node, SMember, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return m->len == hkey->len && memcmp(m->name, hkey->name, m->len) == 0;
+}
+
+// ------------------ Intset encoding ------------------------
+
+// parse a member that formats back to the same bytes, so "007" or "+7"
+// stay strings
+bool set_int(const char *name, size_t len, int64_t &val) {
+    if (len == 0 || (name[0] == '0' && len > 1) ||
+        (name[0] == '-' && (len == 1 || name[1] == '0'))) {
+        return false;
+    }
+    auto [ptr, ec] = std::from_chars(name, name + len, val, 10);
+    return ec == std::errc{} && ptr == name + len;
+}
+
+// format an intset member, returns its length
+size_t set_int_str(int64_t val, char *buf) {
+    return (size_t)(std::to_chars(buf, buf + 24, val).ptr - buf);
+}
+
+bool intset_find(Set *set, int64_t val, size_t &pos) {
+    int64_t *end = set->ints + set->n;
+    int64_t *it = std::lower_bound(set->ints, end, val);
+    pos = (size_t)(it - set->ints);
+    return it != end && *it == val;
+}
+
+void intset_resize(Set *set, size_t cap) {
+    int64_t *ints = (int64_t *)mem_alloc(cap * sizeof(int64_t));
+    if (set->ints) {
+        memcpy(ints, set->ints, set->n * sizeof(int64_t));
+        mem_free(set->ints);
+    }
+    set->ints = ints;
+    set->cap = mem_usable(ints) / sizeof(int64_t);
+}
+
+void intset_insert(Set *set, size_t pos, int64_t val) {
+    if (set->n == set->cap) {
+        intset_resize(set, std::max(set->n + 1, set->cap + set->cap / 2));
+    }
+    memmove(set->ints + pos + 1, set->ints + pos,
+            (set->n - pos) * sizeof(int64_t));
+    set->ints[pos] = val;
+    set->n++;
+}
+
+void intset_remove(Set *set, size_t pos) {
+    memmove(set->ints + pos, set->ints + pos + 1,
+            (set->n - pos - 1) * sizeof(int64_t));
+    set->n--;
+}
+
+// ------------------ Table encoding ------------------------
+
+HNode *set_lookup(Set *set, const char *name, size_t len) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    return hm_lookup(&set->table->hmap, &key.node, &smember_eq);
+}
+
+void set_add_member(Set *set, const char *name, size_t len) {
+    SMember *m = smember_new(name, len);
+    hm_insert(&set->table->hmap, &m->node);
+    set->table->node_mem += mem_usable(m);
+}
+
+// move every member from the intset to the table encoding
+void set_convert(Set *set) {
+    int64_t *ints = set->ints;
+    size_t n = set->n;
+
+    set->ints = NULL;
+    set->n = set->cap = 0;
+    set->table = new (mem_alloc(sizeof(SetTable))) SetTable();
+
+    char buf[24];
+    for (size_t i = 0; i < n; i++) {
+        set_add_member(set, buf, set_int_str(ints[i], buf));
+    }
+    mem_free(ints);
+}
+
+// ------------------ Set functions ------------------------
+
+size_t set_size(Set *set) {
+    return set->table ? hm_size(&set->table->hmap) : set->n;
+}
+
+bool set_contains(Set *set, const char *name, size_t len) {
+    if (!set->table) {
+        int64_t val = 0;
+        size_t pos = 0;
+        return set_int(name, len, val) && intset_find(set, val, pos);
+    }
+    return set_lookup(set, name, len) != NULL;
+}
+
+// add a member, returns true if it is new
+bool set_add(Set *set, const char *name, size_t len) {
+    if (!set->table) {
+        int64_t val = 0;
+        size_t pos = 0;
+        bool is_int = set_int(name, len, val);
+        if (is_int && intset_find(set, val, pos)) {
+            return false;
+        }
+        if (is_int &&
+            set->n < (uint64_t)g_config.set_max_intset_entries) {
+            intset_insert(set, pos, val);
+            return true;
+        }
+        set_convert(set);
+    }
+
+    if (set_lookup(set, name, len)) {
+        return false;
+    }
+    set_add_member(set, name, len);
+    return true;
+}
+
+// Add many integers to an intset with one merge instead of one insert
+// each. `vals` gets sorted. Returns the number of new members, the caller
+// checks the result fits set-max-intset-entries.
+size_t set_add_ints(Set *set, std::vector<int64_t> &vals) {
+    assert(!set->table);
+    std::sort(vals.begin(), vals.end());
+    vals.erase(std::unique(vals.begin(), vals.end()), vals.end());
+
+    size_t added = 0;
+    for (int64_t val : vals) {
+        size_t pos = 0;
+        added += !intset_find(set, val, pos);
+    }
+    if (added == 0) {
+        return 0;
+    }
+    if (set->n + added > set->cap) {
+        intset_resize(set, set->n + added);
+    }
+
+    // merge from the back, in place
+    int64_t *ints = set->ints;
+    size_t i = set->n, j = vals.size(), w = set->n + added;
+    while (j > 0) {
+        if (i > 0 && ints[i - 1] > vals[j - 1]) {
+            ints[--w] = ints[--i];
+        } else {
+            if (i > 0 && ints[i - 1] == vals[j - 1]) {
+                i--; // present, keep one copy
+            }
+            ints[--w] = vals[--j];
+        }
+    }
+    set->n += added;
+    return added;
+}
+
+// remove a member, returns false if it is absent
+bool set_remove(Set *set, const char *name, size_t len) {
+    if (!set->table) {
+        int64_t val = 0;
+        size_t pos = 0;
+        if (!set_int(name, len, val) || !intset_find(set, val, pos)) {
+            return false;
+        }
+        intset_remove(set, pos);
+        return true;
+    }
+
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+
+    HNode *found = hm_delete(&set->table->hmap, &key.node, &smember_eq);
+    if (!found) {
+        return false;
+    }
+    SMember *m = container_of(found, SMember, node);
+    set->table->node_mem -= mem_usable(m);
+    mem_free(m);
+    return true;
+}
+
+// call f(name, len, arg) for every member, intsets in ascending order
+void set_foreach(Set *set, void (*f)(const char *, size_t, void *),
+                 void *arg) {
+    if (!set->table) {
+        char buf[24];
+        for (size_t i = 0; i < set->n; i++) {
+            f(buf, set_int_str(set->ints[i], buf), arg);
+        }
+        return;
+    }
+
+    for (size_t pos = 0;; pos++) {
+        HNode **from = hm_bucket(&set->table->hmap, pos);
+        if (!from) {
+            break;
+        }
+        for (HNode *node = *from; node; node = node->next) {
+            SMember *m = container_of(node, SMember, node);
+            f(m->name, m->len, arg);
+        }
+    }
+}
+
+void set_clear(Set *set) {
+    mem_free(set->ints);
+    if (SetTable *table = set->table) {
+        for (size_t pos = 0;; pos++) {
+            HNode **from = hm_bucket(&table->hmap, pos);
+            if (!from) {
+                break;
+            }
+            for (HNode *node = *from; node;) {
+                HNode *next = node->next;
+                mem_free(container_of(node, SMember, node));
+                node = next;
+            }
+        }
+        hm_clear(&table->hmap);
+        mem_free(table);
+    }
+    *set = Set{};
+}
+
+// bytes held by the set and its members
+size_t set_mem(Set *set) {
+    size_t mem = sizeof(Set) + set->cap * sizeof(int64_t);
+    if (SetTable *table = set->table) {
+        mem += sizeof(SetTable) + table->node_mem + hm_mem(&table->hmap);
+    }
+    return mem;
+}
+
+// ------------------ Defrag ------------------------
+
+// Move the members of one bucket out of sparse slabs, `pos` counts
+// buckets as hm_bucket() does. Returns false past the last bucket.
+bool set_defrag_bucket(Set *set, size_t &pos, size_t &moved) {
+    HNode **from = set->table ? hm_bucket(&set->table->hmap, pos) : NULL;
+    if (!from) {
+        return false;
+    }
+
+    for (; *from; from = &(*from)->next) {
+        if (void *copy = mem_defrag(container_of(*from, SMember, node))) {
+            *from = &((SMember *)copy)->node;
+            moved++;
+        }
+    }
+
+    pos++;
+    return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "memory.hpp"
+
+/*
+    Count-Min Sketch:
+    - Estimates access frequency of keys in a fixed amount of memory.
+    - 4 rows of 4-bit counters, 16 counters packed per 64-bit word.
+    - An estimate is the minimum over the rows, it never undercounts.
+    - Aging: after `sample` increments all counters are halved,
+      so old popularity fades out (TinyLFU "reset").
+*/
+
+const uint32_t k_sketch_depth = 4;
+const uint64_t k_sketch_counter_max = 15;
+
+struct Sketch {
+    uint64_t *table = NULL; // k_sketch_depth rows of `words` words
+    size_t words = 0;       // words per row, power of 2
+    size_t additions = 0;   // increments since the last aging
+    size_t sample = 0;      // age after this many increments
+};
+
+// 64-bit finalizer to derive independent row hashes
+uint64_t sketch_mix(uint64_t h, uint32_t row) {
+    h += 0x9E3779B97F4A7C15ull * (row + 1);
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+// size the sketch for about n distinct keys
+void sketch_init(Sketch *sk, size_t n) {
+    size_t words = 1;
+    while (words * 16 < n) {
+        words *= 2;
+    }
+
+    mem_free(sk->table);
+    sk->table = (uint64_t *)mem_calloc(k_sketch_depth * words, 8);
+    sk->words = words;
+    sk->additions = 0;
+    sk->sample = 10 * words * 16; // 10x the counters per row
+}
+
+void sketch_clear(Sketch *sk) {
+    mem_free(sk->table);
+    *sk = Sketch{};
+}
+
+// halve every counter
+void sketch_age(Sketch *sk) {
+    size_t n = k_sketch_depth * sk->words;
+    for (size_t i = 0; i < n; i++) {
+        sk->table[i] = (sk->table[i] >> 1) & 0x7777777777777777ull;
+    }
+    sk->additions /= 2;
+}
+
+uint32_t sketch_estimate(Sketch *sk, uint64_t hcode) {
+    if (!sk->table) {
+        return 0;
+    }
+
+    uint64_t est = k_sketch_counter_max;
+    for (uint32_t row = 0; row < k_sketch_depth; row++) {
+        uint64_t h = sketch_mix(hcode, row);
+        size_t pos = row * sk->words + ((h >> 4) & (sk->words - 1));
+        uint64_t cnt = (sk->table[pos] >> ((h & 15) * 4)) & 15;
+        est = cnt < est ? cnt : est;
+    }
+    return (uint32_t)est;
+}
+
+void sketch_increment(Sketch *sk, uint64_t hcode) {
+    if (!sk->table) {
+        return;
+    }
+
+    bool added = false;
+    for (uint32_t row = 0; row < k_sketch_depth; row++) {
+        uint64_t h = sketch_mix(hcode, row);
+        uint64_t *word =
+            &sk->table[row * sk->words + ((h >> 4) & (sk->words - 1))];
+        uint32_t shift = (h & 15) * 4;
+
+        if (((*word >> shift) & 15) < k_sketch_counter_max) {
+            *word += 1ull << shift;
+            added = true;
+        }
+    }
+
+    if (added && ++sk->additions >= sk->sample) {
+        sketch_age(sk);
+    }
+}
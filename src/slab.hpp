@@ -0,0 +1,462 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <vector>
+
+/*
+    Slab allocator:
+    - Small objects are grouped into size classes.
+    - Each class carves objects out of 64 KiB slabs, the slab header
+      sits at the start of the slab so it is found by masking an address.
+    - Slabs come from one large reserved address range (the arena),
+      so "is this a slab object?" is a range check.
+    - Every thread allocates from its own heap. Frees from another thread
+      (e.g. lazy free in the thread pool) are pushed on the owner heap's
+      remote free list, and collected by the owner later, a batch at a
+      time so freeing a large container elsewhere never stalls the owner.
+    - A job that builds objects for the event loop allocates from a heap
+      of its own, which the event loop adopts once the job is done, so
+      the objects end up owned by the thread that frees them.
+*/
+
+const size_t k_slab_size = 64 * 1024;
+const size_t k_slab_arena_size = 64ull << 30; // reserved, not committed
+const size_t k_slab_max = 1024;               // larger objects use malloc
+const size_t k_slab_collect_batch = 4096;     // remote frees per collect
+
+const uint32_t k_slab_classes[] = {
+    16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+const size_t k_slab_nclasses = sizeof(k_slab_classes) / sizeof(uint32_t);
+
+struct SlabHeap;
+
+struct Slab {
+    SlabHeap *heap;   // owner
+    Slab *prev;       // in the owner's partial list of this class
+    Slab *next;
+    void *free_list;  // freed objects, linked through their first word
+    uint32_t cls;     // size class index
+    uint32_t size;    // object size
+    uint32_t nobjs;   // object capacity
+    uint32_t used;    // live objects
+    uint32_t carved;  // objects handed out at least once
+    bool listed;      // in the partial list
+};
+
+// first object offset, keeps objects 16-byte aligned
+const size_t k_slab_header = (sizeof(Slab) + 15) & ~(size_t)15;
+
+struct SlabClassStats {
+    std::atomic<size_t> slabs{0};
+    std::atomic<size_t> used{0};
+};
+
+struct SlabHeap {
+    Slab *partial[k_slab_nclasses] = {}; // slabs with free objects
+    std::atomic<void *> remote{NULL};   // objects freed by other threads
+    void *collecting = NULL;            // taken from remote, not collected
+    SlabClassStats stats[k_slab_nclasses];
+
+    // a heap made for one job keeps every slab it takes, empty ones too,
+    // for slab_heap_adopt()
+    bool keep_slabs = false;
+    std::vector<Slab *> slabs;
+};
+
+struct SlabArena {
+    char *base = NULL;
+    char *end = NULL;
+    std::atomic<size_t> used{0}; // bytes handed out as slabs
+
+    // empty slabs, shared by all heaps
+    pthread_mutex_t mu;
+    std::vector<Slab *> empty;    // pages still resident
+    std::vector<Slab *> released; // pages returned to the OS
+
+    // every heap, for stats
+    std::vector<SlabHeap *> heaps;
+};
+
+// ---------------- Arena ----------------
+
+SlabArena *slab_arena() {
+    static SlabArena *arena = [] {
+        SlabArena *a = new SlabArena();
+        pthread_mutex_init(&a->mu, NULL);
+
+        // reserve address space only, pages are committed on first touch
+        size_t len = k_slab_arena_size + k_slab_size;
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            uintptr_t base = ((uintptr_t)p + k_slab_size - 1) &
+                             ~(uintptr_t)(k_slab_size - 1);
+            a->base = (char *)base;
+            a->end = a->base + k_slab_arena_size;
+        }
+        return a;
+    }();
+    return arena;
+}
+
+bool slab_owns(void *ptr) {
+    SlabArena *a = slab_arena();
+    return (char *)ptr >= a->base && (char *)ptr < a->end;
+}
+
+Slab *slab_of(void *ptr) {
+    return (Slab *)((uintptr_t)ptr & ~(uintptr_t)(k_slab_size - 1));
+}
+
+size_t slab_obj_size(void *ptr) { return slab_of(ptr)->size; }
+
+Slab *slab_arena_take() {
+    SlabArena *a = slab_arena();
+    if (!a->base) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&a->mu);
+    Slab *slab = NULL;
+    if (!a->empty.empty()) {
+        slab = a->empty.back();
+        a->empty.pop_back();
+    } else if (!a->released.empty()) {
+        slab = a->released.back(); // faults pages back in on use
+        a->released.pop_back();
+    }
+    pthread_mutex_unlock(&a->mu);
+
+    if (!slab) {
+        size_t off = a->used.fetch_add(k_slab_size);
+        if (off + k_slab_size > k_slab_arena_size) {
+            a->used.fetch_sub(k_slab_size);
+            return NULL; // arena exhausted
+        }
+        slab = (Slab *)(a->base + off);
+    }
+    return slab;
+}
+
+void slab_arena_give(Slab *slab) {
+    SlabArena *a = slab_arena();
+    pthread_mutex_lock(&a->mu);
+    a->empty.push_back(slab);
+    pthread_mutex_unlock(&a->mu);
+}
+
+// Return the pages of empty slabs to the OS, keeping `keep` of them
+// resident for reuse. Returns the number of slabs released.
+size_t slab_release_empty(size_t keep) {
+    SlabArena *a = slab_arena();
+    size_t n = 0;
+
+    pthread_mutex_lock(&a->mu);
+    while (a->empty.size() > keep) {
+        Slab *slab = a->empty.back();
+        a->empty.pop_back();
+        madvise(slab, k_slab_size, MADV_DONTNEED);
+        a->released.push_back(slab);
+        n++;
+    }
+    pthread_mutex_unlock(&a->mu);
+
+    return n;
+}
+
+// ---------------- Heap ----------------
+
+SlabHeap *slab_heap_new() {
+    SlabHeap *h = new SlabHeap();
+    SlabArena *a = slab_arena();
+    pthread_mutex_lock(&a->mu);
+    a->heaps.push_back(h);
+    pthread_mutex_unlock(&a->mu);
+    return h;
+}
+
+// the heap the calling thread allocates from
+SlabHeap *&slab_heap_slot() {
+    thread_local SlabHeap *heap = NULL;
+    return heap;
+}
+
+SlabHeap *slab_heap() {
+    SlabHeap *&heap = slab_heap_slot();
+    if (!heap) {
+        heap = slab_heap_new();
+    }
+    return heap;
+}
+
+// allocate from `heap` on this thread, returns the previous heap
+SlabHeap *slab_heap_swap(SlabHeap *heap) {
+    SlabHeap *prev = slab_heap();
+    slab_heap_slot() = heap;
+    return prev;
+}
+
+uint32_t slab_class_of(size_t size) {
+    uint32_t cls = 0;
+    while (k_slab_classes[cls] < size) {
+        cls++;
+    }
+    return cls;
+}
+
+// owner only: link a slab into its class's partial list
+void slab_link(SlabHeap *heap, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = heap->partial[slab->cls];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    heap->partial[slab->cls] = slab;
+    slab->listed = true;
+}
+
+void slab_unlink(SlabHeap *heap, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        heap->partial[slab->cls] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+    slab->listed = false;
+}
+
+void counter_add(std::atomic<size_t> &c, size_t delta) {
+    // single writer (the owner heap), readers only need a consistent value
+    c.store(c.load(std::memory_order_relaxed) + delta,
+            std::memory_order_relaxed);
+}
+
+// owner only: release an object back into its slab
+void slab_free_local(SlabHeap *heap, void *ptr) {
+    Slab *slab = slab_of(ptr);
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->used--;
+    counter_add(heap->stats[slab->cls].used, (size_t)-1);
+
+    // Empty: hand it back unless it is the only slab left to allocate
+    // from. A slab that was full goes first in the list once freed into,
+    // so a container freed in order empties each slab while it is first.
+    bool last = heap->partial[slab->cls] == slab && !slab->next;
+    if (slab->used == 0 && !last && !heap->keep_slabs) {
+        if (slab->listed) {
+            slab_unlink(heap, slab);
+        }
+        counter_add(heap->stats[slab->cls].slabs, (size_t)-1);
+        slab_arena_give(slab);
+    } else if (!slab->listed) {
+        slab_link(heap, slab); // was full
+    }
+}
+
+// Collect up to `max` objects other threads freed into this heap.
+// Returns true if more are left for a later call.
+bool slab_collect(SlabHeap *heap, size_t max) {
+    if (!heap->collecting) {
+        heap->collecting =
+            heap->remote.exchange(NULL, std::memory_order_acquire);
+    }
+
+    void *ptr = heap->collecting;
+    for (; ptr && max; max--) {
+        void *next = *(void **)ptr;
+        slab_free_local(heap, ptr);
+        ptr = next;
+    }
+    heap->collecting = ptr;
+    return ptr || heap->remote.load(std::memory_order_relaxed);
+}
+
+Slab *slab_new(SlabHeap *heap, uint32_t cls) {
+    Slab *slab = slab_arena_take();
+    if (!slab) {
+        return NULL;
+    }
+
+    slab->heap = heap;
+    slab->free_list = NULL;
+    slab->cls = cls;
+    slab->size = k_slab_classes[cls];
+    slab->nobjs = (uint32_t)((k_slab_size - k_slab_header) / slab->size);
+    slab->used = 0;
+    slab->carved = 0;
+    slab_link(heap, slab);
+    counter_add(heap->stats[cls].slabs, 1);
+    if (heap->keep_slabs) {
+        heap->slabs.push_back(slab);
+    }
+    return slab;
+}
+
+// returns NULL if the size is too large or the arena is unavailable
+void *slab_alloc(size_t size) {
+    if (size > k_slab_max) {
+        return NULL;
+    }
+
+    SlabHeap *heap = slab_heap();
+    uint32_t cls = slab_class_of(size);
+
+    Slab *slab = heap->partial[cls];
+    if (!slab) {
+        slab_collect(heap, k_slab_collect_batch);
+        slab = heap->partial[cls];
+    }
+    if (!slab && !(slab = slab_new(heap, cls))) {
+        return NULL;
+    }
+
+    void *ptr = slab->free_list;
+    if (ptr) {
+        slab->free_list = *(void **)ptr;
+    } else {
+        // carve a fresh object
+        ptr = (char *)slab + k_slab_header + (size_t)slab->carved * slab->size;
+        slab->carved++;
+    }
+
+    slab->used++;
+    counter_add(heap->stats[cls].used, 1);
+
+    if (slab->used == slab->nobjs) {
+        slab_unlink(heap, slab); // full
+    }
+    return ptr;
+}
+
+void slab_free(void *ptr) {
+    SlabHeap *owner = slab_of(ptr)->heap;
+    if (owner == slab_heap()) {
+        return slab_free_local(owner, ptr);
+    }
+
+    // push to the owner's remote free list
+    void *head = owner->remote.load(std::memory_order_relaxed);
+    do {
+        *(void **)ptr = head;
+    } while (!owner->remote.compare_exchange_weak(
+        head, ptr, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// A heap for one job, see slab_heap_adopt().
+SlabHeap *slab_job_heap() {
+    SlabHeap *heap = slab_heap_new();
+    heap->keep_slabs = true;
+    return heap;
+}
+
+// Take over the slabs of a job heap no thread allocates from anymore,
+// then free it. The objects in them become the caller's.
+void slab_heap_adopt(SlabHeap *from) {
+    SlabHeap *heap = slab_heap();
+    while (slab_collect(from, SIZE_MAX)) {
+    }
+
+    for (Slab *slab : from->slabs) {
+        if (slab->listed) {
+            slab_unlink(from, slab);
+        }
+        slab->heap = heap;
+        if (slab->used == 0) {
+            counter_add(from->stats[slab->cls].slabs, (size_t)-1);
+            slab_arena_give(slab);
+        } else if (slab->used < slab->nobjs) {
+            slab_link(heap, slab);
+        }
+    }
+
+    SlabArena *a = slab_arena();
+    pthread_mutex_lock(&a->mu);
+    for (size_t cls = 0; cls < k_slab_nclasses; cls++) {
+        counter_add(heap->stats[cls].slabs, from->stats[cls].slabs.load());
+        counter_add(heap->stats[cls].used, from->stats[cls].used.load());
+    }
+    a->heaps.erase(std::find(a->heaps.begin(), a->heaps.end(), from));
+    pthread_mutex_unlock(&a->mu);
+    delete from;
+}
+
+// Defrag hint: true if the object sits in a slab that is emptier than
+// the average of its class, so moving it lets that slab drain.
+// Only objects owned by the calling thread's heap are considered.
+bool slab_defrag_hint(void *ptr) {
+    if (!slab_owns(ptr)) {
+        return false;
+    }
+
+    Slab *slab = slab_of(ptr);
+    SlabHeap *heap = slab_heap();
+    if (slab->heap != heap || heap->partial[slab->cls] == slab ||
+        slab->used == slab->nobjs) {
+        return false; // foreign, the allocation target, or full
+    }
+
+    size_t slabs = heap->stats[slab->cls].slabs.load(std::memory_order_relaxed);
+    size_t used = heap->stats[slab->cls].used.load(std::memory_order_relaxed);
+    return (size_t)slab->used * slabs < used;
+}
+
+// Slab bytes of the calling thread's heap, and the free bytes in them
+// that compacting could win back. Each class keeps one slab with free
+// room to allocate from, empty if it is the class's last, so that
+// much free room is not counted.
+void slab_heap_usage(size_t &total, size_t &wasted) {
+    SlabHeap *heap = slab_heap();
+    total = wasted = 0;
+    for (size_t cls = 0; cls < k_slab_nclasses; cls++) {
+        size_t bytes =
+            heap->stats[cls].slabs.load(std::memory_order_relaxed) *
+            k_slab_size;
+        size_t live = heap->stats[cls].used.load(std::memory_order_relaxed) *
+                      k_slab_classes[cls];
+        total += bytes;
+        if (bytes > live + k_slab_size) {
+            wasted += bytes - live - k_slab_size;
+        }
+    }
+}
+
+// per size class totals over all heaps
+struct SlabStats {
+    uint32_t size;
+    size_t slabs;
+    size_t used; // live objects
+    size_t free; // free object slots
+};
+
+std::vector<SlabStats> slab_stats() {
+    std::vector<SlabStats> out(k_slab_nclasses);
+    SlabArena *a = slab_arena();
+
+    pthread_mutex_lock(&a->mu);
+    for (size_t cls = 0; cls < k_slab_nclasses; cls++) {
+        SlabStats &st = out[cls];
+        st.size = k_slab_classes[cls];
+        st.slabs = st.used = 0;
+        for (SlabHeap *heap : a->heaps) {
+            st.slabs += heap->stats[cls].slabs.load(std::memory_order_relaxed);
+            st.used += heap->stats[cls].used.load(std::memory_order_relaxed);
+        }
+        size_t cap = st.slabs * ((k_slab_size - k_slab_header) / st.size);
+        st.free = cap > st.used ? cap - st.used : 0;
+    }
+    pthread_mutex_unlock(&a->mu);
+
+    return out;
+}
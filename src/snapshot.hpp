@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+/*
+    Snapshot file format, written by save and bgsave, read at startup.
+    - An 8-byte magic, then one record per key, then an end record with
+      the number of keys, then a checksum of everything before it.
+    - The first record holds a random id of the snapshot, and the id and
+      length of the append-only file at the snapshot (both 0 without
+      one), so that the log is replayed from where the snapshot ends.
+    - A record is a type byte, the key and the value. A key with a TTL
+      is preceded by an expire record holding its Unix time in ms.
+    - Lengths and counts are varints, integers zigzag varints, doubles
+      their 8 bytes little endian. Containers are written member by
+      member, Bloom filter layers and time series chunks as raw bytes.
+    - The checksum hashes each 64 KiB block of the file, so the writer
+      can hash what it flushes and never holds the whole file.
+*/
+
+const char k_snap_magic[8] = {'K', 'A', 'C', 'H', 'E', 'S', '0', '1'};
+const size_t k_snap_block = 64 << 10; // bytes per write and per hash
+
+// record types, independent of the in-memory value types
+enum {
+    SNAP_STR = 1,
+    SNAP_INT = 2,
+    SNAP_ZSET = 3,
+    SNAP_HASH = 4,
+    SNAP_LIST = 5,
+    SNAP_SET = 6,
+    SNAP_BLOOM = 7,
+    SNAP_TS = 8,
+    SNAP_AOF = 0xfd,    // ids and the append-only file length, first
+    SNAP_EXPIRE = 0xfe, // Unix ms of the next key
+    SNAP_END = 0xff,
+};
+
+// where the append-only file continues a snapshot
+struct SnapAof {
+    uint64_t snap_id = 0; // 0 without a snapshot
+    uint64_t aof_id = 0;  // 0 if no log was written with the snapshot
+    uint64_t aof_offset = 0;
+};
+
+// a random id for a snapshot or a log, never 0
+uint64_t snap_new_id() {
+    uint64_t id = 0;
+    if (getrandom(&id, sizeof(id), 0) != (ssize_t)sizeof(id)) {
+        id = get_monotonic_usec() ^ ((uint64_t)getpid() << 32);
+    }
+    return id ? id : 1;
+}
+
+// checksum of a block, chained to the blocks before it
+uint64_t snap_hash_block(uint64_t sum, const uint8_t *p, size_t n) {
+    return (sum << 1 | sum >> 63) ^ str_hash64((const char *)p, n);
+}
+
+// ------------------ Writer ------------------------
+
+struct SnapWriter {
+    int fd = -1;
+    std::vector<uint8_t> buf; // one block
+    uint64_t sum = 0;
+    uint64_t bytes = 0; // flushed
+    bool failed = false;
+};
+
+void snap_flush(SnapWriter &w) {
+    size_t done = 0;
+    while (!w.failed && done < w.buf.size()) {
+        ssize_t rv = write(w.fd, w.buf.data() + done, w.buf.size() - done);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            w.failed = true;
+            break;
+        }
+        done += (size_t)rv;
+    }
+    w.sum = snap_hash_block(w.sum, w.buf.data(), w.buf.size());
+    w.bytes += w.buf.size();
+    w.buf.clear();
+}
+
+void snap_put(SnapWriter &w, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (n) {
+        size_t room = std::min(n, k_snap_block - w.buf.size());
+        w.buf.insert(w.buf.end(), p, p + room);
+        p += room;
+        n -= room;
+        if (w.buf.size() == k_snap_block) {
+            snap_flush(w);
+        }
+    }
+}
+
+void snap_put_u8(SnapWriter &w, uint8_t v) { snap_put(w, &v, 1); }
+
+void snap_put_len(SnapWriter &w, uint64_t v) {
+    uint8_t tmp[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7) {
+        tmp[n++] = (uint8_t)(v | 0x80);
+    }
+    tmp[n++] = (uint8_t)v;
+    snap_put(w, tmp, n);
+}
+
+void snap_put_int(SnapWriter &w, int64_t v) {
+    snap_put_len(w, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void snap_put_dbl(SnapWriter &w, double v) { snap_put(w, &v, 8); }
+
+void snap_put_str(SnapWriter &w, const char *s, size_t n) {
+    snap_put_len(w, n);
+    snap_put(w, s, n);
+}
+
+// the end record and the checksum, false if a write failed
+bool snap_finish(SnapWriter &w, uint64_t keys) {
+    snap_put_u8(w, SNAP_END);
+    snap_put_len(w, keys);
+    snap_flush(w);
+    uint64_t sum = w.sum;
+    snap_put(w, &sum, 8);
+    snap_flush(w);
+    return !w.failed;
+}
+
+// ------------------ Reader ------------------------
+
+// bounds checked reads over a mapped file, `failed` once past the end
+struct SnapReader {
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+    bool failed = false;
+    void *map = NULL;
+    size_t map_size = 0;
+};
+
+bool snap_has(SnapReader &r, uint64_t n) {
+    if ((uint64_t)(r.end - r.p) < n) {
+        r.failed = true;
+    }
+    return !r.failed;
+}
+
+uint8_t snap_get_u8(SnapReader &r) { return snap_has(r, 1) ? *r.p++ : 0; }
+
+uint64_t snap_get_len(SnapReader &r) {
+    uint64_t v = 0;
+    for (uint32_t shift = 0; shift < 64 && snap_has(r, 1); shift += 7) {
+        uint8_t b = *r.p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+    r.failed = true;
+    return 0;
+}
+
+int64_t snap_get_int(SnapReader &r) {
+    uint64_t v = snap_get_len(r);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+double snap_get_dbl(SnapReader &r) {
+    double v = 0;
+    if (snap_has(r, 8)) {
+        memcpy(&v, r.p, 8);
+        r.p += 8;
+    }
+    return v;
+}
+
+// n raw bytes, NULL past the end
+const uint8_t *snap_get_raw(SnapReader &r, uint64_t n) {
+    if (!snap_has(r, n)) {
+        return NULL;
+    }
+    const uint8_t *p = r.p;
+    r.p += n;
+    return p;
+}
+
+// a length prefixed string, valid until snap_close()
+const char *snap_get_str(SnapReader &r, size_t &n) {
+    n = (size_t)snap_get_len(r);
+    return (const char *)snap_get_raw(r, n);
+}
+
+void snap_close(SnapReader &r) {
+    if (r.map) {
+        munmap(r.map, r.map_size);
+    }
+    r = SnapReader{};
+}
+
+// Map a whole file for reading, false with `err` set if it is missing
+// or empty.
+bool snap_map(const std::string &path, SnapReader &r, std::string &err) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st = {};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        err = "cannot open " + path;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        err = "cannot map " + path;
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    r.map = map;
+    r.map_size = size;
+    r.p = (const uint8_t *)map;
+    r.end = r.p + size;
+    return true;
+}
+
+// Map a snapshot and check its magic and checksum. The reader is left on
+// the first record. Returns false with `err` set if the file is missing
+// or damaged.
+bool snap_open(const std::string &path, SnapReader &r, std::string &err) {
+    if (!snap_map(path, r, err)) {
+        return false;
+    }
+    const uint8_t *data = r.p;
+    size_t size = r.map_size;
+    if (size < sizeof(k_snap_magic) + 8 ||
+        memcmp(data, k_snap_magic, sizeof(k_snap_magic)) != 0) {
+        err = "not a snapshot";
+        snap_close(r);
+        return false;
+    }
+
+    size_t body = size - 8;
+    uint64_t sum = 0, want = 0;
+    for (size_t off = 0; off < body; off += k_snap_block) {
+        sum = snap_hash_block(sum, data + off,
+                              std::min(k_snap_block, body - off));
+    }
+    memcpy(&want, data + body, 8);
+    if (sum != want) {
+        err = "bad checksum";
+        snap_close(r);
+        return false;
+    }
+
+    r.p = data + sizeof(k_snap_magic);
+    r.end = data + body;
+    return true;
+}
+
+// ------------------ Copy on write ------------------------
+
+// Private_Dirty of the process in bytes, 0 if unknown. In a forked child
+// these are the pages the parent wrote since the fork, which the kernel
+// had to copy.
+size_t proc_private_dirty() {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long v = 0;
+        if (sscanf(line, "Private_Dirty: %lu kB", &v) == 1) {
+            kb += v;
+        }
+    }
+    fclose(f);
+    return kb << 10;
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "memory.hpp"
+
+/*
+    Time series: samples of (int64_t timestamp in ms, double value),
+    appended in increasing timestamp order and packed into chunks of the
+    largest slab class, as Gorilla (Facebook, VLDB 2015) does.
+    - The first sample of a chunk is kept whole in its header.
+    - Timestamps are stored as the change of the delta to the previous
+      sample, a single 0 bit for a steady interval.
+    - Values are XORed with the previous value, a single 0 bit when it
+      repeats, else the bits that differ, reusing the previous window of
+      leading and trailing zeros when they fit in it.
+    - Chunks are kept in an array sorted by time, so a range query binary
+      searches its first chunk and decodes only the chunks it covers.
+*/
+
+// chunk allocation size, the largest slab class
+const size_t k_ts_chunk_size = 1024;
+// most bits one sample takes: 5 + 64 for the timestamp, 2 + 12 + 64 for
+// the value
+const uint32_t k_ts_sample_max_bits = 147;
+// chunks moved per defrag step of a large series
+const size_t k_ts_defrag_batch = 16;
+// no previous window of meaningful value bits
+const uint8_t k_ts_no_window = 0xff;
+
+// one allocation: [TSChunk][data words], bits are written from the most
+// significant bit of each word down
+struct TSChunk {
+    int64_t first_ts;
+    int64_t last_ts;
+    int64_t last_delta;
+    uint64_t first_val; // bits of the doubles
+    uint64_t last_val;
+    uint32_t count;     // samples
+    uint32_t nbits;     // data bits in use
+    uint32_t cap_bits;
+    uint8_t leading;    // window of the last XOR written in full
+    uint8_t trailing;
+    uint64_t data[0];
+};
+
+struct TSeries {
+    TSChunk **chunks = NULL; // by time
+    size_t nchunks = 0;
+    size_t cap = 0;
+    uint64_t count = 0;      // samples
+    size_t mem = 0;          // bytes held by chunks
+};
+
+// ------------------ Bit stream ------------------------
+
+// append the low n bits of v, 1 <= n <= 64
+void ts_put(TSChunk *c, uint64_t v, uint32_t n) {
+    if (n < 64) {
+        v &= (1ull << n) - 1;
+    }
+    uint32_t word = c->nbits / 64, room = 64 - c->nbits % 64;
+    if (n <= room) {
+        c->data[word] |= v << (room - n);
+    } else {
+        c->data[word] |= v >> (n - room);
+        c->data[word + 1] |= v << (64 - (n - room));
+    }
+    c->nbits += n;
+}
+
+// read n bits at `pos`, 1 <= n <= 64
+uint64_t ts_get(const uint64_t *data, uint32_t &pos, uint32_t n) {
+    uint32_t word = pos / 64, off = pos % 64;
+    uint64_t v = data[word] << off;
+    if (off + n > 64) {
+        v |= data[word + 1] >> (64 - off);
+    }
+    pos += n;
+    return v >> (64 - n);
+}
+
+// sign extend the low n bits
+int64_t ts_signed(uint64_t v, uint32_t n) {
+    return n == 64 ? (int64_t)v : (int64_t)(v << (64 - n)) >> (64 - n);
+}
+
+// ------------------ Sample encoding ------------------------
+
+// Delta of delta classes: prefix bits, prefix length, payload bits.
+// The last class holds any 64-bit value.
+struct TSDodClass {
+    uint32_t prefix;
+    uint32_t prefix_bits;
+    uint32_t bits;
+};
+
+const TSDodClass k_ts_dod_classes[] = {
+    {0b10, 2, 7}, {0b110, 3, 9}, {0b1110, 4, 12}, {0b11110, 5, 32},
+    {0b11111, 5, 64},
+};
+
+void ts_put_dod(TSChunk *c, int64_t dod) {
+    if (dod == 0) {
+        return ts_put(c, 0, 1);
+    }
+    for (const TSDodClass &k : k_ts_dod_classes) {
+        int64_t lim = k.bits == 64 ? INT64_MAX : (1ll << (k.bits - 1)) - 1;
+        if (k.bits == 64 || (dod >= -lim - 1 && dod <= lim)) {
+            ts_put(c, k.prefix, k.prefix_bits);
+            return ts_put(c, (uint64_t)dod, k.bits);
+        }
+    }
+}
+
+int64_t ts_get_dod(const uint64_t *data, uint32_t &pos) {
+    // the 1 bits of the prefix pick the class, 5 of them end it without
+    // a 0 bit
+    uint32_t ones = 0;
+    while (ones < 5 && ts_get(data, pos, 1)) {
+        ones++;
+    }
+    if (ones == 0) {
+        return 0;
+    }
+    uint32_t bits = k_ts_dod_classes[ones - 1].bits;
+    return ts_signed(ts_get(data, pos, bits), bits);
+}
+
+void ts_put_val(TSChunk *c, uint64_t val) {
+    uint64_t x = val ^ c->last_val;
+    if (x == 0) {
+        return ts_put(c, 0, 1);
+    }
+
+    uint8_t lead = (uint8_t)__builtin_clzll(x);
+    uint8_t trail = (uint8_t)__builtin_ctzll(x);
+    if (c->leading != k_ts_no_window && lead >= c->leading &&
+        trail >= c->trailing) {
+        // fits the previous window
+        ts_put(c, 0b10, 2);
+        return ts_put(c, x >> c->trailing, 64 - c->leading - c->trailing);
+    }
+
+    uint32_t len = 64 - lead - trail;
+    ts_put(c, 0b11, 2);
+    ts_put(c, lead, 6);
+    ts_put(c, len - 1, 6);
+    ts_put(c, x >> trail, len);
+    c->leading = lead;
+    c->trailing = trail;
+}
+
+// ------------------ Chunks ------------------------
+
+// append an empty chunk
+TSChunk *ts_chunk_push(TSeries *ts) {
+    TSChunk *c = (TSChunk *)mem_calloc(k_ts_chunk_size, 1);
+    c->cap_bits = (uint32_t)(mem_usable(c) - sizeof(TSChunk)) / 8 * 64;
+    c->leading = k_ts_no_window;
+
+    if (ts->nchunks == ts->cap) {
+        size_t cap = std::max((size_t)4, ts->cap * 2);
+        TSChunk **chunks = (TSChunk **)mem_alloc(cap * sizeof(TSChunk *));
+        if (ts->chunks) {
+            memcpy(chunks, ts->chunks, ts->nchunks * sizeof(TSChunk *));
+            mem_free(ts->chunks);
+        }
+        ts->chunks = chunks;
+        ts->cap = mem_usable(chunks) / sizeof(TSChunk *);
+    }
+    ts->chunks[ts->nchunks++] = c;
+    ts->mem += mem_usable(c);
+    return c;
+}
+
+TSChunk *ts_chunk_new(TSeries *ts, int64_t t, uint64_t val) {
+    TSChunk *c = ts_chunk_push(ts);
+    c->first_ts = c->last_ts = t;
+    c->first_val = c->last_val = val;
+    c->count = 1;
+    return c;
+}
+
+// ------------------ TSeries functions ------------------------
+
+uint64_t ts_size(TSeries *ts) { return ts->count; }
+
+// the last sample of a non-empty series
+void ts_last(TSeries *ts, int64_t &t, double &val) {
+    TSChunk *c = ts->chunks[ts->nchunks - 1];
+    t = c->last_ts;
+    memcpy(&val, &c->last_val, 8);
+}
+
+// Append a sample, false if it is not newer than the last one.
+bool ts_append(TSeries *ts, int64_t t, double val) {
+    uint64_t bits = 0;
+    memcpy(&bits, &val, 8);
+
+    TSChunk *c = ts->nchunks ? ts->chunks[ts->nchunks - 1] : NULL;
+    if (c && t <= c->last_ts) {
+        return false;
+    }
+    ts->count++;
+    if (!c || c->nbits + k_ts_sample_max_bits > c->cap_bits) {
+        ts_chunk_new(ts, t, bits);
+        return true;
+    }
+
+    int64_t delta = t - c->last_ts;
+    ts_put_dod(c, delta - c->last_delta);
+    ts_put_val(c, bits);
+    c->last_ts = t;
+    c->last_delta = delta;
+    c->last_val = bits;
+    c->count++;
+    return true;
+}
+
+void ts_clear(TSeries *ts) {
+    for (size_t i = 0; i < ts->nchunks; i++) {
+        mem_free(ts->chunks[i]);
+    }
+    mem_free(ts->chunks);
+    *ts = TSeries{};
+}
+
+// bytes held by the series and its chunks
+size_t ts_mem(TSeries *ts) {
+    return sizeof(TSeries) + ts->cap * sizeof(TSChunk *) + ts->mem;
+}
+
+// ------------------ Iterator ------------------------
+
+// decoding state within one chunk
+struct TSIter {
+    TSeries *ts = NULL;
+    size_t chunk = 0; // index, nchunks past the last sample
+    uint32_t i = 0;   // sample within the chunk
+    uint32_t pos = 0; // next bit
+    int64_t t = 0;
+    int64_t delta = 0;
+    uint64_t val = 0;
+    uint8_t leading = k_ts_no_window;
+    uint8_t trailing = 0;
+};
+
+void tsiter_load(TSIter &it, size_t chunk) {
+    it.chunk = chunk;
+    if (chunk == it.ts->nchunks) {
+        return;
+    }
+    TSChunk *c = it.ts->chunks[chunk];
+    it.i = it.pos = 0;
+    it.t = c->first_ts;
+    it.delta = 0;
+    it.val = c->first_val;
+    it.leading = k_ts_no_window;
+}
+
+bool tsiter_valid(TSIter &it) { return it.chunk < it.ts->nchunks; }
+
+int64_t tsiter_ts(TSIter &it) { return it.t; }
+
+double tsiter_val(TSIter &it) {
+    double val = 0;
+    memcpy(&val, &it.val, 8);
+    return val;
+}
+
+void tsiter_next(TSIter &it) {
+    TSChunk *c = it.ts->chunks[it.chunk];
+    if (++it.i == c->count) {
+        return tsiter_load(it, it.chunk + 1);
+    }
+
+    it.delta += ts_get_dod(c->data, it.pos);
+    it.t += it.delta;
+
+    if (!ts_get(c->data, it.pos, 1)) {
+        return; // same value
+    }
+    if (ts_get(c->data, it.pos, 1)) {
+        it.leading = (uint8_t)ts_get(c->data, it.pos, 6);
+        uint32_t len = (uint32_t)ts_get(c->data, it.pos, 6) + 1;
+        it.trailing = (uint8_t)(64 - it.leading - len);
+    }
+    uint32_t len = 64 - it.leading - it.trailing;
+    it.val ^= ts_get(c->data, it.pos, len) << it.trailing;
+}
+
+// the first sample at or after `from`, invalid if there is none
+TSIter ts_seek(TSeries *ts, int64_t from) {
+    // the first chunk ending at or after `from`
+    TSChunk **end = ts->chunks + ts->nchunks;
+    TSChunk **it_chunk = std::lower_bound(
+        ts->chunks, end, from,
+        [](TSChunk *c, int64_t t) { return c->last_ts < t; });
+
+    TSIter it;
+    it.ts = ts;
+    tsiter_load(it, (size_t)(it_chunk - ts->chunks));
+    while (tsiter_valid(it) && tsiter_ts(it) < from) {
+        tsiter_next(it);
+    }
+    return it;
+}
+
+// ------------------ Defrag ------------------------
+
+// Move up to k_ts_defrag_batch chunks out of sparse slabs, from chunk
+// number `cursor` on. Returns false past the last chunk.
+bool ts_defrag_chunks(TSeries *ts, size_t &cursor, size_t &moved) {
+    if (cursor >= ts->nchunks) {
+        return false;
+    }
+    size_t end = std::min(ts->nchunks, cursor + k_ts_defrag_batch);
+    for (; cursor < end; cursor++) {
+        if (void *copy = mem_defrag(ts->chunks[cursor])) {
+            ts->chunks[cursor] = (TSChunk *)copy;
+            moved++;
+        }
+    }
+    return true;
+}
@@ -3,6 +3,8 @@
 #include <cassert>
 #include <cstdint>
 #include <charconv>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
@@ -139,7 +141,8 @@ enum resp_status_code {
     RES_ERR,
 
     ERR_BAD_ARG,
-    ERR_BAD_TYPE
+    ERR_BAD_TYPE,
+    ERR_OOM
 };
 
 int32_t read_full(int fd, char *buf, size_t n) {
@@ -196,6 +199,46 @@ uint64_t str_hash(const uint8_t *data, size_t len) {
     return h;
 }
 
+// MurmurHash64A, for sketches that need more and better bits than
+// str_hash()
+uint64_t str_hash64(const char *data, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = 0xadc83b19ull ^ (len * m);
+
+    const char *end = data + (len & ~(size_t)7);
+    for (const char *p = data; p != end; p += 8) {
+        uint64_t k = 0;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, end, len & 7);
+    if (len & 7) {
+        h ^= tail;
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// xorshift64* PRNG, only used for sampling
+uint64_t rand_u64() {
+    static uint64_t state = 0x9E3779B97F4A7C15ull;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
+
 int str_to_dbl(const std::string &s, double &out) {
     const char *start = s.c_str(); // pointer to buffer
     char *end = nullptr;
@@ -221,6 +264,35 @@ int str_to_i64(const std::string &s, int64_t &out) {
     return ec == std::errc{} && ptr == s.data() + s.size();
 }
 
+// decimal digits of v in buf, which needs 20 bytes, returns the length
+size_t i64_to_str(int64_t v, char *buf) {
+    return std::to_chars(buf, buf + 20, v).ptr - buf;
+}
+
+// shortest "%g" form of v that reads back as v, buf needs 32 bytes
+size_t dbl_to_str(double v, char *buf) {
+    int n = 0;
+    for (int prec = 15; prec <= 17; prec++) {
+        n = snprintf(buf, 32, "%.*g", prec, v);
+        if (strtod(buf, NULL) == v) {
+            break;
+        }
+    }
+    return (size_t)n;
+}
+
+// An int64_t written exactly as i64_to_str() writes it: no sign but
+// '-', no leading zeros, no "-0". Such strings can be kept as numbers.
+bool str_is_i64(const char *s, size_t n, int64_t &out) {
+    if (n == 0 || n > 20) {
+        return false;
+    }
+    auto [ptr, ec] = std::from_chars(s, s + n, out, 10);
+    char buf[20];
+    return ec == std::errc{} && ptr == s + n &&
+           i64_to_str(out, buf) == n && memcmp(buf, s, n) == 0;
+}
+
 
 // ------------------- Timer Functions ------------------
 
@@ -230,3 +302,15 @@ uint64_t get_monotonic_msec(){
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1'000'000;
 }
 
+uint64_t get_monotonic_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1'000'000 + tv.tv_nsec / 1000;
+}
+
+// wall clock, for timestamps clients see
+uint64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1'000'000;
+}
@@ -1,18 +1,53 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 
-#include "avl.hpp"
+#include "btree.hpp"
+#include "config.hpp"
 #include "hashtable.hpp"
 #include "utils.hpp"
 
+/*
+    Sorted sets have two encodings:
+    - Array: small sets live in one sorted buffer of
+      (score, name length, name, name length) entries, searched linearly.
+      The trailing length lets iterators step backwards.
+    - Tree: a B+tree by (score, name) plus a hashtable by name.
+    A set starts as an array and is converted for good once it has more than
+    `zset-max-array-entries` members or a name longer than
+    `zset-max-array-value` bytes.
+
+    Removing a rank range from a tree set cuts it out of the B+tree as a
+    "trim". Its members stay in the hashtable, where lookups skip them,
+    until they are unlinked a batch at a time (zset_purge()).
+*/
+
+struct ZTrim;
+
 struct ZSet {
-    AVLNode *root = NULL; // index by (score, name), sorted
-    HMap hmap;            // index by name
+    // array encoding
+    char *arr = NULL;
+    uint32_t arr_n = 0;    // members
+    uint32_t arr_used = 0; // bytes
+    uint32_t arr_cap = 0;
+    bool is_tree = false;
+
+    // tree encoding
+    BTree tree;          // index by (score, name), sorted
+    HMap hmap;           // index by name
+    size_t node_mem = 0; // bytes held by ZNodes
+
+    // ranges cut from the tree whose members are still in the hashtable
+    ZTrim *trims = NULL; // newest first
+    size_t trimmed = 0;  // members in `trims`
+
+    // background jobs reading the set, it must not change meanwhile
+    uint32_t readers = 0;
+    bool detached = false; // no key owns it, the last reader frees it
 };
 
 struct ZNode {
-    AVLNode treeNode;
     HNode hmapNode;
 
     // data
@@ -21,20 +56,40 @@ struct ZNode {
     char name[0]; // flexible array, reduce memory allocation
 };
 
+// members cut from a tree set, still indexed by its hashtable
+struct ZTrim {
+    BTree tree;          // the members, in order
+    size_t purged = 0;   // leading members unlinked from the hashtable
+    size_t node_mem = 0; // bytes of the purged members
+    size_t leaf_mem = 0; // bytes of the leaves seen while purging
+    ZTrim *next = NULL;
+};
+
+// a position in a zset of either encoding, invalidated by any write
+struct ZIter {
+    ZSet *zset = NULL;
+    BIter bt;         // tree encoding
+    uint32_t idx = 0; // array encoding: member index
+    uint32_t off = 0; // array encoding: byte offset of the member
+};
+
+// a member as seen through an iterator
+struct ZMember {
+    double score;
+    const char *name;
+    size_t len;
+};
+
 
-bool zless(AVLNode *lhs, AVLNode *rhs);
-bool z_cmp_less(AVLNode *lhs, double score, const char *name, size_t len);
-void tree_insert(ZSet *zset, ZNode *znode);
-void tree_dispose(AVLNode *node);
 bool hcmp(HNode *node, HNode *key);
+bool hcmp_live(HNode *node, HNode *key);
+bool zpair_less(double lscore, const char *lname, size_t llen, double rscore,
+                const char *rname, size_t rlen);
 
 // ------------------ ZNode functions ------------------------
 
 ZNode *znode_new(const char *name, size_t len, double score) {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len); // struct + name arr
-
-    // create AVL Node
-    avl_init(&node->treeNode);
+    ZNode *node = (ZNode *)mem_alloc(sizeof(ZNode) + len); // struct + name arr
 
     // create HMap node
     node->hmapNode.next = NULL;
@@ -48,21 +103,124 @@ ZNode *znode_new(const char *name, size_t len, double score) {
     return node;
 }
 
-void znode_del(ZNode *node) { free(node); }
+void znode_del(ZNode *node) { mem_free(node); }
 
-// ------------------ ZSet functions ------------------------
+// ------------------ Array encoding ------------------------
+
+// entry: [double score][uint8_t name length][name][uint8_t name length]
+const size_t k_zarr_hdr = sizeof(double) + 1;
+
+double zarr_score(const char *p) {
+    double score;
+    memcpy(&score, p, sizeof(double));
+    return score;
+}
+
+size_t zarr_len(const char *p) { return (uint8_t)p[sizeof(double)]; }
+const char *zarr_name(const char *p) { return p + k_zarr_hdr; }
+size_t zarr_size(const char *p) { return k_zarr_hdr + zarr_len(p) + 1; }
+
+// size of the entry ending right before `p`
+size_t zarr_prev_size(const char *p) { return k_zarr_hdr + (uint8_t)p[-1] + 1; }
+
+// byte offset of a member, -1 if absent
+int64_t zarr_find(ZSet *zset, const char *name, size_t len) {
+    for (uint32_t off = 0; off < zset->arr_used;) {
+        const char *p = zset->arr + off;
+        if (zarr_len(p) == len && memcmp(zarr_name(p), name, len) == 0) {
+            return off;
+        }
+        off += zarr_size(p);
+    }
+    return -1;
+}
+
+// first entry not less than (score, name), by index and byte offset
+void zarr_seek(ZSet *zset, double score, const char *name, size_t len,
+               uint32_t &idx, uint32_t &off) {
+    idx = off = 0;
+    while (off < zset->arr_used) {
+        const char *p = zset->arr + off;
+        if (!zpair_less(zarr_score(p), zarr_name(p), zarr_len(p), score, name,
+                        len)) {
+            break;
+        }
+        idx++;
+        off += zarr_size(p);
+    }
+}
+
+void zarr_insert(ZSet *zset, const char *name, size_t len, double score) {
+    size_t size = k_zarr_hdr + len + 1;
+
+    if (zset->arr_used + size > zset->arr_cap) {
+        // grow by half, the slab class rounding gives some slack for free
+        size_t cap = std::max(zset->arr_used + size,
+                              (size_t)zset->arr_cap + zset->arr_cap / 2);
+        char *arr = (char *)mem_alloc(cap);
+        if (zset->arr) {
+            memcpy(arr, zset->arr, zset->arr_used);
+            mem_free(zset->arr);
+        }
+        zset->arr = arr;
+        zset->arr_cap = (uint32_t)mem_usable(arr);
+    }
+
+    uint32_t idx = 0, off = 0;
+    zarr_seek(zset, score, name, len, idx, off);
+
+    char *p = zset->arr + off;
+    memmove(p + size, p, zset->arr_used - off);
+    memcpy(p, &score, sizeof(double));
+    p[sizeof(double)] = (char)(uint8_t)len;
+    memcpy(p + k_zarr_hdr, name, len);
+    p[k_zarr_hdr + len] = (char)(uint8_t)len;
+
+    zset->arr_used += (uint32_t)size;
+    zset->arr_n++;
+}
+
+void zarr_remove(ZSet *zset, uint32_t off) {
+    char *p = zset->arr + off;
+    size_t size = zarr_size(p);
+    memmove(p, p + size, zset->arr_used - off - size);
+    zset->arr_used -= (uint32_t)size;
+    zset->arr_n--;
+}
+
+// ------------------ Tree encoding ------------------------
+
+// a lookup key that skips trimmed members
+struct ZKey {
+    HKey key;
+    ZSet *zset;
+};
+
+// true if the node is a trimmed member, found in a trim by its pair
+bool zset_trimmed(ZSet *zset, ZNode *node) {
+    for (ZTrim *trim = zset->trims; trim; trim = trim->next) {
+        BIter it = bt_seek(&trim->tree, node->score, node->name, node->len);
+        if (bt_item(it) == node) {
+            return true;
+        }
+    }
+    return false;
+}
 
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset->root) {
+    // by the hashtable, a bulk insert fills the tree last
+    if (hm_size(&zset->hmap) == 0) {
         return NULL;
     }
 
-    HKey key;
-    key.node.hcode = str_hash((uint8_t *)name, len);
-    key.name = name;
-    key.len = len;
+    ZKey key;
+    key.key.node.hcode = str_hash((uint8_t *)name, len);
+    key.key.name = name;
+    key.key.len = len;
+    key.zset = zset;
 
-    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    HNode *found = hm_lookup(&zset->hmap, &key.key.node,
+                             zset->trims ? &hcmp_live : &hcmp);
     return found ? container_of(found, ZNode, hmapNode) : NULL;
 }
 
@@ -73,62 +231,551 @@ void zset_update(ZSet *zset, ZNode *node, double score) {
     }
 
     // detach node
-    zset->root = avl_del(&node->treeNode);
+    bt_delete(&zset->tree, node->score, node, node->name, node->len);
 
     // reinsert node
-    avl_init(&node->treeNode);
     node->score = score;
-    tree_insert(zset, node);
+    bt_insert(&zset->tree, score, node, node->name, node->len);
+}
+
+void zset_add_node(ZSet *zset, const char *name, size_t len, double score) {
+    ZNode *node = znode_new(name, len, score);
+    hm_insert(&zset->hmap, &node->hmapNode);
+    bt_insert(&zset->tree, score, node, name, len);
+    zset->node_mem += mem_usable(node);
+}
+
+void zset_delete(ZSet *zset, ZNode *node) {
+    // remove from hashtable, by identity as trimmed members share names
+    HNode *found = hm_delete(&zset->hmap, &node->hmapNode, &hnode_same);
+    assert(found);
+
+    // remove from tree
+    bt_delete(&zset->tree, node->score, node, node->name, node->len);
+
+    // deallocate node
+    zset->node_mem -= mem_usable(node);
+    znode_del(node);
+}
+
+// move every member from the array to the tree encoding
+void zset_convert(ZSet *zset) {
+    char *arr = zset->arr;
+    uint32_t used = zset->arr_used;
+
+    zset->arr = NULL;
+    zset->arr_n = zset->arr_used = zset->arr_cap = 0;
+    zset->is_tree = true;
+
+    for (uint32_t off = 0; off < used;) {
+        const char *p = arr + off;
+        zset_add_node(zset, zarr_name(p), zarr_len(p), zarr_score(p));
+        off += zarr_size(p);
+    }
+    mem_free(arr);
 }
 
-bool zset_insert(ZSet *zset, const char *name, size_t size, double score) {
-    if (ZNode *node = zset_lookup(zset, name, size)) {
+// ------------------ ZSet functions ------------------------
+
+size_t zset_size(ZSet *zset) {
+    return zset->is_tree ? zset->tree.size : zset->arr_n;
+}
+
+// add or update a member, returns true if it was added
+bool zset_insert(ZSet *zset, const char *name, size_t len, double score) {
+    if (!zset->is_tree) {
+        int64_t off = zarr_find(zset, name, len);
+        if (off >= 0) {
+            if (zarr_score(zset->arr + off) != score) {
+                zarr_remove(zset, (uint32_t)off);
+                zarr_insert(zset, name, len, score);
+            }
+            return false;
+        }
+
+        if (zset->arr_n < (uint64_t)g_config.zset_max_array_entries &&
+            len <= (uint64_t)g_config.zset_max_array_value) {
+            zarr_insert(zset, name, len, score);
+            return true;
+        }
+        zset_convert(zset);
+    }
+
+    if (ZNode *node = zset_lookup(zset, name, len)) {
         zset_update(zset, node, score);
         return false;
     }
+    zset_add_node(zset, name, len, score);
+    return true;
+}
 
-    ZNode *node = znode_new(name, size, score);
-    hm_insert(&zset->hmap, &node->hmapNode);
-    tree_insert(zset, node);
+const size_t k_zset_bulk_min = 64; // smaller batches insert one by one
+
+// order for sorting pairs
+bool bpair_less(const BPair &a, const BPair &b) {
+    if (a.score != b.score) {
+        return a.score < b.score;
+    }
+    return zless(a.item, b.score, b.item->name, b.item->len);
+}
+
+// Add or update many members, later duplicates win. Returns how many
+// were added. A batch at least as large as the set is applied by
+// sorting everything and rebuilding the tree bottom-up.
+size_t zset_insert_bulk(ZSet *zset, const ZMember *members, size_t n) {
+    size_t added = 0;
+
+    bool bulk = n >= k_zset_bulk_min && zset_size(zset) <= n;
+    if (bulk && !zset->is_tree) {
+        // stay in the array encoding if everything fits
+        bool fits =
+            zset->arr_n + n <= (uint64_t)g_config.zset_max_array_entries;
+        for (size_t i = 0; fits && i < n; i++) {
+            fits = members[i].len <= (uint64_t)g_config.zset_max_array_value;
+        }
+        if (fits) {
+            bulk = false;
+        } else {
+            zset_convert(zset);
+        }
+    }
+
+    if (!bulk) {
+        for (size_t i = 0; i < n; i++) {
+            added += zset_insert(zset, members[i].name, members[i].len,
+                                 members[i].score);
+        }
+        return added;
+    }
+
+    // the current members, taken from the leaf chain before scores change
+    std::vector<BPair> pairs;
+    pairs.reserve(zset->tree.size + n);
+    for (BIter it = bt_at(&zset->tree, 0); it.leaf; bt_next(it)) {
+        pairs.push_back(BPair{0, bt_item(it)});
+    }
+
+    // update scores in place, add new names to the hashtable only
+    for (size_t i = 0; i < n; i++) {
+        const ZMember &m = members[i];
+        if (ZNode *node = zset_lookup(zset, m.name, m.len)) {
+            node->score = m.score;
+            continue;
+        }
+        ZNode *node = znode_new(m.name, m.len, m.score);
+        hm_insert(&zset->hmap, &node->hmapNode);
+        zset->node_mem += mem_usable(node);
+        pairs.push_back(BPair{0, node});
+        added++;
+    }
+
+    // sort by (score, name) and rebuild
+    for (BPair &p : pairs) {
+        p.score = p.item->score;
+    }
+    std::sort(pairs.begin(), pairs.end(), bpair_less);
+    bt_build(&zset->tree, pairs.data(), pairs.size());
 
+    return added;
+}
+
+// returns false if the member does not exist
+bool zset_remove(ZSet *zset, const char *name, size_t len) {
+    if (!zset->is_tree) {
+        int64_t off = zarr_find(zset, name, len);
+        if (off < 0) {
+            return false;
+        }
+        zarr_remove(zset, (uint32_t)off);
+        return true;
+    }
+
+    ZNode *node = zset_lookup(zset, name, len);
+    if (!node) {
+        return false;
+    }
+    zset_delete(zset, node);
     return true;
 }
 
-void zset_delete(ZSet *zset, ZNode *node) {
-    // remove from hashtable
-    HKey key;
-    key.len = node->len;
-    key.name = node->name;
-    key.node.hcode = node->hmapNode.hcode;
+// returns false if the member does not exist
+bool zset_score(ZSet *zset, const char *name, size_t len, double &score) {
+    if (!zset->is_tree) {
+        int64_t off = zarr_find(zset, name, len);
+        if (off < 0) {
+            return false;
+        }
+        score = zarr_score(zset->arr + off);
+        return true;
+    }
 
-    HNode *found = hm_delete(&zset->hmap, &key.node, &hcmp);
-    assert(found);
+    ZNode *node = zset_lookup(zset, name, len);
+    if (!node) {
+        return false;
+    }
+    score = node->score;
+    return true;
+}
 
-    // remove from tree
-    zset->root = avl_del(&node->treeNode);
+// 0-based position of a member in (score, name) order,
+// returns false if the member does not exist
+bool zset_rank(ZSet *zset, const char *name, size_t len, size_t &rank) {
+    if (!zset->is_tree) {
+        int64_t off = zarr_find(zset, name, len);
+        if (off < 0) {
+            return false;
+        }
+        const char *p = zset->arr + off;
+        uint32_t idx = 0, pos = 0;
+        zarr_seek(zset, zarr_score(p), name, len, idx, pos);
+        rank = idx;
+        return true;
+    }
 
-    // deallocate node
-    znode_del(node);
+    ZNode *node = zset_lookup(zset, name, len);
+    if (!node) {
+        return false;
+    }
+    rank = bt_rank(&zset->tree, node->score, name, len);
+    return true;
+}
+
+// number of members with a score below `score`, or not above it if
+// `inclusive`, so [rank(min), rank(max)) is a score range
+size_t zset_rank_score(ZSet *zset, double score, bool inclusive) {
+    if (zset->is_tree) {
+        return bt_rank_score(&zset->tree, score, inclusive);
+    }
+
+    size_t rank = 0;
+    for (uint32_t off = 0; off < zset->arr_used; rank++) {
+        const char *p = zset->arr + off;
+        double s = zarr_score(p);
+        if (inclusive ? s > score : s >= score) {
+            break;
+        }
+        off += zarr_size(p);
+    }
+    return rank;
+}
+
+// ------------------ Iterators ------------------------
+
+bool ziter_valid(const ZIter &it) {
+    return it.zset->is_tree ? it.bt.leaf != NULL : it.idx < it.zset->arr_n;
+}
+
+ZMember ziter_get(const ZIter &it) {
+    if (it.zset->is_tree) {
+        ZNode *node = bt_item(it.bt);
+        return ZMember{node->score, node->name, node->len};
+    }
+    const char *p = it.zset->arr + it.off;
+    return ZMember{zarr_score(p), zarr_name(p), zarr_len(p)};
+}
+
+void ziter_next(ZIter &it) {
+    if (it.zset->is_tree) {
+        bt_next(it.bt);
+    } else if (ziter_valid(it)) {
+        it.off += (uint32_t)zarr_size(it.zset->arr + it.off);
+        it.idx++;
+    }
+}
+
+void ziter_prev(ZIter &it) {
+    if (it.zset->is_tree) {
+        bt_prev(it.bt);
+    } else if (it.idx == 0) {
+        it.idx = it.zset->arr_n; // invalid
+    } else if (ziter_valid(it)) {
+        it.off -= (uint32_t)zarr_prev_size(it.zset->arr + it.off);
+        it.idx--;
+    }
+}
+
+// the member at a 0-based rank, invalid if out of range
+ZIter zset_at(ZSet *zset, size_t rank) {
+    ZIter it;
+    it.zset = zset;
+    if (zset->is_tree) {
+        it.bt = bt_at(&zset->tree, rank);
+    } else if (rank >= zset->arr_n) {
+        it.idx = zset->arr_n;
+    } else if (rank < zset->arr_n / 2) {
+        for (; it.idx < rank; it.idx++) {
+            it.off += (uint32_t)zarr_size(zset->arr + it.off);
+        }
+    } else {
+        // closer to the end, walk backwards
+        it.idx = zset->arr_n;
+        it.off = zset->arr_used;
+        while (it.idx > rank) {
+            it.off -= (uint32_t)zarr_prev_size(zset->arr + it.off);
+            it.idx--;
+        }
+    }
+    return it;
 }
 
 // Seek to the first pair where pair >= (score, name)
-ZNode *zset_seek(ZSet *zset, double score, const char *name, size_t len) {
-    AVLNode *found = NULL;
-    for (AVLNode *node = zset->root; node;) {
-        if (z_cmp_less(node, score, name, len)) {
-            node = node->right;
-        } else {
-            found = node; // candidate
-            node = node->left;
+ZIter zset_seek(ZSet *zset, double score, const char *name, size_t len) {
+    ZIter it;
+    it.zset = zset;
+    if (zset->is_tree) {
+        it.bt = bt_seek(&zset->tree, score, name, len);
+    } else {
+        zarr_seek(zset, score, name, len, it.idx, it.off);
+    }
+    return it;
+}
+
+// Move to the n-th successor/predecessor (offset)
+ZIter zset_offset(ZIter it, int64_t offset) {
+    if (!ziter_valid(it)) {
+        return it;
+    }
+    ZSet *zset = it.zset;
+
+    if (!zset->is_tree) {
+        int64_t target = (int64_t)it.idx + offset;
+        return zset_at(zset, target >= 0 ? (size_t)target : zset->arr_n);
+    }
+
+    // stay within the leaf
+    int64_t pos = (int64_t)it.bt.pos + offset;
+    if (pos >= 0 && pos < (int64_t)it.bt.leaf->hdr.n) {
+        it.bt.pos = (uint32_t)pos;
+        return it;
+    }
+
+    // otherwise go by rank
+    ZNode *node = bt_item(it.bt);
+    int64_t rank =
+        (int64_t)bt_rank(&zset->tree, node->score, node->name, node->len) +
+        offset;
+    return zset_at(zset, rank >= 0 ? (size_t)rank : zset->tree.size);
+}
+
+// ------------------ Range Removal ------------------------
+
+// Remove the members ranked [lo, hi), lo < hi <= size. An array set is
+// changed in place. A tree set has the range cut out of the B+tree in
+// O(log n) and pushed as its newest trim, which is returned: its members
+// are gone from ranges and lookups, but still take memory and hashtable
+// slots until purged. Until then the set's tree also counts the bytes
+// of the trim's nodes.
+ZTrim *zset_remove_range(ZSet *zset, size_t lo, size_t hi) {
+    if (!zset->is_tree) {
+        uint32_t begin = zset_at(zset, lo).off;
+        uint32_t end =
+            hi < zset->arr_n ? zset_at(zset, hi).off : zset->arr_used;
+        memmove(zset->arr + begin, zset->arr + end, zset->arr_used - end);
+        zset->arr_used -= end - begin;
+        zset->arr_n -= (uint32_t)(hi - lo);
+        return NULL;
+    }
+
+    ZTrim *trim = new (mem_alloc(sizeof(ZTrim))) ZTrim();
+    BTree tail;
+    bt_split(&zset->tree, hi, &tail);
+    bt_split(&zset->tree, lo, &trim->tree);
+    bt_join(&zset->tree, &tail);
+
+    trim->next = zset->trims;
+    zset->trims = trim;
+    zset->trimmed += trim->tree.size;
+    return trim;
+}
+
+// Unlink up to `max` members of the newest trim from the hashtable.
+// Returns the trim once it is done, taken off the set, to be freed with
+// ztrim_free().
+ZTrim *zset_purge(ZSet *zset, size_t max) {
+    ZTrim *trim = zset->trims;
+    BIter it = bt_at(&trim->tree, trim->purged);
+    for (; it.leaf && max > 0; max--) {
+        if (it.pos == 0) {
+            trim->leaf_mem += mem_usable(it.leaf);
+        }
+        ZNode *node = bt_item(it);
+        HNode *found = hm_delete(&zset->hmap, &node->hmapNode, &hnode_same);
+        assert(found);
+
+        size_t mem = mem_usable(node);
+        zset->node_mem -= mem;
+        trim->node_mem += mem;
+        trim->purged++;
+        bt_next(it);
+    }
+
+    if (it.leaf) {
+        return NULL;
+    }
+    zset->trims = trim->next;
+    zset->trimmed -= trim->tree.size;
+
+    // move the count of the tree nodes over from the set
+    trim->tree.mem = trim->leaf_mem +
+                     bt_inner_mem(trim->tree.root, bt_height(trim->tree.root));
+    zset->tree.mem -= trim->tree.mem;
+    return trim;
+}
+
+// bytes counted by a trim: its members move over from the set as they
+// are purged, its tree nodes once all are
+size_t ztrim_mem(ZTrim *trim) {
+    return sizeof(ZTrim) + trim->tree.mem + trim->node_mem;
+}
+
+// free a trim and its members
+void ztrim_free(ZTrim *trim) {
+    for (BIter it = bt_at(&trim->tree, 0); it.leaf;) {
+        ZNode *node = bt_item(it);
+        bt_next(it);
+        znode_del(node);
+    }
+    bt_clear(&trim->tree);
+    mem_free(trim);
+}
+
+// ------------------ Union / Intersection ------------------------
+
+// how scores of a member found in several sets are combined
+enum {
+    ZAGG_SUM = 0,
+    ZAGG_MIN = 1,
+    ZAGG_MAX = 2,
+};
+
+const char *k_zset_aggregates[] = {"sum", "min", "max"};
+
+double zset_aggregate(double a, double b, int agg) {
+    if (agg == ZAGG_MIN) {
+        return std::min(a, b);
+    } else if (agg == ZAGG_MAX) {
+        return std::max(a, b);
+    }
+    double sum = a + b;
+    return std::isnan(sum) ? 0 : sum; // inf + -inf
+}
+
+// free the nodes of a hashtable not indexed by any tree
+void zset_free_nodes(HMap *hmap) {
+    for (size_t pos = 0; HNode **from = hm_bucket(hmap, pos); pos++) {
+        for (HNode *node = *from; node;) {
+            HNode *next = node->next;
+            znode_del(container_of(node, ZNode, hmapNode));
+            node = next;
         }
     }
-    return found ? container_of(found, ZNode, treeNode) : NULL;
+    hm_clear(hmap);
 }
 
-// Iterate to the n-th successor/predecessor (offset)
-ZNode *znode_offset(ZNode *node, int64_t offset) {
-    AVLNode *tnode = node ? avl_offset(&node->treeNode, offset) : NULL;
-    return tnode ? container_of(tnode, ZNode, treeNode) : NULL;
+// Weighted union, or intersection if `inter`, of `n` sets into the
+// empty set `out`. The inputs are only walked in order, never looked up
+// by name (lookups help rehashing), so reading them changes nothing and
+// can be done off the event loop while they are read there too.
+void zset_combine(ZSet *out, ZSet *const *in, const double *weights, size_t n,
+                  int agg, bool inter) {
+    // an intersection starts from the smallest set
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    if (inter) {
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return zset_size(in[a]) < zset_size(in[b]);
+        });
+    }
+
+    // members so far by name, with their aggregated scores, in a
+    // table sized up front: short chains and no rehashing
+    HMap acc;
+    size_t most = inter && n ? zset_size(in[order[0]]) : 0;
+    for (size_t i = 0; !inter && i < n; i++) {
+        most += zset_size(in[i]);
+    }
+    hm_reserve(&acc, most);
+
+    for (size_t k = 0; k < n; k++) {
+        ZSet *zset = in[order[k]];
+        double weight = weights[order[k]];
+        HMap found; // intersection: members also in this set
+        if (inter && k > 0) {
+            hm_reserve(&found, hm_size(&acc));
+        }
+
+        for (ZIter it = zset_at(zset, 0); ziter_valid(it); ziter_next(it)) {
+            ZMember m = ziter_get(it);
+            double score = weight * m.score;
+            if (std::isnan(score)) {
+                score = 0; // 0 * inf
+            }
+
+            if (k == 0) {
+                // names are unique within a set
+                ZNode *node = znode_new(m.name, m.len, score);
+                hm_insert(&acc, &node->hmapNode);
+                continue;
+            }
+
+            HKey key;
+            key.node.hcode = str_hash((uint8_t *)m.name, m.len);
+            key.name = m.name;
+            key.len = m.len;
+
+            if (inter) {
+                if (HNode *hit = hm_delete(&acc, &key.node, &hcmp)) {
+                    ZNode *node = container_of(hit, ZNode, hmapNode);
+                    node->score = zset_aggregate(node->score, score, agg);
+                    hm_insert(&found, hit);
+                }
+            } else if (HNode *hit = hm_lookup(&acc, &key.node, &hcmp)) {
+                ZNode *node = container_of(hit, ZNode, hmapNode);
+                node->score = zset_aggregate(node->score, score, agg);
+            } else {
+                ZNode *node = znode_new(m.name, m.len, score);
+                hm_insert(&acc, &node->hmapNode);
+            }
+        }
+
+        if (inter && k > 0) {
+            zset_free_nodes(&acc); // missing from this set
+            acc = found;
+        }
+        if (inter && hm_size(&acc) == 0) {
+            break;
+        }
+    }
+
+    // order the result
+    std::vector<BPair> pairs;
+    pairs.reserve(hm_size(&acc));
+    size_t node_mem = 0;
+    bool fits = hm_size(&acc) <= (uint64_t)g_config.zset_max_array_entries;
+    for (size_t pos = 0; HNode **from = hm_bucket(&acc, pos); pos++) {
+        for (HNode *hnode = *from; hnode; hnode = hnode->next) {
+            ZNode *node = container_of(hnode, ZNode, hmapNode);
+            pairs.push_back(BPair{node->score, node});
+            node_mem += mem_usable(node);
+            fits = fits && node->len <= (uint64_t)g_config.zset_max_array_value;
+        }
+    }
+    std::sort(pairs.begin(), pairs.end(), bpair_less);
+
+    if (fits) {
+        for (const BPair &p : pairs) {
+            zarr_insert(out, p.item->name, p.item->len, p.score);
+        }
+        zset_free_nodes(&acc);
+    } else {
+        // keep the nodes, index them with a tree built bottom-up
+        out->is_tree = true;
+        out->hmap = acc;
+        out->node_mem = node_mem;
+        bt_build(&out->tree, pairs.data(), pairs.size());
+    }
 }
 
 // ---------------- Helper Functions ------------------
@@ -145,57 +792,80 @@ bool hcmp(HNode *node, HNode *key) {
     return memcmp(znode->name, hkey->name, znode->len) == 0;
 }
 
-// zset tuple comparison
-bool zless(AVLNode *lhs, AVLNode *rhs) {
-    ZNode *zl = container_of(lhs, ZNode, treeNode);
-    ZNode *zr = container_of(rhs, ZNode, treeNode);
+// hcmp() for a ZKey, skipping trimmed members
+bool hcmp_live(HNode *node, HNode *key) {
+    ZKey *zkey = container_of(container_of(key, HKey, node), ZKey, key);
+    return hcmp(node, key) &&
+           !zset_trimmed(zkey->zset, container_of(node, ZNode, hmapNode));
+}
 
-    if (zl->score != zr->score) {
-        return zl->score < zr->score;
+// zset tuple comparison
+bool zpair_less(double lscore, const char *lname, size_t llen, double rscore,
+                const char *rname, size_t rlen) {
+    if (lscore != rscore) {
+        return lscore < rscore;
     }
 
-    int rv = memcmp(zl->name, zr->name, std::min(zl->len, zr->len));
-    return (rv != 0) ? (rv < 0) : (zl->len < zr->len);
+    int rv = memcmp(lname, rname, std::min(llen, rlen));
+    return (rv != 0) ? (rv < 0) : (llen < rlen);
 }
 
 // zset component compare
-bool z_cmp_less(AVLNode *lhs, double score, const char *name, size_t len) {
-    ZNode *zl = container_of(lhs, ZNode, treeNode);
+bool zless(ZNode *node, double score, const char *name, size_t len) {
+    return zpair_less(node->score, node->name, node->len, score, name, len);
+}
 
-    if (zl->score != score) {
-        return zl->score < score;
-    }
+// destroy the zset
+void zset_clear(ZSet *zset) {
+    mem_free(zset->arr);
 
-    int rv = memcmp(zl->name, name, std::min(zl->len, len));
-    return (rv != 0) ? (rv < 0) : (zl->len < len);
+    // free the members, then the tree
+    for (BIter it = bt_at(&zset->tree, 0); it.leaf;) {
+        ZNode *node = bt_item(it);
+        bt_next(it);
+        znode_del(node);
+    }
+    bt_clear(&zset->tree);
+    while (ZTrim *trim = zset->trims) {
+        zset->trims = trim->next;
+        ztrim_free(trim);
+    }
+    hm_clear(&zset->hmap);
+    *zset = ZSet{};
 }
 
-void tree_insert(ZSet *zset, ZNode *znode) {
-    AVLNode *parent = NULL;
-    AVLNode **from = &zset->root;
+// Move the tree nodes and members of the leaf holding `rank` out of
+// sparse slabs, then advance `rank` past it. False past the last leaf.
+bool zset_defrag_leaf(ZSet *zset, size_t &rank, size_t &moved) {
+    BLeaf *leaf = bt_defrag_path(&zset->tree, rank, moved);
+    if (!leaf) {
+        return false;
+    }
 
-    while (*from) {
-        parent = *from;
-        from = zless(&znode->treeNode, parent) ? &parent->left : &parent->right;
+    for (uint32_t i = 0; i < leaf->hdr.n; i++) {
+        ZNode *node = leaf->items[i];
+        ZNode *copy = (ZNode *)mem_defrag(node);
+        if (!copy) {
+            continue;
+        }
+        // fix the hash chain, the leaf slot and inner keys
+        *hm_ref(&zset->hmap, &node->hmapNode, copy->hmapNode.hcode) =
+            &copy->hmapNode;
+        bt_relocate(&zset->tree, node, copy, copy->score, copy->name,
+                    copy->len);
+        moved++;
     }
 
-    *from = &znode->treeNode;
-    znode->treeNode.parent = parent;
-    zset->root = avl_fix(&znode->treeNode);
+    rank += leaf->hdr.n;
+    return true;
 }
 
-void tree_dispose(AVLNode *node) {
-    if (!node) {
-        return;
+// bytes held by the zset, including its nodes and hashtable
+size_t zset_mem(ZSet *zset) {
+    size_t mem = sizeof(ZSet) + zset->arr_cap + zset->node_mem +
+                 zset->tree.mem + hm_mem(&zset->hmap);
+    for (ZTrim *trim = zset->trims; trim; trim = trim->next) {
+        mem += ztrim_mem(trim);
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, treeNode));
+    return mem;
 }
-
-// destroy the zset
-void zset_clear(ZSet *zset) {
-    hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
-    zset->root = NULL;
-}
\ No newline at end of file